@@ -30,7 +30,9 @@
 #include <cedar/jit.h>
 #include <cedar/object/symbol.h>
 #include <cedar/ref.h>
+#include <exception>
 #include <map>
+#include <string>
 #include <vector>
 
 namespace cedar {
@@ -74,11 +76,12 @@ namespace cedar {
     // values to the stack. It also knows how big any closure is ahead of time,
     // so all of this can be done statically in x86 machine code.
     //
-    // In the case where a closure does occur, all functions after it must also
-    // have a closure to support walking up the closure chain to find the
-    // variable it needs. If a function has 0 arguments in a closure, it can
-    // simply inherit the closure from the parent to save A) allocation, and
-    // B) expensive closure walking.
+    // A scope only allocates a closure if something in it escapes, and a
+    // scope with nothing in a closure simply inherits the one from its
+    // parent. Closures keep a display of the whole chain (see closure in
+    // object/lambda.h), so a variable is found by the depth of its scope's
+    // closure and its index in it, without walking the chain and without
+    // every scope in between needing a closure of its own.
     //
     // Variables will be further abstracted in the compiler with abstract
     // classes for where they are stored. Variables will have a `.access(cc)`
@@ -145,9 +148,12 @@ namespace cedar {
       scope *parent;
       module *mod;
       function_node *func;
+      // how many of the variables escape, and how many don't
       int closure_size;
-      int closure_index;
       int stack_size;
+      // the depth of this scope's closure in the closure chain, if it
+      // allocates one (see finalize)
+      int closure_index;
       bool allocate_closure = false;
       std::vector<scope*> children;
       std::vector<var *> vars;
@@ -215,6 +221,9 @@ namespace cedar {
         return_,
         scope_,
         math_op,
+        recur,
+        eval,
+        context,
       };
 
       node_type type = unknown;
@@ -415,26 +424,42 @@ namespace cedar {
 
 
 
-    // (. obj <attrs...> [(call ...)])
+    // (. obj a (b x y) c := v)
     // the dot node allows syntax to deeply nest into an object by getting
-    // attributes and optionally finally call a method
-    // so (. "hello" (len)) or len('hello') in python, expands into
-    // - obj = "hello"
-    // - attrs = [intern('len')]
-    // - has_call = true (call the last attr)
-    // - call_args = [] // has an implicit self argument of the form `(len
-    // self)` the implicit self is why the call portion exists here. It allows
-    // the compiler to optimize the 'self' access and limit lookups.
+    // attributes, calling methods and finally optionally setting an
+    // attribute. Each step works on the value of the one before it, so the
+    // example above expands into
+    // - obj = obj
+    // - steps = [get a, call b with (x y), set c to v]
+    // A method call passes the object as the implicit self argument, like
+    // the bytecode compiler's INVOKE does
     struct dot_node : public node {
+      struct step {
+        uint64_t id;
+        bool call = false;
+        std::vector<node *> args;
+        // the value of a `:=`, which ends the chain
+        node *val = nullptr;
+      };
       node *obj;
-      std::vector<uint64_t> attrs;
-      bool has_call;
-      std::vector<node *> call_args;
+      std::vector<step> steps;
       node_type type = dot;
       using node::node;
       virtual std::string str() {
-        // TODO
-        std::string s = "DOT";
+        std::string s = "(. ";
+        s += obj->str();
+        for (auto &st : steps) {
+          s += " ";
+          if (st.call) s += "(";
+          s += symbol::unintern(st.id);
+          for (auto a : st.args) {
+            s += " ";
+            s += a->str();
+          }
+          if (st.call) s += ")";
+          if (st.val != nullptr) s += " := " + st.val->str();
+        }
+        s += ")";
         return s;
       }
       inline virtual ~dot_node(){/* STUB */};
@@ -537,6 +562,77 @@ namespace cedar {
 
 
 
+    // (recur args...) rebinds the arguments of the function it's in and
+    // starts it over
+    struct recur_node : public node {
+      std::vector<node *> arguments;
+      using node::node;
+      node_type type = recur;
+
+      virtual std::string str() {
+        std::string s = "(recur ";
+        for (auto a : arguments) {
+          s += a->str();
+          s += " ";
+        }
+        s += ")";
+        return s;
+      }
+
+      inline virtual ~recur_node(){/* STUB */};
+    };
+
+
+    // (eval expr) compiles and runs whatever expr evaluates to
+    struct eval_node : public node {
+      node *val;
+      using node::node;
+      node_type type = eval;
+
+      virtual std::string str() { return "(eval " + val->str() + ")"; }
+
+      inline virtual ~eval_node(){/* STUB */};
+    };
+
+
+    // the symbols that name the context a function runs in instead of a
+    // variable: SELF, *module* and *func*
+    struct context_node : public node {
+      enum which {
+        self,
+        module,
+        func,
+      };
+      which what = self;
+      using node::node;
+      node_type type = context;
+
+      virtual std::string str() {
+        if (what == self) return "SELF";
+        if (what == module) return "*module*";
+        return "*func*";
+      }
+
+      inline virtual ~context_node(){/* STUB */};
+    };
+
+
+
+    // thrown by parse for a form that only makes sense in the interpreter,
+    // like the ones that park the fiber running them. Whoever wanted the
+    // AST has to compile the form with the bytecode compiler instead
+    class unsupported_form : public std::exception {
+      std::string msg;
+
+     public:
+      inline explicit unsupported_form(std::string form) {
+        msg = "the AST can't represent " + form;
+      }
+      inline const char *what() const noexcept { return msg.c_str(); }
+    };
+
+
+
     node *parse(ref, module *, scope *sc = nullptr);
   }  // namespace ast
 }  // namespace cedar
@@ -25,6 +25,7 @@
 
 #pragma once
 
+#include <cedar/ref.h>
 
 namespace cedar {
 
@@ -34,5 +35,13 @@ namespace cedar {
   struct call_state {
     lambda *func;
     closure *locals;
+    // what SELF refers to while the call runs. Usually the function's own
+    // self, but methods called through OP_INVOKE get the receiver instead
+    // of being bound to it
+    ref self;
+    // the arguments, until the call's frame is pushed and they are copied
+    // into its stack slots
+    int argc;
+    ref *argv;
   };
 }
@@ -31,6 +31,7 @@
 #include <cedar/runes.h>
 #include <cedar/vm/binding.h>
 #include <cedar/native_interface.h>
+#include <atomic>
 
 namespace cedar {
 
@@ -38,17 +39,31 @@ namespace cedar {
 
   extern module *core_mod;
 
+  // binding_version is bumped every time the *layout* of a global binding
+  // table changes (a new binding, a binding changing visibility, an import,
+  // etc). Reassigning an existing binding does not bump it. The inline caches
+  // on OP_LOAD_GLOBAL hold a pointer to the binding's value cell, which never
+  // moves, and are only valid as long as this version hasn't moved on, since
+  // a new binding can shadow the one they found.
+  extern std::atomic<u64> binding_version;
+  inline void invalidate_global_caches(void) { binding_version++; }
+
   void def_global(u64, ref);
   void def_global(ref, ref);
   void def_global(runes, ref);
   void def_global(runes, bound_function);
   void def_global(runes, native_callback);
+  void def_global(runes, raw_function);
 
   bool is_global(u64);
 
   ref get_global(u64);
   ref get_global(ref);
   ref get_global(runes);
+
+  // returns a pointer to the global's value cell, or nullptr if it doesn't
+  // exist. The cell stays put for as long as the binding exists
+  ref *get_global_slot(u64);
 };
 
 
@@ -44,8 +44,14 @@
 #include <cedar/ast.h>
 #include <cedar/native_interface.h>
 #include <cedar/ref.h>
+#include <cedar/vm/binding.h>
+#include <cedar/vm/bytecode.h>
+#include <string>
 #include <vector>
+#include <deque>
+#include <unordered_map>
 #include <atomic>
+#include <exception>
 #include <mutex>
 #include <sys/mman.h>
 
@@ -54,9 +60,26 @@ namespace cedar {
   namespace ast {
     struct node;
     struct scope;
+    struct var;
+    struct number_node;
+    struct symbol_node;
+    struct context_node;
+    struct call_node;
+    struct if_node;
+    struct do_node;
+    struct def_node;
+    struct return_node;
+    struct scope_node;
+    struct function_node;
+    struct math_op_node;
+    struct dot_node;
+    struct recur_node;
+    struct eval_node;
   };
   class lambda;
   class module;
+  class closure;
+  class fiber;
   namespace jit {
 
     class compiler;
@@ -69,91 +92,329 @@ namespace cedar {
     using mem = X86Mem;
 
 
+    struct ast_function;
+
+    // an inline cache for a global the AST JIT loads
+    struct ast_global_site {
+      u64 id = 0;
+      std::atomic<vm::global_cache *> cache{nullptr};
+    };
+
     /**
      * A code_handle allows the GC to cleanup jit pages after they are
-     * done being used. It basically just stores a void* and has an apply()
-     * method that allows the calling of that code
+     * done being used. It basically just stores a void* to the code, and
+     * anything the code points at that has to live as long as it does
      */
     class code_handle : public gc_cleanup {
-      ref expr;
-      module *mod;
+      friend class compiler;
       size_t size = 0;
-      std::atomic<int> calls = 0;
-      std::atomic<bool> compiled;
-      std::mutex compile_lock;
       void *code = nullptr;
      public:
-      using jit_function_handle = void (*)(const function_callback &);
+      // the constants, inline caches and functions of code compiled by the
+      // AST JIT. Deques, so nothing moves as they grow
+      std::deque<ref> constants;
+      std::deque<ast_global_site> globals;
+      std::deque<vm::attr_cache> attrs;
+      std::vector<ast_function *> functions;
+      // AST nodes the code hands to helpers at runtime
+      std::vector<ast::node *> nodes;
+      // the code this replaced after a deoptimization. Other threads may
+      // still be running it, so it stays mapped as long as this does
+      code_handle *previous = nullptr;
+
       code_handle(void* c, size_t s);
-      code_handle(ref, module*);
       ~code_handle(void);
 
-      void apply(const function_callback &cb);
-
+      // take ownership of some mapped code, which is unmapped when the GC
+      // collects the handle
+      void adopt(void *c, size_t s);
     };
 
 
+    // compile a top level form with the AST JIT. Forms the AST can't
+    // represent are compiled with the bytecode compiler instead, so this
+    // always gives back something that can be called with no arguments
     lambda *compile(ref, module *);
     lambda *compile(cedar::runes, module *);
-
-
-
-
-    struct stkregion {
-      short ind = 0;
-      bool used = false;
-      short size = 0;
-      reg ptr;
+    // compile a form like compile() and run it, like cedar::eval does
+    ref eval(ref, module *);
+
+
+    // how deep native calls can nest on one thread. Calls past it stay in
+    // the interpreter, which keeps its frames on the heap. Code from the AST
+    // JIT has no interpreter to go to, so it throws instead
+#define JIT_MAX_DEPTH 1024
+
+    // the state of a call to code compiled by the baseline JIT. The
+    // generated code addresses the operand stack at fixed offsets from
+    // `stack`, and calls back into the runtime (see jit/baseline.cpp) for
+    // anything it doesn't inline
+    struct native_frame {
+      lambda *fn;
+      vm::bytecode *code;
+      module *mod;
+      ref self;
+      // the closure LOAD_LOCAL and SET_LOCAL work on, and the one the call
+      // started with, which recur goes back to
+      closure *locals;
+      closure *entry_locals;
+      fiber *fib;
+      ref *slots;
+      ref *stack;
+      ref result;
+      // exceptions can't unwind through generated code, so the runtime
+      // helpers park them here and the code returns right away
+      std::exception_ptr error;
+      // the native frame that made this call, when native code did, and
+      // where this frame picks up (after the call it is making) if it is
+      // handed back to the interpreter. See hand_back in jit/baseline.cpp
+      native_frame *caller;
+      u64 resume_address;
+      int resume_depth;
+      int handback;
+      // set once the call has been handed back, so the code stops
+      bool handed_back;
+      // the fiber's reductions, which native calls and back edges spend
+      // like the interpreter's do
+      int *reductions;
     };
 
-    class compiler {
-     protected:
-      ref base_obj;
-      FileLogger logger;
-      CodeHolder code;
-      X86Compiler cc;
-      reg cb;
-      mem stk;
+    // how a native call can give what's left of it back to the interpreter
+    // of the fiber it runs on, when it needs something only the interpreter
+    // can do (like park the fiber)
+    enum handback_mode {
+      // it can't, C++ code made the call. Native code called by native code
+      // goes through its caller
+      handback_none,
+      // the fiber's top frame made the call, and the rest of it goes in
+      // frames pushed above that one
+      handback_push,
+      // the call is the fiber's top frame, which went native at a recur
+      // and picks up where the native code leaves it
+      handback_replace,
+    };
 
-      module *mod;
-      // 4 byte alignment on the stack is pretty typical
-      int alignment = 4;
-      // a vector of length 'words' that keeps track of which
-      // word of the stack is allocated or not
-      std::vector<bool> regions;
-      // how many 'regions' of memory to allocate onto the end of the region
-      // list. Returns the index to the base region
-      int sbrk(int region_count);
-      void init(void);
+    // a resume_address for a call that can't be picked up after
+#define JIT_NO_RESUME ((u64)-1)
 
-     public:
-      explicit compiler(ref);
-      explicit compiler(std::string);
+    extern thread_local int native_depth;
 
-      // run the compiler, returning code pointer, filling in the size
-      void *run(module *, size_t*);
+    // how much code can be waiting for the compile thread. Code that turns
+    // hot while the queue is full stays in the interpreter, and is queued
+    // the next time it gets hot
+#define JIT_QUEUE_SIZE 64
 
+    // hand a hot function's bytecode to the compile thread for the baseline
+    // JIT, unless it has been tried already. Callers keep interpreting until
+    // the native code is swapped in. Does nothing when CDRNOJIT is set, and
+    // compiles on the calling thread when CDRJITSYNC is
+    void tier_up(lambda *);
 
-      // top level compile function, takes a dst register and any ast::node
-      void compile_node(reg dst, ast::node *obj);
+    // a function inside some native code, for profilers and debuggers
+    struct code_symbol {
+      std::string name;
+      size_t offset;
+      size_t size;
+    };
 
-      void compile_nil(reg dst);
-      void compile_number(reg dst, ast::node *obj);
-      void compile_symbol(reg dst, ast::node *obj);
-      void compile_call(reg dst, ast::node *obj);
-      void compile_if(reg dst, ast::node *obj);
+    // describe freshly mapped code to the outside world. With CDRPERFMAP set
+    // every symbol is written to /tmp/perf-<pid>.map for perf, and with
+    // CDRGDBJIT set the code is registered through gdb's JIT interface
+    void describe_code(void *code, size_t size,
+                       const std::vector<code_symbol> &);
+    // unregister code from gdb before it is unmapped
+    void forget_code(void *code);
+    // is anything listening to describe_code. Naming code isn't free
+    bool describing(void);
+    // the name a function's native code goes by: its name, or a bit of the
+    // form that defined it, and the file it came from
+    std::string code_name(ref name, ref defining, module *);
+
+    // where --jit-dump writes the assembly of everything compiled. Empty
+    // when it isn't dumping
+    extern std::string dump_dir;
+    // open a new file in the dump directory for the assembly of the named
+    // code. Returns nullptr when not dumping
+    FILE *open_dump(const std::string &name);
+
+    // counters for the compile thread and the code it makes
+    struct jit_stats {
+      std::atomic<u64> queued{0};
+      std::atomic<u64> compiled{0};
+      std::atomic<u64> failed{0};
+      // tier ups turned away by a full queue
+      std::atomic<u64> dropped{0};
+      // guards that failed and sent a call back to the interpreter
+      std::atomic<u64> deopts{0};
+      std::atomic<u64> queue_depth{0};
+      // total time spent compiling
+      std::atomic<u64> compile_ns{0};
+      // bytes of native code currently mapped
+      std::atomic<u64> code_bytes{0};
+    };
+    extern jit_stats stats;
+
+    // can a call to this bytecode go straight to native code
+    inline bool can_enter(vm::bytecode *code) {
+      return code->native.load(std::memory_order_acquire) != nullptr &&
+             native_depth < JIT_MAX_DEPTH;
+    }
+
+    // call a function whose bytecode has been compiled. Sets up the frame
+    // the way the interpreter's call path does and returns the result
+    ref call_native(lambda *, ref self, int argc, ref *argv, fiber *);
+
+    // call_native for the interpreter's CALL, which has stored its frame
+    // with the callee and arguments already off the stack. Returns true
+    // with the result in *result, or false if the native code handed the
+    // rest of the call back: its frames have been pushed on the fiber for
+    // the interpreter to carry on with
+    bool enter_native(lambda *, ref self, int argc, ref *argv, fiber *,
+                      ref *result);
+
+    // on-stack replacement at a recur, which is the only way bytecode
+    // loops: the rest of a call the interpreter is running goes to native
+    // code. A recur starts the function over at the top, which is where the
+    // native code starts too, so all that carries over from the interpreter's
+    // frame is the closure it started with and the recur's arguments.
+    // Returns true with the call's result in *result, or false if the
+    // native code handed the loop back, with the fiber's top frame set up
+    // to carry on from where it stopped (see enter_native)
+    bool enter_at_recur(lambda *, ref self, closure *locals, int argc,
+                        ref *argv, fiber *, ref *result);
+
+
+
+
+    // call the function at base[0] with the argc arguments above it,
+    // leaving the result in base[0]. This is the interpreter's CALL_BODY for
+    // native code: self_ptr is the receiver of a method call, and self is
+    // what natively bound functions get otherwise
+    void call_value(ref *base, int argc, ref *self_ptr, ref self, fiber *,
+                    module *);
+
+    // if a global is bound to one of the core's comparisons, that lambda.
+    // Code inlining the comparison has to check the callee is still that
+    // lambda
+    lambda *core_comparison_global(u64 id, vm::comparison *);
+
+
+
+
+    // the state of a call to a function compiled by the AST JIT, the
+    // counterpart of native_frame. The arguments, the variables of every
+    // scope* that don't escape and the temporaries all have a slot
+    struct ast_frame {
+      ast_function *fn;
+      // the lambda that was called, for *func*
+      lambda *func;
+      module *mod;
+      ref self;
+      // the closure escaping variables are in, and the one the function
+      // closed over, which recur starts from again
+      closure *env;
+      closure *outer;
+      fiber *fib;
+      ref *slots;
+      ref result;
+      // exceptions can't unwind through generated code, so the runtime
+      // helpers park them here and the code returns right away
+      std::exception_ptr error;
+    };
 
-      void compile_scope_init(ast::scope *);
-      void compile_function(reg dst, ast::node *obj);
+    // a function (or a top level form) the AST JIT compiled
+    struct ast_function {
+      void (*code)(ast_frame *) = nullptr;
+      // the code this is part of, which the lambdas made from it keep alive.
+      // Nothing else points at it once the compiler is done
+      code_handle *handle = nullptr;
+      ref name;
+      int argc = 0;
+      bool vararg = false;
+      int slot_count = 0;
+      // how many arguments escape, and where each argument goes: a slot, or
+      // an index in the function's closure
+      int closure_size = 0;
+      std::vector<int> arg_slot;
+      std::vector<int> arg_closure;
+    };
 
 
-      void compile_string(reg dst, ast::node *obj);
+    // compiles a top level form from its AST into one block of machine
+    // code, with every function in the form after the form itself. The
+    // code works on refs in the frame's slots, inlines int and float
+    // arithmetic, branches and comparisons, and calls into the runtime
+    // helpers in jit/compiler.cpp for everything else
+    class compiler {
+      // a function waiting to be compiled. The top level form has no node
+      struct pending {
+        ast::function_node *node;
+        ast::node *body;
+        ast_function *fn;
+        CCFunc *func;
+      };
 
-      void dump_stack(void);
+      module *mod;
+      CodeHolder holder;
+      X86Compiler cc;
+      code_handle *handle;
+      std::vector<pending> work;
+
+      // the function being compiled
+      ast_function *fn = nullptr;
+      reg frame;
+      reg slots;
+      Label start;
+      Label bail;
+      int slot_top = 0;
+      std::unordered_map<ast::var *, int> var_slots;
+
+      // take n slots off the top of the frame, or give them back
+      int push_slots(int n);
+      void pop_slots(int n);
+
+      mem value(int slot);
+      mem flags(int slot);
+      void copy(reg dst, int doff, reg src, int soff);
+      void copy_slot(int dst, int src);
+      void store_value(int slot, i64 bits, u8 flags);
+      reg call_helper(void *helper, int slot, i64 a, i64 b);
+
+      void emit_function(pending);
 
-      stkregion salloc(short size);
-      // release a stack region. Like free but at compile time and statically
-      void sfree(stkregion &);
+     public:
+      explicit compiler(module *);
+
+      // compile a form, and return the lambda that runs it. Throws
+      // ast::unsupported_form if the form needs the interpreter
+      lambda *run(ref);
+
+
+      // top level compile function, takes a dst slot and any ast::node
+      void compile_node(int dst, ast::node *obj, bool tail);
+
+      void compile_number(int dst, ast::number_node *);
+      void compile_constant(int dst, ref);
+      void compile_symbol(int dst, ast::symbol_node *);
+      void compile_context(int dst, ast::context_node *);
+      void compile_call(int dst, ast::call_node *, bool tail);
+      void compile_if(int dst, ast::if_node *, bool tail);
+      void compile_do(int dst, ast::do_node *, bool tail);
+      void compile_def(int dst, ast::def_node *);
+      void compile_return(int dst, ast::return_node *);
+      void compile_scope(int dst, ast::scope_node *, bool tail);
+      void compile_function(int dst, ast::function_node *);
+      void compile_math_op(int dst, ast::math_op_node *);
+      bool compile_float_tree(int dst, ast::math_op_node *);
+      X86Xmm float_expr(ast::node *, int leaves, size_t &next);
+      void compile_dot(int dst, ast::dot_node *);
+      void compile_recur(ast::recur_node *);
+      void compile_eval(int dst, ast::eval_node *);
+
+      // branch to target if the value in a slot is false
+      void jump_if_false(int slot, Label target);
+      // dst = dst op rhs, inline for ints and floats
+      void arith(char op, int dst, int rhs);
     };
 
   }  // namespace jit
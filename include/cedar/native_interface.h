@@ -90,6 +90,12 @@ namespace cedar {
 
 
   using native_callback = std::function<void(const function_callback &)>;
+
+  // the fixed native calling convention. The VM calls these directly with
+  // the arguments where they sit on its stack, so there's no std::function,
+  // no captures and no function_callback to build. The result goes in *ret
+  using raw_function = void (*)(int argc, ref *argv, ref self, fiber *fib,
+                                ref *ret);
 }  // namespace cedar
 
 #endif
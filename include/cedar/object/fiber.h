@@ -37,18 +37,42 @@ namespace cedar {
   class scheduler;
   namespace vm {
     class machine;
+    union threaded_word;
   }
 
 
+  // frames live back to back in the fiber's frame stack, the caller of a
+  // frame is always the one directly below it
   struct frame {
     call_state call;
-    frame *caller;
+    // the base of this frame's stack slots, which hold the locals that
+    // don't escape into a closure. The operand stack starts right after
+    // them, and never goes deeper than bp + code->slot_count +
+    // code->stack_size, which bind_frame reserves
+    int bp;
     int sp;
-    u8 *ip;
+    // points into the bytecode's threaded code, nullptr until it's loaded
+    vm::threaded_word *ip;
+    // the instance a type's new method is running on, when the frame was
+    // pushed to construct an object. Returning from the frame gives this
+    // back instead of new's return value
+    ref constructing;
+    // the closure the frame started with, before any scope* pushed onto
+    // it. recur binds the captured arguments into it again
+    closure *entry_locals;
+    // the bytecode address the frame starts running at when the
+    // interpreter first loads it, or -1 for the start. Set for calls native
+    // code hands back part way through (see fiber::resume_call)
+    i64 resume;
   };
 
   enum fiber_state { RUNNING, STOPPED, PARKED, BLOCKING, SLEEPING };
 
+// how many calls (and recurs) a fiber makes before it checks if its worker
+// wants it to yield. Keeps the check off the hot path without letting a
+// fiber overstay its time slice by much
+#define REDUCTION_BUDGET 2000
+
 
   class fiber : public object {
 
@@ -58,14 +82,16 @@ namespace cedar {
     int stack_size = 0;
     ref *stack = nullptr;
 
-    // the frame list is a linked list, where the first element
-    // is the newest call stack and the last frame in the list
-    // is the initial function. Nullptr means to return from the
-    // fiber and mark it as done
+    // the frame stack is a contiguous array of frames that only grows, so
+    // a call/return pair never allocates. top_frame points at the newest
+    // frame, and nullptr means to return from the fiber and mark it as done
+    frame *frames = nullptr;
+    int frame_count = 0;
+    int frame_cap = 0;
     frame *top_frame = nullptr;
-    std::vector<frame> frames;
     void adjust_stack(int);
     frame *add_call_frame(call_state);
+    void bind_frame(frame *);
     frame *pop_call_frame(void);
     void co_run();
 
@@ -86,6 +112,7 @@ namespace cedar {
     int jid = 0;
     i64 sleep = 0;
     i64 ticks = 0;
+    // calls left until the fiber checks if it should yield
     int reductions = 0;
 
     u64 last_ran = 0;
@@ -109,11 +136,29 @@ namespace cedar {
 
     void print_callstack();
 
-    // run the fiber for at most max_ms miliseconds
-    void run(int max_ms);
+    // run the fiber until it returns, sleeps or blocks. If it's preemptible
+    // it also parks once its worker's time slice is up
+    void run(bool preemptible);
 
     // run the fiber until it returns, then return the value it yields
     ref run(void);
+
+    // pick the call in the fiber's top frame up part way through, at the
+    // instruction at address, with the function, slots, operand stack and
+    // closures native code had when it gave the call back. See
+    // jit/baseline.cpp
+    void resume_at(lambda *fn, ref self, u64 address, ref *slots,
+                   ref *operands, int depth, closure *locals,
+                   closure *entry_locals);
+    // push a frame for a call native code was part way through, and pick
+    // it up like resume_at. The frame returns to the one below it
+    void resume_call(lambda *fn, ref self, u64 address, ref *slots,
+                     ref *operands, int depth, closure *locals,
+                     closure *entry_locals);
+    // push a frame for a call native code was about to make, which the
+    // interpreter starts from the top. Returns the frame, so a constructor
+    // call can say what it is constructing
+    frame *push_call(call_state);
   };
 
 }  // namespace cedar
@@ -31,6 +31,7 @@
 #include <cedar/vm/binding.h>
 #include <cedar/vm/bytecode.h>
 #include <cedar/vm/machine.h>
+#include <atomic>
 #include <exception>
 #include <functional>
 
@@ -54,23 +55,45 @@ namespace cedar {
 
   // closure represents a wraper around closed values
   // in functions, also known as "freevars" in LC
-  // It will attempt to store things in a fixed sized
-  // array if it can, but will also allocate a vector
-  // if needed
+  //
+  // Closures form a chain back to the top level, one link per function
+  // call or scope* that captures something. The compiler knows how deep in
+  // the chain every variable's closure is, so instead of walking m_parent a
+  // closure keeps a display: the variables of every closure in its chain,
+  // indexed by depth. Any variable is one lookup away no matter how far out
+  // it was bound. A closure's display is built once, the first time
+  // something is closed under it, and every closure made under it after
+  // that shares it, so making one doesn't copy the chain
   class closure {
    public:
     i32 m_size = 0;
-    i32 m_index = 0;
+    // the number of closures above this one in the chain
+    i32 m_depth = 0;
     closure *m_parent;
     lambda *func = nullptr;
 
     std::vector<ref> m_vars;
+    // the parent's display, which holds every closure above this one
+    ref **m_outer = nullptr;
     // constructor to allocate n vars of closure space
     //
-    closure(i32, closure * = nullptr, i32 = 0);
+    closure(i32, closure * = nullptr);
     ~closure(void);
     closure *clone(void);
-    ref &at(int);
+    // a variable in this closure
+    inline ref &at(int i) { return m_vars[i]; }
+    // a variable in the closure `depth` levels down the chain from the root
+    inline ref &at(int depth, int i) {
+      if (depth == m_depth) return m_vars[i];
+      return m_outer[depth][i];
+    }
+    // the variables of every closure in the chain, this one's last
+    ref **display(void);
+
+   private:
+    // closures can be shared between fibers on different threads, so the
+    // first two to close under one can race to build this
+    std::atomic<ref **> m_display{nullptr};
   };
 
 
@@ -80,6 +103,8 @@ namespace cedar {
     enum lambda_type {
       bytecode_type,
       function_binding_type,
+      // a plain C function pointer, see raw_function
+      raw_function_type,
     };
 
     char code_type = bytecode_type;
@@ -89,11 +114,11 @@ namespace cedar {
     ref name;
     ref self = nullptr;
     ref defining;
-    i16 arg_index = 0;
     i8 argc = 0;
     bool vararg = false;
     bool macro = false;
     native_callback function_binding;
+    raw_function raw_binding = nullptr;
 
 
 
@@ -102,14 +127,20 @@ namespace cedar {
     lambda(vm::bytecode *);
     lambda(bound_function);
     lambda(native_callback);
+    lambda(raw_function);
     ~lambda(void);
     u64 hash(void);
     lambda *copy(void);
 
+    inline bool is_native(void) const { return code_type != bytecode_type; }
+
     void call(const function_callback&);
 
     call_state prime(int argc = 0l, ref *argv = nullptr);
-    void set_args_closure(closure *, int argc = 0, ref *argv = nullptr);
+    // store the arguments of a call where the function keeps them: the
+    // captured ones in the closure c, and the rest in the frame's slots.
+    // Either can be null to only fill in the other
+    void bind_args(closure *c, ref *slots, int argc = 0, ref *argv = nullptr);
   };
 
 
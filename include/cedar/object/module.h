@@ -28,6 +28,7 @@
 #include <cedar/object/lambda.h>
 #include <cedar/object/symbol.h>
 #include <flat_hash_map.hpp>
+#include <atomic>
 
 namespace cedar {
 
@@ -46,9 +47,17 @@ namespace cedar {
     enum binding_type { PRIVATE, PUBLIC };
     struct binding {
       binding_type type = PRIVATE;
-      ref val;
+      // the value lives in a cell of its own instead of in the table, so the
+      // pointers OP_LOAD_GLOBAL's caches keep to it stay good when the table
+      // rehashes. The cell is collected once nothing points at it
+      ref *cell = nullptr;
     };
     ska::flat_hash_map<intern_t, binding> m_fields;
+    // bumped whenever a binding is added to the table or given a new cell.
+    // Native code that assumes a global stays where it was found only has
+    // to watch the modules the lookup went through, not every module's
+    // changes like binding_version
+    std::atomic<u64> layout{0};
 
     module(void);
     module(std::string);
@@ -57,6 +66,7 @@ namespace cedar {
     void def(std::string, ref);
     void def(std::string, bound_function);
     void def(std::string, native_callback);
+    void def(std::string, raw_function);
 
     // set a private module field. Will only be accessed via a `find` from
     // within the same module. The way private is inforced is by making getattr
@@ -68,6 +78,9 @@ namespace cedar {
 
 
     ref find(intern_t, bool *, module *from = nullptr);
+    // same lookup rules as find, but returns a pointer to the binding's value
+    // so OP_LOAD_GLOBAL can cache it. nullptr if it wasn't found
+    ref *find_slot(intern_t, module *from = nullptr);
     virtual ref getattr_fast(u64);
     virtual void setattr_fast(u64, ref);
   };
@@ -31,6 +31,7 @@
 #include <cedar/object/lambda.h>
 #include <cedar/object/symbol.h>
 #include <cedar/runes.h>
+#include <atomic>
 #include <functional>
 #include <vector>
 
@@ -51,8 +52,16 @@ namespace cedar {
 
     using method = std::function<ref(int, ref *, vm::machine *)>;
     std::vector<type *> m_parents;
+    // the types that have this one as a parent
+    std::vector<type *> m_children;
     cedar::runes m_name;
 
+    // bumped whenever where some field of the type's instances resolves to
+    // might have changed. Attribute inline caches are only valid for the
+    // version they were filled at
+    std::atomic<u64> version = 0;
+    void invalidate(void);
+
     attr_map m_fields;
     void set_field(ref, ref);
     void set_field(cedar::runes, bound_function);
@@ -82,18 +91,24 @@ namespace cedar {
 
 
 
+  // look up a method to call on obj, the way getattr would, but without
+  // binding a copy of it to obj. method_self is set to the self it should be
+  // called with: obj for methods found on its type, otherwise whatever the
+  // attribute already had
+  ref lookup_method(ref obj, u64 id, ref &method_self);
+
+
   inline ref self_callv(ref self, const cedar::runes func, int argc,
                         ref *argv) {
-    ref s = new symbol(func);
-    ref attr = self.getattr(s);
+    ref method_self;
+    ref attr = lookup_method(self, symbol::intern(func), method_self);
     if (!attr.is<lambda>()) {
       throw cedar::make_exception(
           "self call failed, unable to call non-lambda");
     }
 
     call_context ctx;
-    ref val = call_function(attr.as<lambda>(), argc, argv, &ctx);
-    return val;
+    return call_method(attr.as<lambda>(), method_self, argc, argv, &ctx);
   }
 
 
@@ -38,6 +38,40 @@ namespace cedar {
 
 	ref wrap_top_level_with_lambdas(ref, vm::compiler*);
 
+	// the optimization passes run between macroexpansion and bytecode
+	// emission. Each one only rewrites forms into ones that evaluate the same
+	// way, and leaves anything it doesn't understand alone
+
+	// expand every macro call in a form up front, so the passes after it
+	// see the real code
+	ref expand_macros(ref, vm::compiler*);
+	// replace calls to small core functions with their bodies
+	ref inline_core_functions(ref, vm::compiler*);
+	// evaluate arithmetic and comparisons whose arguments are all literals
+	ref fold_constants(ref, vm::compiler*);
+	// drop if branches a constant test never takes, and the values in a do
+	// that are thrown away and can't have side effects
+	ref eliminate_dead_code(ref, vm::compiler*);
+
+	// run a form through all of the above, in order. Setting CDRPASSDUMP in
+	// the environment prints each pass's output and how long it took
+	ref optimize(ref, vm::compiler*);
+
+
+	// the core functions the passes inline or fold, as they were bound when
+	// core finished loading. Any of them can be rebound later, so an inlined
+	// call is guarded with (is-core* k name), which is true only while name
+	// still refers to core_originals[k]. Nothing is inlined before they are
+	// recorded, so core's own code always makes the real calls
+#define CORE_INLINED_MAX 16
+	extern ref core_originals[CORE_INLINED_MAX];
+	void record_core_originals(void);
+	inline bool is_core_original(int k, ref val) {
+		ref &orig = core_originals[k];
+		return !orig.is_nil() && orig.m_obj == val.m_obj &&
+			orig.m_flags == val.m_flags;
+	}
+
 
 	class passcontroller {
 		private:
@@ -31,6 +31,7 @@
 #include <setjmp.h>
 #include <sys/mman.h>
 #include <uv.h>
+#include <atomic>
 #include <future>
 #include <list>
 #include <mutex>
@@ -144,6 +145,9 @@ namespace cedar {
     fiber *current_fiber = nullptr;
     bool continue_working = true;
     bool internal = false;
+    // set by the scheduler's timer thread once per time slice. The fiber
+    // running on this worker checks it when it runs out of reductions
+    std::atomic<bool> yield_requested = false;
   };
 
   struct internal_worker {
@@ -174,7 +178,17 @@ namespace cedar {
 
   fiber *current_fiber();
 
+  // milliseconds since the epoch, updated once a time slice by the
+  // scheduler's timer thread so the hot paths never read the clock
+  u64 coarse_time_ms(void);
+
   ref eval_lambda(call_state);
+  // run a fiber that hasn't been started the way eval_lambda does, and
+  // return what it returns
+  ref eval_fiber(fiber *);
   ref call_function(lambda *, int argc, ref *argv, call_context *ctx);
+  // call a function with something other than its own self, used to call
+  // methods without binding a copy of them to the receiver
+  ref call_method(lambda *, ref self, int argc, ref *argv, call_context *ctx);
 
 }  // namespace cedar
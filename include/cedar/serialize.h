@@ -30,10 +30,20 @@
 
 #include <cedar/ref.h>
 #include <stdio.h>
+#include <vector>
 
 namespace cedar {
   class serializer {
     FILE *fp;
+    // where the data ends, found the first time a length is checked
+    long end = -1;
+    void write_symbol_table(std::vector<u64> &);
+    std::vector<u64> read_symbol_table(void);
+    // reading throws std::runtime_error when the data ends early, or a
+    // length in it is longer than what's left
+    void read_bytes(void *, size_t);
+    size_t read_length(size_t each);
+    std::string read_string(void);
     public:
     serializer(FILE *);
     void write(ref);
@@ -0,0 +1,63 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Nick Wanninger
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#include <cedar/ref.h>
+#include <cedar/types.h>
+
+namespace cedar {
+
+  class lambda;
+
+  namespace simd {
+
+    // the widest vector instructions the host has, as asmjit's CpuInfo sees
+    // them. Picked once, the first time anything asks. Setting CDRSIMD to
+    // one of the names caps it, to compare the paths
+    enum level { sse2, avx2, avx512 };
+    level host_level(void);
+    const char *level_name(level);
+
+    // add up n refs, which must all be floats (or all ints). Returns false
+    // if any of them isn't, and sum is left alone. The float sum is done in
+    // vector lanes that are added up at the end, so it can round
+    // differently than adding the values one at a time would
+    bool sum_floats(const ref *v, size_t n, double *sum);
+    bool sum_ints(const ref *v, size_t n, i64 *sum);
+
+    // native versions of cedar functions from a float to a float, so
+    // mapping one over numbers doesn't call back into cedar for each
+    using unary = double (*)(double);
+    void register_unary(lambda *, unary);
+    // the native version of a function, or nullptr if it has none
+    unary find_unary(lambda *);
+
+  }  // namespace simd
+}  // namespace cedar
+
+#endif
@@ -26,6 +26,7 @@
 
 #include <cedar/ref.h>
 #include <functional>
+#include <cedar/native_interface.h>
 #include <cedar/scheduler.h>
 
 // just forward declare machine
@@ -34,6 +35,19 @@ namespace cedar {namespace vm { class machine; }}
 namespace cedar {
   using bound_function = std::function<ref(int, ref*, call_context*)>;
   // using native_callback = std::function<void(const function_callback&)>;
+
+  namespace vm {
+    // the core's ordering comparisons, which the JIT can inline on ints
+    enum comparison {
+      compare_none,
+      compare_lt,
+      compare_lte,
+      compare_gt,
+      compare_gte,
+    };
+    // which of them a raw binding is, if any
+    comparison core_comparison(raw_function);
+  }  // namespace vm
 }
 
 #define cedar_binding_sig(name) cedar::ref name(int argc, cedar::ref *argv, cedar::call_context *ctx)
@@ -41,6 +55,12 @@ namespace cedar {
 	cedar_binding_sig(name) asm ("_$CDR$" #name); \
 	cedar_binding_sig(name)
 
+// a binding using the raw_function convention, for hot builtins that
+// shouldn't pay for a std::function call and a function_callback
+#define cedar_raw_binding(name)                                     \
+  static void name(int argc, cedar::ref *argv, cedar::ref self,     \
+                   cedar::fiber *fib, cedar::ref *ret)
+
 #define cedar_init_sig() void cedar_module_init(void)
 #define cedar_init() cedar_init_sig() asm ("_$CDR-INIT$"); cedar_init_sig()
 
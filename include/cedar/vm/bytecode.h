@@ -38,19 +38,175 @@
 #include <cedar/serialize.h>
 #include <vector>
 #include <mutex>
+#include <atomic>
 
 namespace cedar {
 
   class object;
+  class module;
+  class type;
+
+  namespace jit {
+    struct native_frame;
+    class code_handle;
+  }  // namespace jit
 
 
   namespace vm {
 
 
+    // an inline cache entry for a single OP_LOAD_GLOBAL site. Entries are
+    // never modified once published, a miss just swaps in a new one. They
+    // are valid as long as the module matches and cedar::binding_version
+    // hasn't changed since the lookup was done
+    struct global_cache {
+      module *mod = nullptr;
+      u64 version = 0;
+      ref *slot = nullptr;
+      // the layouts of the module and the core as of the lookup, for the
+      // baseline JIT's guards. Nothing can shadow the binding without
+      // changing one of them
+      u64 mod_layout = 0;
+      u64 core_layout = 0;
+    };
+
+
+    // how many types a type_profile tells apart before it gives up
+#define TYPE_PROFILE_WAYS 4
+    // how many of a function's arguments have their types profiled
+#define TYPE_PROFILE_ARGS 4
+
+    // a fixed size record of the types of the values seen at some point in
+    // the code, cheap enough to leave on all the time. A type claims a free
+    // way with a CAS and is counted with plain relaxed loads and stores, so a
+    // racing increment can be lost, which is fine for a profile. Counters
+    // saturate instead of wrapping. Once more types show up than there are
+    // ways the profile is megamorphic, and stops recording
+    struct type_profile {
+      std::atomic<type *> types[TYPE_PROFILE_WAYS];
+      std::atomic<u32> counts[TYPE_PROFILE_WAYS];
+      // every number is a number_type, so this says which kinds were seen:
+      // bit 0 for ints and bit 1 for floats
+      std::atomic<u8> number_kinds;
+      std::atomic<bool> megamorphic;
+
+      inline type_profile() {
+        for (auto &t : types) t = nullptr;
+        for (auto &c : counts) c = 0;
+        number_kinds = 0;
+        megamorphic = false;
+      }
+
+      inline void record(ref val) {
+        if (megamorphic.load(std::memory_order_relaxed)) return;
+        if (val.is_number()) {
+          u8 kind = val.is_int() ? 1 : 2;
+          // only write when something new shows up, it's almost never
+          if ((number_kinds.load(std::memory_order_relaxed) & kind) == 0)
+            number_kinds.fetch_or(kind, std::memory_order_relaxed);
+        }
+        type *t = val.get_type();
+        for (int i = 0; i < TYPE_PROFILE_WAYS; i++) {
+          type *seen = types[i].load(std::memory_order_relaxed);
+          // claim a free way. If another thread beat us to it, seen is now
+          // whatever it put there
+          if (seen == nullptr &&
+              types[i].compare_exchange_strong(seen, t,
+                                               std::memory_order_relaxed))
+            seen = t;
+          if (seen != t) continue;
+          u32 n = counts[i].load(std::memory_order_relaxed);
+          if (n != UINT32_MAX) counts[i].store(n + 1, std::memory_order_relaxed);
+          return;
+        }
+        megamorphic.store(true, std::memory_order_relaxed);
+      }
+
+      // the only type seen so far, or nullptr if there were none or several.
+      // What a compiler specializing the site would check for
+      inline type *monomorphic(void) const {
+        if (megamorphic.load(std::memory_order_relaxed)) return nullptr;
+        if (types[1].load(std::memory_order_relaxed) != nullptr) return nullptr;
+        return types[0].load(std::memory_order_relaxed);
+      }
+    };
+
+
+    // how many receiver types an attribute site remembers
+#define ATTR_CACHE_WAYS 4
+
+    // an attribute cache entry says where attributes of some type live, as
+    // of some version of that type. Own attributes on the object always win,
+    // then field (nullptr if the type doesn't define the attribute). Like
+    // global_cache, entries are immutable once they're published
+    struct attr_cache_entry {
+      type *t = nullptr;
+      u64 version = 0;
+      ref *field = nullptr;
+    };
+
+    // a polymorphic inline cache for a single GET_ATTR or SET_ATTR site
+    struct attr_cache {
+      u64 id = 0;
+      std::atomic<attr_cache_entry *> entries[ATTR_CACHE_WAYS];
+      // the next way to replace when the cache is full
+      std::atomic<u32> next;
+      // the receivers an OP_INVOKE site was called with. Unused by the
+      // GET_ATTR and SET_ATTR sites
+      type_profile receivers;
+    };
+
+
+    // a single word of direct threaded code. Each instruction is the
+    // address of its handler in fiber::run followed by one word per operand,
+    // already decoded into whatever the handler wants to use
+    union threaded_word {
+      void *label;
+      i64 i;
+      u64 u;
+      double f;
+      // CONST and MAKE_FUNC point right at the constant
+      ref *cref;
+      // jumps point at the instruction they go to
+      threaded_word *target;
+      // LOAD_GLOBAL points at it's inline cache
+      std::atomic<global_cache *> *cache;
+      // and GET_ATTR and SET_ATTR at theirs
+      attr_cache *attr;
+    };
+
+
+    // how many calls (and recurs) it takes before a function is compiled
+    // by the baseline JIT
+#define JIT_HOT_THRESHOLD 1000
+
+    // how many times a bytecode's native code can deoptimize before the JIT
+    // stops speculating on it, and compiles code that never deoptimizes
+#define JIT_MAX_DEOPTS 4
+
+    // where a bytecode is in tiering up to native code
+    enum jit_status : u8 {
+      jit_untried,
+      // waiting in the compile thread's queue, or being compiled
+      jit_compiling,
+      jit_compiled,
+      // the JIT couldn't compile it, it stays in the interpreter
+      jit_failed,
+    };
+
+    // the baseline JIT's translation of some bytecode, which runs it in the
+    // frame it is handed (see jit::call_native)
+    using native_code = void (*)(jit::native_frame *);
+
+
+    class bytecode;
+    void fuse_superinstructions(bytecode &);
+
     // bytecode object
     class bytecode {
      protected:
        friend cedar::serializer;
+       friend void vm::fuse_superinstructions(bytecode &);
 
       // size is how many bytes are written into the code pointer
       // it also determines *where* to write when writing new data
@@ -60,6 +216,17 @@ namespace cedar {
      public:
       i32 stack_size = 0;
 
+      // the frame's stack slots, which sit below its operand stack. The
+      // function's arguments are the first ones, then the scope* variables
+      // that no nested function closes over
+      i32 slot_count = 0;
+      // the arguments a nested function closes over live in the function's
+      // closure instead of a slot. For each argument, its index in the
+      // closure or -1. Empty if none of them are captured
+      std::vector<i16> arg_closure_index;
+      // how many variables the function's closure holds
+      i32 closure_size = 0;
+
       // constants stores values that the bytecode can reference with
       // a simple index into it.
       std::vector<ref> constants;
@@ -75,16 +242,75 @@ namespace cedar {
       }
 
 
-      std::mutex calls_lock;
-      std::map<std::vector<type *>, int> calls;
+      // OP_LOAD_GLOBAL sites index into global_names and global_caches
+      // with the u16 that follows the opcode. There is one entry per site
+      std::vector<u64> global_names;
+      std::atomic<global_cache *> *global_caches = nullptr;
+
+      // symbols referenced by imm_name operands (set!, def-macro, etc)
+      std::vector<u64> names;
+
+      // GET_ATTR and SET_ATTR sites, one per site like the globals above
+      std::vector<u64> attr_names;
+      attr_cache *attr_caches = nullptr;
+
+      // reserve a new cache slot for a global load. Returns it's index
+      u16 new_global_cache(u64 id);
+      u16 new_attr_cache(u64 id);
+      // find or add a symbol in the name table. Returns it's index
+      u16 name_index(u64 id);
+      void allocate_caches(void);
+
+
+      // the direct threaded translation the interpreter runs, built from the
+      // code above the first time the bytecode is called. The byte encoding
+      // stays canonical, this is never serialized
+      std::atomic<threaded_word *> threaded = nullptr;
+
+
+      // the types of the first TYPE_PROFILE_ARGS arguments of every call.
+      // The receiver types at each OP_INVOKE site are in its attr_cache
+      type_profile arg_types[TYPE_PROFILE_ARGS];
+
+      inline void record_args(int argc, ref *argv) {
+        if (argv == nullptr) return;
+        for (int i = 0; i < argc && i < TYPE_PROFILE_ARGS; i++)
+          arg_types[i].record(argv[i]);
+      }
+
+
+      // calls and recurs counted towards compiling the code natively
+      std::atomic<u32> hotness = 0;
+      std::atomic<u8> jit_state = jit_untried;
+      // how often guards in the native code failed, see JIT_MAX_DEOPTS
+      std::atomic<u32> deopts = 0;
+      // the native code, once the JIT is done with it. The handle owns the
+      // pages it lives in, and unmaps them when the bytecode is collected
+      std::atomic<native_code> native = nullptr;
+      jit::code_handle *native_handle = nullptr;
+
+      // count a call or a back edge. Returns true when the count reaches
+      // JIT_HOT_THRESHOLD, which is when the caller should tier the code up.
+      // Racing threads can lose counts, or both see the threshold, so
+      // tiering up has to be (and is) idempotent
+      inline bool heat(void) {
+        u32 n = hotness.load(std::memory_order_relaxed);
+        if (n >= JIT_HOT_THRESHOLD) return false;
+        hotness.store(n + 1, std::memory_order_relaxed);
+        return n + 1 == JIT_HOT_THRESHOLD;
+      }
 
 
       void print(u8 *ip = nullptr);
       ref &get_const(int);
       int push_const(ref);
+      // finish the code once the compiler is done writing it. Runs the
+      // peephole pass, fuses superinstructions and sizes the operand stack
       void finalize();
+      // rewrite the naive sequences the compiler emits into cheaper ones,
+      // thread jump chains and drop unreachable code. Run by finalize
+      void peephole();
 
-      void record_call(int argc, ref *argv);
 
 
       template <typename T>
@@ -122,11 +348,14 @@ namespace cedar {
       inline u64 write_op(u8 op) { return write((u8)op); }
 
 
-      inline u64 write_op(u8 op, u64 arg) {
-        auto r = write((u8)op);
-        write((u64)arg);
-        return r;
-      }
+      // write an op and its operand, encoded in the width the opcode table
+      // says it takes. Throws if the argument doesn't fit
+      u64 write_op(u8 op, i64 arg);
+      // write an OP_INVOKE of the attribute `id` with argc arguments
+      u64 write_invoke(u64 id, i64 argc);
+      // write a LOAD_LOCAL or SET_LOCAL of variable `index` in the closure
+      // `depth` levels down from the root of the chain
+      u64 write_local(u8 op, i64 depth, i64 index);
 
       inline uint64_t get_size() { return size; }
       inline uint64_t get_cap() { return cap; }
@@ -138,5 +367,16 @@ namespace cedar {
       }
     };
 
+
+    // the slow paths behind the interpreter's inline caches, shared with the
+    // JIT so both keep the same caches warm
+    ref load_global_slow(bytecode *code, std::atomic<global_cache *> *site,
+                         module *m);
+    // the same for a cache that isn't in some bytecode's table
+    ref load_global_slow(u64 id, std::atomic<global_cache *> *site, module *m);
+    ref getattr_cached(attr_cache *site, ref &obj);
+    ref lookup_method_cached(attr_cache *site, ref &obj, ref &method_self);
+    void setattr_cached(attr_cache *site, ref &obj, ref &val);
+
   }  // namespace vm
 }  // namespace cedar
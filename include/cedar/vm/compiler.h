@@ -32,6 +32,8 @@
 #include <stack>
 #include <memory>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <cedar/types.h>
 
 
@@ -41,29 +43,57 @@ namespace cedar {
 
 		// forwared declaration
 
+		// the state of the function whose body is being compiled, which
+		// is what decides where its locals live
+		struct function_state {
+			// the lambda depth of the function, 0 at the top level
+			u16 depth = 0;
+			// stack slots in use and the most ever used at once
+			int slots = 0;
+			int max_slots = 0;
+			// every symbol referenced from inside a function nested in this
+			// one. A local in here escapes, as it can outlive the frame, and
+			// has to be stored in a closure. The rest get a stack slot
+			std::set<u64> nested_refs;
+		};
+
 		struct compiler_ctx {
-			u64 closure_size = 0;
+			// how many closures are in the chain at this point in the code,
+			// which is also the depth a new closure would be at
+			u16 closure_depth = 0;
 			u16 lambda_depth = 0;
+			// set while compiling an expression whose value the function
+			// returns directly. Calls there are emitted as TAIL_CALL
+			bool tail = false;
+			function_state *fn = nullptr;
+		};
+
+		// where a local variable is stored
+		struct binding {
+			// a stack slot in the frame of the function at lambda depth
+			// `depth`, or an index into the closure at `depth` in the chain
+			bool slot;
+			int index;
+			u16 depth;
 		};
 
 		class scope {
 			/**
 			 * m_bindings
-			 * a mapping from the hashes of symbols to their index
-			 * in the closure
-			 * Looking up a binding's index is an O(n) task as it needs to
-			 * walk up the scope tree until it finds the mapping or has no
-			 * parent to continue searching. If no value was found, -1 will
-			 * be returned as -1 is not a valid closure index
+			 * a mapping from the hashes of symbols to where they are stored
+			 * Looking up a binding is an O(n) task as it needs to walk up the
+			 * scope tree until it finds the mapping or has no parent to
+			 * continue searching. If no binding was found, nullptr will be
+			 * returned
 			 */
-			std::map<uint64_t, int> m_bindings;
+			std::map<uint64_t, binding> m_bindings;
 			public:
 				scope* m_parent = nullptr;
 				scope(scope*);
-				int find(uint64_t);
-				int find(ref &);
-				void set(ref &, int);
-				void set(uint64_t, int);
+				binding *find(uint64_t);
+				binding *find(ref &);
+				void set(ref &, binding);
+				void set(uint64_t, binding);
 		};
 
 
@@ -76,7 +106,17 @@ namespace cedar {
 				class context {
         };
 
-        module *mod;
+        module *mod = nullptr;
+
+				// macro expansions are memoized by the form they expand, so the
+				// escape analysis and the code generation see the same expansion
+				// even if the macro makes up new symbols each time it's run
+				std::unordered_map<object *, ref> m_expansions;
+				std::vector<ref> m_expanded_forms;
+				ref expand(ref);
+				// collect the symbols referenced in a form from inside a nested
+				// function into a set, see function_state::nested_refs
+				void collect_nested_refs(ref, bool nested, std::set<u64> &);
 
 				/*
 				 * given some object reference,
@@ -100,5 +140,9 @@ namespace cedar {
 		// a bytecode compilation pass that takes in the compiler
 		// oboejct
 		ref bytecode_pass(ref, compiler*, module*);
+
+		// rewrite the hot opcode sequences in some finished bytecode into
+		// the superinstructions declared in generate_opcode_h.py
+		void fuse_superinstructions(bytecode &);
 	}
 }
@@ -25,6 +25,7 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
 
 #include <cedar/vm/bytecode.h>
 
@@ -43,6 +44,22 @@ namespace cedar {
 			imm_int,
 			imm_ptr,
       imm_byte,
+      // narrow integer operands, picked per opcode to keep code dense
+      imm_i8,
+      imm_u16,
+      imm_u32,
+      // a u16 inline cache index, the symbol is in bytecode::global_names
+      imm_global,
+      // a u16 index into bytecode::names
+      imm_name,
+      // a u16 attribute cache index, the symbol is in bytecode::attr_names
+      imm_attr,
+      // an attribute cache index like imm_attr, then a u16 argument count
+      imm_invoke,
+      // a u16 closure depth, then a u16 index into that closure
+      imm_local,
+      // a superinstruction, the operands of each part back to back
+      imm_super,
 		};
 
 		// an instruction is an internal representation of
@@ -75,15 +92,44 @@ namespace cedar {
 					void *arg_voidptr;
 				};
 
+				// the table index for imm_global, imm_name, imm_attr and imm_invoke
+				// instructions, or the closure depth of an imm_local one (with the
+				// index into the closure in arg_int)
+				uint32_t arg_slot = 0;
+				// the argument count of an imm_invoke instruction
+				uint32_t arg_count = 0;
+
+				// the decoded parts of a superinstruction
+				std::vector<instruction> parts;
+
 				bool encode(bytecode&);
 
 				inst_type type(void);
+				// does this instruction (or it's last part) jump to arg_int
+				bool is_jump(void);
 				std::string to_string(uint64_t offset = 0);
+				std::string operand_string(void);
 		};
 
 
 
 		std::vector<instruction> decode_bytecode(bytecode*);
+		// how an instruction (or superinstruction part) changes the depth of
+		// the operand stack
+		int stack_effect(instruction &);
+		// the operand stack depth at the start of each decoded instruction, or
+		// INT_MIN where it can't be reached. max_depth gets the deepest the
+		// stack goes, and consistent is cleared if some instruction can be
+		// reached with two different depths. Either can be null
+		std::vector<int> stack_depths(std::vector<instruction> &,
+		                              int *max_depth = nullptr,
+		                              bool *consistent = nullptr);
+
+		// the opcodes a superinstruction runs, empty for normal opcodes
+		std::vector<u8> superinstruction_parts(u8 op);
+		// how many operand bytes follow the opcode in the instruction stream
+		u64 operand_size(u8 op);
+		u64 inst_type_size(inst_type);
 
 	} // namespace vm
 } // namespace cedar
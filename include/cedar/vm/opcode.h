@@ -9,59 +9,67 @@
 #define OP_CONST                    0x02
 #define OP_FLOAT                    0x03
 #define OP_INT                      0x04
-#define OP_INT_NEG_1                0x05
-#define OP_INT_0                    0x06
-#define OP_INT_1                    0x07
-#define OP_INT_2                    0x08
-#define OP_INT_3                    0x09
-#define OP_INT_4                    0x0a
-#define OP_INT_5                    0x0b
-#define OP_LOAD_LOCAL               0x0c
-#define OP_SET_LOCAL                0x0d
-#define OP_LOAD_GLOBAL              0x0e
-#define OP_SET_GLOBAL               0x0f
-#define OP_SET_PRIVATE              0x10
-#define OP_CONS                     0x11
-#define OP_APPEND                   0x12
-#define OP_CALL                     0x13
-#define OP_CALL_EXCEPTIONAL         0x14
-#define OP_MAKE_FUNC                0x15
-#define OP_MAKE_SCOPE               0x16
-#define OP_POP_SCOPE                0x17
-#define OP_ARG_POP                  0x18
-#define OP_RETURN                   0x19
-#define OP_EXIT                     0x1a
-#define OP_SKIP                     0x1b
-#define OP_JUMP                     0x1c
-#define OP_JUMP_IF_FALSE            0x1d
-#define OP_RECUR                    0x1e
-#define OP_DUP                      0x1f
-#define OP_SWAP                     0x20
-#define OP_GET_ATTR                 0x21
-#define OP_SET_ATTR                 0x22
-#define OP_DEF_MACRO                0x23
-#define OP_EVAL                     0x24
-#define OP_SLEEP                    0x25
-#define OP_GET_MODULE               0x26
-#define OP_ADD                      0x27
-#define OP_SUB                      0x28
-#define OP_NEG                      0x29
-#define OP_DEC                      0x2a
-#define OP_INC                      0x2b
-#define OP_LOAD_SELF                0x2c
-#define OP_RECV                     0x2d
-#define OP_SEND                     0x2e
-#define OP_DICT_SET                 0x2f
-#define OP_GET_CURRENT_FUNC         0x30
+#define OP_INT_8                    0x05
+#define OP_INT_NEG_1                0x06
+#define OP_INT_0                    0x07
+#define OP_INT_1                    0x08
+#define OP_INT_2                    0x09
+#define OP_INT_3                    0x0a
+#define OP_INT_4                    0x0b
+#define OP_INT_5                    0x0c
+#define OP_LOAD_LOCAL               0x0d
+#define OP_SET_LOCAL                0x0e
+#define OP_LOAD_SLOT                0x0f
+#define OP_SET_SLOT                 0x10
+#define OP_CLEAR_SLOT               0x11
+#define OP_LOAD_GLOBAL              0x12
+#define OP_SET_GLOBAL               0x13
+#define OP_SET_PRIVATE              0x14
+#define OP_CONS                     0x15
+#define OP_APPEND                   0x16
+#define OP_CALL                     0x17
+#define OP_CALL_EXCEPTIONAL         0x18
+#define OP_TAIL_CALL                0x19
+#define OP_MAKE_FUNC                0x1a
+#define OP_MAKE_SCOPE               0x1b
+#define OP_POP_SCOPE                0x1c
+#define OP_ARG_POP                  0x1d
+#define OP_RETURN                   0x1e
+#define OP_EXIT                     0x1f
+#define OP_SKIP                     0x20
+#define OP_JUMP                     0x21
+#define OP_JUMP_IF_FALSE            0x22
+#define OP_RECUR                    0x23
+#define OP_DUP                      0x24
+#define OP_SWAP                     0x25
+#define OP_GET_ATTR                 0x26
+#define OP_SET_ATTR                 0x27
+#define OP_INVOKE                   0x28
+#define OP_DEF_MACRO                0x29
+#define OP_EVAL                     0x2a
+#define OP_SLEEP                    0x2b
+#define OP_GET_MODULE               0x2c
+#define OP_ADD                      0x2d
+#define OP_SUB                      0x2e
+#define OP_NEG                      0x2f
+#define OP_DEC                      0x30
+#define OP_INC                      0x31
+#define OP_LOAD_SELF                0x32
+#define OP_RECV                     0x33
+#define OP_SEND                     0x34
+#define OP_DICT_SET                 0x35
+#define OP_IS_CORE                  0x36
+#define OP_GET_CURRENT_FUNC         0x37
 
 /* Instruction opcode foreach macro for code generation */
 /* Arg order: (name, bytecode, type, stack effect */
 #define CEDAR_FOREACH_OPCODE(V) \
   V(NOP, OP_NOP, no_arg, 0) \
   V(NIL, OP_NIL, no_arg, 1) \
-  V(CONST, OP_CONST, imm_int, 1) \
+  V(CONST, OP_CONST, imm_u16, 1) \
   V(FLOAT, OP_FLOAT, imm_float, 1) \
   V(INT, OP_INT, imm_int, 1) \
+  V(INT_8, OP_INT_8, imm_i8, 1) \
   V(INT_NEG_1, OP_INT_NEG_1, no_arg, 1) \
   V(INT_0, OP_INT_0, no_arg, 1) \
   V(INT_1, OP_INT_1, no_arg, 1) \
@@ -69,32 +77,37 @@
   V(INT_3, OP_INT_3, no_arg, 1) \
   V(INT_4, OP_INT_4, no_arg, 1) \
   V(INT_5, OP_INT_5, no_arg, 1) \
-  V(LOAD_LOCAL, OP_LOAD_LOCAL, imm_byte, 1) \
-  V(SET_LOCAL, OP_SET_LOCAL, imm_byte, 0) \
-  V(LOAD_GLOBAL, OP_LOAD_GLOBAL, imm_int, 1) \
-  V(SET_GLOBAL, OP_SET_GLOBAL, imm_int, 0) \
-  V(SET_PRIVATE, OP_SET_PRIVATE, imm_int, 0) \
+  V(LOAD_LOCAL, OP_LOAD_LOCAL, imm_local, 1) \
+  V(SET_LOCAL, OP_SET_LOCAL, imm_local, 0) \
+  V(LOAD_SLOT, OP_LOAD_SLOT, imm_u16, 1) \
+  V(SET_SLOT, OP_SET_SLOT, imm_u16, 0) \
+  V(CLEAR_SLOT, OP_CLEAR_SLOT, imm_u16, 0) \
+  V(LOAD_GLOBAL, OP_LOAD_GLOBAL, imm_global, 1) \
+  V(SET_GLOBAL, OP_SET_GLOBAL, imm_name, 0) \
+  V(SET_PRIVATE, OP_SET_PRIVATE, imm_name, 0) \
   V(CONS, OP_CONS, no_arg, -1) \
   V(APPEND, OP_APPEND, no_arg, -1) \
-  V(CALL, OP_CALL, imm_int, 0) \
-  V(CALL_EXCEPTIONAL, OP_CALL_EXCEPTIONAL, imm_int, 0) \
-  V(MAKE_FUNC, OP_MAKE_FUNC, imm_int, 1) \
-  V(MAKE_SCOPE, OP_MAKE_SCOPE, no_arg, 0) \
+  V(CALL, OP_CALL, imm_u16, 0) \
+  V(CALL_EXCEPTIONAL, OP_CALL_EXCEPTIONAL, imm_u16, 0) \
+  V(TAIL_CALL, OP_TAIL_CALL, imm_u16, 0) \
+  V(MAKE_FUNC, OP_MAKE_FUNC, imm_u16, 1) \
+  V(MAKE_SCOPE, OP_MAKE_SCOPE, imm_u16, 0) \
   V(POP_SCOPE, OP_POP_SCOPE, no_arg, 0) \
   V(ARG_POP, OP_ARG_POP, imm_int, 1) \
-  V(RETURN, OP_RETURN, no_arg, 0) \
+  V(RETURN, OP_RETURN, no_arg, -1) \
   V(EXIT, OP_EXIT, no_arg, 0) \
   V(SKIP, OP_SKIP, no_arg, -1) \
-  V(JUMP, OP_JUMP, imm_int, 0) \
-  V(JUMP_IF_FALSE, OP_JUMP_IF_FALSE, imm_int, 0) \
-  V(RECUR, OP_RECUR, imm_int, 0) \
-  V(DUP, OP_DUP, imm_int, 1) \
+  V(JUMP, OP_JUMP, imm_u32, 0) \
+  V(JUMP_IF_FALSE, OP_JUMP_IF_FALSE, imm_u32, -1) \
+  V(RECUR, OP_RECUR, imm_u16, 0) \
+  V(DUP, OP_DUP, imm_byte, 1) \
   V(SWAP, OP_SWAP, no_arg, 0) \
-  V(GET_ATTR, OP_GET_ATTR, imm_int, 0) \
-  V(SET_ATTR, OP_SET_ATTR, imm_int, 0) \
-  V(DEF_MACRO, OP_DEF_MACRO, imm_int, 0) \
+  V(GET_ATTR, OP_GET_ATTR, imm_attr, 0) \
+  V(SET_ATTR, OP_SET_ATTR, imm_attr, -1) \
+  V(INVOKE, OP_INVOKE, imm_invoke, 0) \
+  V(DEF_MACRO, OP_DEF_MACRO, imm_name, 0) \
   V(EVAL, OP_EVAL, no_arg, 0) \
-  V(SLEEP, OP_SLEEP, no_arg, -1) \
+  V(SLEEP, OP_SLEEP, no_arg, 0) \
   V(GET_MODULE, OP_GET_MODULE, no_arg, 1) \
   V(ADD, OP_ADD, no_arg, -1) \
   V(SUB, OP_SUB, no_arg, -1) \
@@ -103,8 +116,48 @@
   V(INC, OP_INC, no_arg, 0) \
   V(LOAD_SELF, OP_LOAD_SELF, no_arg, 1) \
   V(RECV, OP_RECV, no_arg, 0) \
-  V(SEND, OP_SEND, no_arg, 0) \
+  V(SEND, OP_SEND, no_arg, -1) \
   V(DICT_SET, OP_DICT_SET, no_arg, -2) \
+  V(IS_CORE, OP_IS_CORE, imm_byte, 0) \
   V(GET_CURRENT_FUNC, OP_GET_CURRENT_FUNC, no_arg, 1)
 
+/* Superinstructions, each runs a fixed sequence of opcodes */
+#define OP_LOAD_GLOBAL_LOAD_SLOT_LOAD_SLOT_CALL 0x38
+#define OP_LOAD_GLOBAL_LOAD_SLOT_CALL 0x39
+#define OP_LOAD_SLOT_LOAD_SLOT_CALL 0x3a
+#define OP_LOAD_SLOT_CALL           0x3b
+#define OP_LOAD_GLOBAL_CALL         0x3c
+#define OP_LOAD_GLOBAL_LOAD_SLOT    0x3d
+#define OP_LOAD_SLOT_LOAD_SLOT      0x3e
+#define OP_LOAD_SLOT_LOAD_SLOT_ADD  0x3f
+#define OP_LOAD_SLOT_LOAD_SLOT_SUB  0x40
+#define OP_LOAD_SLOT_DEC            0x41
+#define OP_LOAD_SLOT_INC            0x42
+#define OP_LOAD_SLOT_JUMP_IF_FALSE  0x43
+#define OP_LOAD_GLOBAL_LOAD_SLOT_LOAD_SLOT_TAIL_CALL 0x44
+#define OP_LOAD_SLOT_LOAD_SLOT_TAIL_CALL 0x45
+#define OP_LOAD_SLOT_TAIL_CALL      0x46
+#define OP_LOAD_GLOBAL_IS_CORE_JUMP_IF_FALSE 0x47
+
+/* Superinstruction foreach macro for code generation */
+/* Arg order: (name, bytecode, operand bytes, stack effect, parts)
+   where parts is a sequence of P(name) for each fused opcode */
+#define CEDAR_FOREACH_SUPERINSTRUCTION(V, P) \
+  V(LOAD_GLOBAL_LOAD_SLOT_LOAD_SLOT_CALL, OP_LOAD_GLOBAL_LOAD_SLOT_LOAD_SLOT_CALL, 8, 3, P(LOAD_GLOBAL) P(LOAD_SLOT) P(LOAD_SLOT) P(CALL)) \
+  V(LOAD_GLOBAL_LOAD_SLOT_CALL, OP_LOAD_GLOBAL_LOAD_SLOT_CALL, 6, 2, P(LOAD_GLOBAL) P(LOAD_SLOT) P(CALL)) \
+  V(LOAD_SLOT_LOAD_SLOT_CALL, OP_LOAD_SLOT_LOAD_SLOT_CALL, 6, 2, P(LOAD_SLOT) P(LOAD_SLOT) P(CALL)) \
+  V(LOAD_SLOT_CALL, OP_LOAD_SLOT_CALL, 4, 1, P(LOAD_SLOT) P(CALL)) \
+  V(LOAD_GLOBAL_CALL, OP_LOAD_GLOBAL_CALL, 4, 1, P(LOAD_GLOBAL) P(CALL)) \
+  V(LOAD_GLOBAL_LOAD_SLOT, OP_LOAD_GLOBAL_LOAD_SLOT, 4, 2, P(LOAD_GLOBAL) P(LOAD_SLOT)) \
+  V(LOAD_SLOT_LOAD_SLOT, OP_LOAD_SLOT_LOAD_SLOT, 4, 2, P(LOAD_SLOT) P(LOAD_SLOT)) \
+  V(LOAD_SLOT_LOAD_SLOT_ADD, OP_LOAD_SLOT_LOAD_SLOT_ADD, 4, 1, P(LOAD_SLOT) P(LOAD_SLOT) P(ADD)) \
+  V(LOAD_SLOT_LOAD_SLOT_SUB, OP_LOAD_SLOT_LOAD_SLOT_SUB, 4, 1, P(LOAD_SLOT) P(LOAD_SLOT) P(SUB)) \
+  V(LOAD_SLOT_DEC, OP_LOAD_SLOT_DEC, 2, 1, P(LOAD_SLOT) P(DEC)) \
+  V(LOAD_SLOT_INC, OP_LOAD_SLOT_INC, 2, 1, P(LOAD_SLOT) P(INC)) \
+  V(LOAD_SLOT_JUMP_IF_FALSE, OP_LOAD_SLOT_JUMP_IF_FALSE, 6, 0, P(LOAD_SLOT) P(JUMP_IF_FALSE)) \
+  V(LOAD_GLOBAL_LOAD_SLOT_LOAD_SLOT_TAIL_CALL, OP_LOAD_GLOBAL_LOAD_SLOT_LOAD_SLOT_TAIL_CALL, 8, 3, P(LOAD_GLOBAL) P(LOAD_SLOT) P(LOAD_SLOT) P(TAIL_CALL)) \
+  V(LOAD_SLOT_LOAD_SLOT_TAIL_CALL, OP_LOAD_SLOT_LOAD_SLOT_TAIL_CALL, 6, 2, P(LOAD_SLOT) P(LOAD_SLOT) P(TAIL_CALL)) \
+  V(LOAD_SLOT_TAIL_CALL, OP_LOAD_SLOT_TAIL_CALL, 4, 1, P(LOAD_SLOT) P(TAIL_CALL)) \
+  V(LOAD_GLOBAL_IS_CORE_JUMP_IF_FALSE, OP_LOAD_GLOBAL_IS_CORE_JUMP_IF_FALSE, 7, 0, P(LOAD_GLOBAL) P(IS_CORE) P(JUMP_IF_FALSE))
+
 #endif
@@ -24,6 +24,7 @@
 
 #include <cedar/ast.h>
 #include <cedar/object/dict.h>
+#include <cedar/object/keyword.h>
 #include <cedar/object/list.h>
 #include <cedar/object/symbol.h>
 #include <cedar/object/vector.h>
@@ -39,51 +40,28 @@ using namespace cedar::ast;
 
 
 void ast::scope::finalize(void) {
-  stack_size = 0;
-  closure_size = 0;
-
   // finalize walks *down* the scope tree and decides on which variables go in
-  // closures, and which dont. It also sets up closure indexes, instructions on
-  // how to allocate closures, etc...
-  //
+  // closures, and which dont. A scope that captures anything gets its own
+  // closure, one deeper in the chain than the closest scope above it that
+  // has one. Everything else inherits its parent's closure as is
   if (parent == nullptr) {
     closure_index = 0;
   } else {
-    // any children of a function that has a closure must allocate a closure to
-    // maintain access to variables. Imagine a function that returns a function
-    // of no args, where that function returns another function that expects a
-    // closed value form the root function. The 3rd function would have no way
-    // to access the root function becasue the middle function did not have
-    // access to the root's closure through the middle function
-    allocate_closure = parent->allocate_closure;
-    closure_index = parent->closure_index + parent->vars.size();
+    closure_index = parent->closure_index + (parent->allocate_closure ? 1 : 0);
   }
 
-
-
-
+  stack_size = 0;
   closure_size = 0;
   for (auto v : vars) {
     if (v->escapes) {
-      allocate_closure = true;
-      v->closure_index = closure_index + closure_size;
+      v->closure_index = closure_size;
       closure_size += 1;
     } else {
       v->stack_index = stack_size;
-      stack_size+=1;
+      stack_size += 1;
     }
   };
-
-  /*
-
-  printf("+");
-  for (int i = 0; i < closure_index-1; i++) printf(" ");
-  printf("%2d %2d: %p\n", closure_size, closure_index, this);
-  for (auto v : vars) {
-    for (int i = 0; i < closure_index+1; i++) printf(" ");
-    printf("%2d: %s\n", v->closure_index, v->str().c_str());
-  };
-  */
+  allocate_closure = closure_size != 0;
 
   for (auto c : children) {
     c->finalize();
@@ -150,6 +128,13 @@ node *ast::parse(ref obj, module *m, scope *sc) {
     }
 
 
+    // these park the fiber running them, which only the interpreter can do
+    if (is_call(obj, "sleep") || is_call(obj, "chan-send*") ||
+        is_call(obj, "chan-recv*")) {
+      throw unsupported_form(obj.first().to_string(true));
+    }
+
+
     bool is_defmac = is_call(obj, "defmacro*");
     bool is_defdef = is_call(obj, "def*");
     bool is_defprv = is_call(obj, "def-private*");
@@ -167,6 +152,21 @@ node *ast::parse(ref obj, module *m, scope *sc) {
             obj);
       }
 
+      // (def* a.b.c v) sets the attribute c of a.b
+      auto parts = split_dot_notation(s->get_content());
+      if (is_defdef && parts.size() > 1) {
+        ref set = newlist(newsymbol(parts.back()), new keyword(":="),
+                          obj.rest().rest().first());
+        parts.pop_back();
+        runes base = parts[0];
+        for (size_t i = 1; i < parts.size(); i++) {
+          base += ".";
+          base += parts[i];
+        }
+        return parse(new list(newsymbol("."), new list(newsymbol(base), set)),
+                     m, sc);
+      }
+
       n->dst = parse(obj.rest().first(), m, sc);
       n->val = parse(obj.rest().rest().first(), m, sc);
       return n;
@@ -210,7 +210,7 @@ node *ast::parse(ref obj, module *m, scope *sc) {
         expr = expr.rest();
         args = expr.rest().first();
       }
-      fn->name = name.to_string(true);
+      fn->name = name.is_nil() ? "" : name.to_string(true);
       while (true) {
         if (args.is_nil()) break;
         auto arg = args.first();
@@ -320,6 +320,64 @@ node *ast::parse(ref obj, module *m, scope *sc) {
 
 
 
+    if (is_call(obj, ".")) {
+      auto n = new dot_node(sc);
+      ref curr = obj.rest();
+      n->obj = parse(curr.first(), m, sc);
+      curr = curr.rest();
+      while (!curr.is_nil()) {
+        ref a = curr.first();
+        dot_node::step st;
+        if (a.isa(symbol_type)) {
+          st.id = a.as<symbol>()->id;
+          // a symbol may be followed by a := in order to set the value
+          ref next = curr.rest().first();
+          if (keyword *kw = ref_cast<keyword>(next); kw != nullptr) {
+            if (!(kw->get_content() == ":=")) {
+              throw cedar::make_exception("Unknown keyword '", next,
+                                          "' in dot syntax: ", obj);
+            }
+            st.val = parse(curr.rest().rest().first(), m, sc);
+            n->steps.push_back(st);
+            break;
+          }
+        } else if (a.isa(list_type) && a.first().isa(symbol_type)) {
+          st.id = a.first().as<symbol>()->id;
+          st.call = true;
+          for (ref args = a.rest(); !args.is_nil(); args = args.rest()) {
+            st.args.push_back(parse(args.first(), m, sc));
+          }
+        } else {
+          throw cedar::make_exception("invalid syntax in dot special form: ",
+                                      obj);
+        }
+        n->steps.push_back(st);
+        curr = curr.rest();
+      }
+      return n;
+    }
+
+
+    if (is_call(obj, "eval")) {
+      auto n = new eval_node(sc);
+      n->val = parse(obj.rest().first(), m, sc);
+      return n;
+    }
+
+
+    // defmacro passes its arguments unevaluated
+    if (is_call(obj, "defmacro")) {
+      auto c = new call_node(sc);
+      c->func = parse(obj.first(), m, sc);
+      for (ref args = obj.rest(); !args.is_nil(); args = args.rest()) {
+        auto *arg = new const_node(sc);
+        arg->val = args.first();
+        c->arguments.push_back(arg);
+      }
+      return c;
+    }
+
+
     // if the parser got here, it's a normal funciton call
     std::vector<node *> arguments;
 
@@ -330,6 +388,13 @@ node *ast::parse(ref obj, module *m, scope *sc) {
     }
 
 
+    if (is_call(obj, "recur")) {
+      auto n = new recur_node(sc);
+      n->arguments = arguments;
+      return n;
+    }
+
+
     if (is_call(obj, "+")) {
       auto n = new math_op_node(sc);
       n->arguments = arguments;
@@ -352,7 +417,8 @@ node *ast::parse(ref obj, module *m, scope *sc) {
       return n;
     }
 
-    if (is_call(obj, "/")) {
+    // (/ x) is x's reciprocal method, which the call does
+    if (is_call(obj, "/") && arguments.size() > 1) {
       auto n = new math_op_node(sc);
       n->arguments = arguments;
       n->op = '/';
@@ -390,6 +456,33 @@ node *ast::parse(ref obj, module *m, scope *sc) {
 
   if (ot == symbol_type) {
     symbol *s = ref_cast<symbol>(obj);
+
+    static auto self_id = symbol::intern("SELF");
+    static auto mod_id = symbol::intern("*module*");
+    static auto func_id = symbol::intern("*func*");
+    if (s->id == self_id || s->id == mod_id || s->id == func_id) {
+      auto n = new context_node(sc);
+      n->what = s->id == self_id  ? context_node::self
+                : s->id == mod_id ? context_node::module
+                                  : context_node::func;
+      return n;
+    }
+
+    // a.b.c is (. a.b c), the same way the bytecode compiler reads it
+    runes content = s->get_content();
+    auto parts = split_dot_notation(content);
+    if (parts.size() > 1 && !(content == ".")) {
+      if (parts.back().size() == 0)
+        throw cedar::make_exception("invalid dot notation: ", obj);
+      runes base = parts[0];
+      for (size_t i = 1; i + 1 < parts.size(); i++) {
+        base += ".";
+        base += parts[i];
+      }
+      return parse(newlist(newsymbol("."), newsymbol(base),
+                           newsymbol(parts.back())),
+                   m, sc);
+    }
     auto n = new symbol_node(sc);
     auto v = sc->find(s->id);
     // if the scope is not the same, then the variable escapes
@@ -402,55 +495,25 @@ node *ast::parse(ref obj, module *m, scope *sc) {
   }
 
 
+  // vector literals are calls to the Vector constructor, and dicts to
+  // whatever they say builds them, like in the bytecode compiler
   if (ot == vector_type) {
+    static ref vec_sym = new symbol("Vector");
     vector *v = ref_cast<vector>(obj);
-
-    auto len = v->size();
-
-    auto n = new vector_node(sc);
-
-    for (int i = 0; i < len; i++) {
-      n->elems.push_back(parse(v->at(i), m, sc));
-    }
-    return n;
-  }
-
-
-  if (ot == keyword_type) {
-    auto n = new keyword_node(sc);
-    n->val = obj.to_string(true);
-    return n;
-  }
-
-
-  if (ot == string_type) {
-    auto n = new string_node(sc);
-    n->val = obj.to_string(true);
-    return n;
+    std::vector<ref> elems;
+    for (int i = 0; i < (int)v->size(); i++) elems.push_back(v->at(i));
+    return parse(new list(vec_sym, elems.empty() ? nullptr : new list(elems)),
+                 m, sc);
   }
 
 
   if (ot == dict_type) {
-    auto n = new dict_node(sc);
-
-    dict *d = ref_cast<dict>(obj);
-    auto kv = d->keys();
-
-    while (!kv.is_nil()) {
-      ref pair = kv.first();
-      ref key = pair.first();
-      ref val = pair.rest().first();
-      n->elems.insert(std::pair(parse(key, m, sc), parse(val, m, sc)));
-      kv = kv.rest();
-    }
-    return n;
+    return parse(ref_cast<dict>(obj)->to_constructor_expr(), m, sc);
   }
 
 
-
-  std::cout << "UNHANDLED NODE\n" << std::endl;
-
-  exit(0);
-
-  return new node(sc);
-}
+  // anything else, like strings and keywords, is a constant
+  auto *c = new const_node(sc);
+  c->val = obj;
+  return c;
+}
\ No newline at end of file
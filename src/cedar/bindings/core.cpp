@@ -91,6 +91,25 @@ void bind_core(void) {
     args.get_return() = thing;
   });
 
+
+  // a snapshot of the JIT's counters, for seeing how much is being tiered
+  // up and what it costs
+  mod->def("jit-stats", [=](const function_callback &args) {
+    ref d = new dict();
+#define V(name) \
+  d = self_call(d, "set", new keyword(":" #name), (i64)jit::stats.name.load());
+    V(queued);
+    V(compiled);
+    V(failed);
+    V(dropped);
+    V(deopts);
+    V(queue_depth);
+    V(compile_ns);
+    V(code_bytes);
+#undef V
+    args.get_return() = d;
+  });
+
   
   /*
   lambda *fn = jit::compile(nullptr, nullptr);
@@ -31,6 +31,7 @@
 #include <cedar/object/string.h>
 #include <cedar/object/vector.h>
 #include <cedar/serialize.h>
+#include <cedar/simd.h>
 
 #include <cedar/objtype.h>
 #include <cedar/scheduler.h>
@@ -58,6 +59,19 @@ static native_callback wrap_math_func(const char *name,
 }
 
 
+// define a function from a float to a float, and tell map-vector it can
+// run the C version straight on numbers
+static void def_unary(module *mod, const char *name, double (*func)(double)) {
+  mod->def(name, wrap_math_func(name, func));
+  ref fn = mod->getattr_fast(symbol::intern(name));
+  if (auto *l = ref_cast<lambda>(fn); l != nullptr)
+    simd::register_unary(l, func);
+}
+
+
+static double sigmoid(double x) { return 1 / (1 + exp(-x)); }
+
+
 // probably overkill and going to cause problems...
 // TODO dont use this
 unsigned int gcd(unsigned int u, unsigned int v) {
@@ -143,32 +157,26 @@ void bind_math(void) {
 
 
 
-  mod->def("ceil", wrap_math_func("ceil", ceil));
-  mod->def("round", wrap_math_func("round", round));
-  mod->def("floor", wrap_math_func("floor", floor));
+  def_unary(mod, "ceil", ceil);
+  def_unary(mod, "round", round);
+  def_unary(mod, "floor", floor);
 
-  mod->def("exp", wrap_math_func("exp", exp));
-  mod->def("abs", wrap_math_func("abs", abs));
+  def_unary(mod, "exp", exp);
+  def_unary(mod, "abs", abs);
 
-  mod->def("cos", wrap_math_func("cos", cos));
-  mod->def("sin", wrap_math_func("sin", sin));
-  mod->def("tan", wrap_math_func("tan", tan));
+  def_unary(mod, "cos", cos);
+  def_unary(mod, "sin", sin);
+  def_unary(mod, "tan", tan);
 
-  mod->def("acos", wrap_math_func("acos", acos));
-  mod->def("asin", wrap_math_func("asin", asin));
-  mod->def("atan", wrap_math_func("atan", atan));
+  def_unary(mod, "acos", acos);
+  def_unary(mod, "asin", asin);
+  def_unary(mod, "atan", atan);
 
-  mod->def("cosh", wrap_math_func("cosh", cosh));
-  mod->def("sinh", wrap_math_func("sinh", sinh));
-  mod->def("tanh", wrap_math_func("tanh", tanh));
+  def_unary(mod, "cosh", cosh);
+  def_unary(mod, "sinh", sinh);
+  def_unary(mod, "tanh", tanh);
 
-  mod->def("sigmoid", [=](const function_callback &args) -> void {
-    if (args.len() == 1) {
-      args.get_return() = 1 / (1 + exp(-args[0].to_float()));
-      return;
-    }
-    args.throw_obj(new string("sigmoid requires 1 argument"));
-  });
+  def_unary(mod, "sigmoid", sigmoid);
 
   define_builtin_module("math", mod);
 }
@@ -33,11 +33,13 @@
 using namespace cedar;
 
 static std::mutex g_lock;
-static ska::flat_hash_map<u64, ref> globals;
+// each global's value is in a cell of its own, see module::binding
+static ska::flat_hash_map<u64, ref *> globals;
 
 
 
 module *cedar::core_mod = nullptr;
+std::atomic<u64> cedar::binding_version = 1;
 
 bool cedar::is_global(u64 id) {
   g_lock.lock();
@@ -48,7 +50,13 @@ bool cedar::is_global(u64 id) {
 
 void cedar::def_global(u64 id, ref val) {
   g_lock.lock();
-  globals[id] = val;
+  auto it = globals.find(id);
+  if (it != globals.end()) {
+    *it->second = val;
+  } else {
+    globals[id] = new ref(val);
+    invalidate_global_caches();
+  }
   g_lock.unlock();
 }
 
@@ -76,19 +84,32 @@ void cedar::def_global(runes k, native_callback f) {
   def_global(id, func);
 }
 
+void cedar::def_global(runes k, raw_function f) {
+  u64 id = symbol::intern(k);
+  ref func = new lambda(f);
+  def_global(id, func);
+}
+
 
 
 ref cedar::get_global(u64 id) {
   std::unique_lock<std::mutex> lock(g_lock);
 
   if (globals.count(id) != 0) {
-    return globals.at(id);
+    return *globals.at(id);
   }
   throw cedar::make_exception("Unable to find global variable ",
                               symbol::unintern(id));
   return nullptr;
 }
 
+ref *cedar::get_global_slot(u64 id) {
+  std::unique_lock<std::mutex> lock(g_lock);
+  auto it = globals.find(id);
+  if (it == globals.end()) return nullptr;
+  return it->second;
+}
+
 ref cedar::get_global(ref k) { return get_global(k.as<symbol>()->id); }
 
 ref cedar::get_global(runes k) { return get_global(symbol::intern(k)); }
@@ -0,0 +1,1448 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Nick Wanninger
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// the baseline JIT. Hot bytecode is translated instruction by instruction
+// into x86-64, keeping the interpreter's semantics and data layout: the
+// operand stack is an array of refs, but every push and pop is resolved to a
+// fixed offset at compile time. Small things (constants, slots, int
+// arithmetic and comparisons, branches) are inlined, and everything else
+// calls into the runtime helpers below
+
+#include <cedar/globals.h>
+#include <cedar/jit.h>
+#include <cedar/native_interface.h>
+#include <cedar/object/fiber.h>
+#include <cedar/object/lambda.h>
+#include <cedar/object/list.h>
+#include <cedar/object/module.h>
+#include <cedar/object/symbol.h>
+#include <cedar/objtype.h>
+#include <cedar/passes.h>
+#include <cedar/scheduler.h>
+#include <cedar/thread.h>
+#include <cedar/vm/binding.h>
+#include <cedar/vm/instruction.h>
+#include <cedar/vm/opcode.h>
+#include <alloca.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+using namespace cedar;
+using namespace cedar::jit;
+using namespace asmjit;
+using namespace asmjit::x86;
+
+
+// defined with the core bindings
+extern ref true_value;
+
+
+// the generated code pokes at refs directly, so it only knows the
+// uncompressed layout: the value in the first word, the flags after it
+static_assert(sizeof(ref) == 16 && offsetof(ref, m_flags) == 8,
+              "the baseline JIT needs uncompressed refs");
+#define REF_SIZE 16
+#define FLAGS_OFFSET 8
+#define INT_FLAGS (1 << FLAG_INT)
+#define FLOAT_FLAGS (1 << FLAG_FLOAT)
+#define NUMBER_FLAGS ((1 << FLAG_INT) | (1 << FLAG_FLOAT))
+
+
+thread_local int jit::native_depth = 0;
+
+
+
+
+// Every helper takes the frame, the top of the operand stack (where the
+// next push would go) as of the start of the instruction, and up to two
+// operands. They return a negative number if something was thrown, or the
+// call was handed back to the interpreter, which the generated code
+// answers by returning
+using helper = int (*)(native_frame *, ref *, i64, i64);
+
+#define HELPER(name) static int name(native_frame *f, ref *top, i64 a, i64 b)
+
+#define GUARDED(body)                       \
+  try {                                     \
+    body;                                   \
+  } catch (...) {                           \
+    f->error = std::current_exception();    \
+    return -1;                              \
+  }
+
+
+// the same cases as the interpreter's CALL_BODY
+void jit::call_value(ref *base, int argc, ref *self_ptr, ref default_self,
+                     fiber *fib, module *mod) {
+  ref *argv = base + 1;
+  call_context ctx;
+  ctx.coro = fib;
+  ctx.mod = mod;
+
+  if (base[0].isa(lambda_type)) {
+    auto *fn = base[0].reinterpret<lambda *>();
+    if (fn == nullptr) {
+      throw cedar::make_exception(
+          "Function to be run in call returned nullptr");
+    }
+    if (fn->code_type == lambda::bytecode_type) {
+      ref self = self_ptr != nullptr ? *self_ptr : fn->self;
+      // getting back into the interpreter means a whole new fiber, which
+      // costs more than compiling whatever native code calls
+      if (fn->code->jit_state.load(std::memory_order_relaxed) ==
+          vm::jit_untried)
+        tier_up(fn);
+      if (can_enter(fn->code)) {
+        base[0] = call_native(fn, self, argc, argv, fib);
+        return;
+      }
+      base[0] = call_method(fn, self, argc, argv, &ctx);
+      return;
+    }
+    if (fn->code_type == lambda::raw_function_type) {
+      ref self = self_ptr != nullptr ? *self_ptr : default_self;
+      fn->raw_binding(argc, argv, self, fib, base);
+      return;
+    }
+    if (fn->code_type == lambda::function_binding_type) {
+      function_callback c(self_ptr != nullptr ? *self_ptr : default_self,
+                          argc, argv, fib, mod);
+      fn->call(c);
+      base[0] = c.get_return();
+      return;
+    }
+  } else if (base[0].is<type>()) {
+    static auto __alloc__id = symbol::intern("__alloc__");
+    static auto new_id = symbol::intern("new");
+    type *cls = base[0].as<type>();
+    ref alloc_func_ref = cls->getattr_fast(__alloc__id);
+    ref inst = call_function(alloc_func_ref.as<lambda>(), 0, base, &ctx);
+    base[0] = inst;
+    ref new_self;
+    ref new_func_ref = lookup_method(inst, new_id, new_self);
+    if (!new_func_ref.is<lambda>()) {
+      throw cedar::make_exception("`new` method for ", ref{cls},
+                                  " is not a function");
+    }
+    call_method(new_func_ref.as<lambda>(), new_self, argc + 1, base, &ctx);
+    base[0] = inst;
+    return;
+  }
+  base[0] = self_callv(base[0], "apply", argc + 1, base);
+}
+
+
+static ref run_native(lambda *fn, ref self, closure *locals, int argc,
+                      ref *argv, fiber *fib, native_frame *caller,
+                      int handback, bool *handed_back);
+
+
+// Native code runs on the C stack of whatever called it, so it can't park
+// its fiber, and calls into bytecode that isn't compiled need the
+// interpreter. Rather than start a fiber of its own for those (and run a
+// whole scheduler inside the one it's on), native code hands what's left of
+// its call back to the fiber it runs on. Every native frame between the
+// interpreter and the one giving up becomes an interpreter frame, picking up
+// after the call it was making, and the interpreter carries on from the top
+// one. That takes an unbroken line of native calls back to the interpreter:
+// when C++ code is in the way, hand_back says no and the caller does what
+// it can in place.
+//
+// f picks up at address, with depth values on its operand stack
+static bool hand_back(native_frame *f, u64 address, int depth) {
+  if (address == JIT_NO_RESUME) return false;
+  std::vector<native_frame *> line;
+  for (native_frame *c = f; c->handback == handback_none; c = c->caller) {
+    line.push_back(c);
+    if (c->caller == nullptr || c->caller->resume_address == JIT_NO_RESUME)
+      return false;
+  }
+  native_frame *root = line.empty() ? f : line.back()->caller;
+  line.push_back(root);
+  if (f->fib == nullptr) return false;
+
+  for (auto it = line.rbegin(); it != line.rend(); it++) {
+    native_frame *c = *it;
+    u64 at = c == f ? address : c->resume_address;
+    int d = c == f ? depth : c->resume_depth;
+    // a loop that went native at a recur is still the fiber's top frame
+    if (c->handback == handback_replace)
+      f->fib->resume_at(c->fn, c->self, at, c->slots, c->stack, d, c->locals,
+                        c->entry_locals);
+    else
+      f->fib->resume_call(c->fn, c->self, at, c->slots, c->stack, d,
+                          c->locals, c->entry_locals);
+    c->handed_back = true;
+  }
+  return true;
+}
+
+
+// hand f back to the interpreter after the call it is making, along with
+// the call itself, which the interpreter starts. Returns the callee's frame
+// or nullptr if f couldn't be handed back
+static frame *hand_back_call(native_frame *f, call_state call) {
+  if (!hand_back(f, f->resume_address, f->resume_depth)) return nullptr;
+  return f->fib->push_call(call);
+}
+
+
+// the fiber's reductions have run out. Start a new budget, and say if the
+// fiber's worker wants it to yield, like the interpreter's REDUCE
+static bool yield_requested(native_frame *f) {
+  *f->reductions = REDUCTION_BUDGET;
+  fiber *fib = f->fib;
+  return fib != nullptr && fib->worker != nullptr &&
+         fib->worker->yield_requested.load(std::memory_order_relaxed);
+}
+
+static bool time_is_up(native_frame *f) {
+  return --*f->reductions <= 0 && yield_requested(f);
+}
+
+
+// jit::call_value for native code. Calls to bytecode go straight to its
+// native code, and the calls native code can't make (or that come when
+// the fiber should yield) are handed back to the interpreter. Returns true
+// if they were, and the code has to stop
+static bool call_value(native_frame *f, ref *base, int argc, ref *self_ptr) {
+  f->resume_depth = base - f->stack;
+  ref *argv = base + 1;
+
+  if (base[0].isa(lambda_type)) {
+    auto *fn = base[0].reinterpret<lambda *>();
+    if (fn != nullptr && fn->code_type == lambda::bytecode_type) {
+      ref self = self_ptr != nullptr ? *self_ptr : fn->self;
+      if (fn->code->heat()) tier_up(fn);
+      call_state call = fn->prime(argc, argv);
+      call.self = self;
+      bool native = can_enter(fn->code);
+      bool yield = native && time_is_up(f);
+      if (!native || yield) {
+        if (hand_back_call(f, call) != nullptr) {
+          // the interpreter parks the fiber before it starts the call
+          if (yield) f->fib->reductions = 0;
+          return true;
+        }
+        if (!native) {
+          base[0] = eval_lambda(call);
+          return false;
+        }
+      }
+      base[0] = run_native(fn, self, call.locals, argc, argv, f->fib, f,
+                           handback_none, nullptr);
+      return f->handed_back;
+    }
+  } else if (base[0].is<type>()) {
+    static auto __alloc__id = symbol::intern("__alloc__");
+    static auto new_id = symbol::intern("new");
+    call_context ctx;
+    ctx.coro = f->fib;
+    ctx.mod = f->mod;
+    type *cls = base[0].as<type>();
+    ref alloc_func_ref = cls->getattr_fast(__alloc__id);
+    ref inst = call_function(alloc_func_ref.as<lambda>(), 0, base, &ctx);
+    base[0] = inst;
+    ref new_self;
+    ref new_func_ref = lookup_method(inst, new_id, new_self);
+    if (!new_func_ref.is<lambda>()) {
+      throw cedar::make_exception("`new` method for ", ref{cls},
+                                  " is not a function");
+    }
+    lambda *new_func = new_func_ref.as<lambda>();
+    if (new_func->code_type == lambda::bytecode_type &&
+        !can_enter(new_func->code)) {
+      // new gets a frame of its own in the interpreter, like the
+      // interpreter's CALL would give it
+      call_state call = new_func->prime(argc + 1, base);
+      call.self = new_self;
+      frame *frm = hand_back_call(f, call);
+      if (frm != nullptr) {
+        frm->constructing = inst;
+        return true;
+      }
+      eval_lambda(call);
+      base[0] = inst;
+      return false;
+    }
+    call_method(new_func, new_self, argc + 1, base, &ctx);
+    base[0] = inst;
+    return false;
+  }
+  jit::call_value(base, argc, self_ptr, f->self, f->fib, f->mod);
+  return false;
+}
+
+
+HELPER(jit_load_local) {
+  GUARDED(top[0] = f->locals->at(a, b));
+  return 0;
+}
+
+HELPER(jit_set_local) {
+  GUARDED(f->locals->at(a, b) = top[-1]);
+  return 0;
+}
+
+HELPER(jit_load_global) {
+  auto *site = (std::atomic<vm::global_cache *> *)a;
+  GUARDED(top[0] = vm::load_global_slow(f->code, site, f->mod));
+  return 0;
+}
+
+HELPER(jit_set_global) {
+  GUARDED({
+    if (f->mod != nullptr) {
+      f->mod->setattr_fast(a, top[-1]);
+    } else {
+      def_global((u64)a, top[-1]);
+    }
+  });
+  return 0;
+}
+
+HELPER(jit_set_private) {
+  GUARDED(f->mod->set_private(a, top[-1]));
+  return 0;
+}
+
+HELPER(jit_cons) {
+  GUARDED(top[-2] = new list(top[-2], top[-1]));
+  return 0;
+}
+
+HELPER(jit_append) {
+  GUARDED(top[-2] = append(top[-1], top[-2]));
+  return 0;
+}
+
+HELPER(jit_call) {
+  GUARDED(if (call_value(f, top - a - 1, a, nullptr)) return -1);
+  return 0;
+}
+
+// a call in tail position. If it calls the function this code belongs to,
+// the frame is set up for the new call and 1 tells the code to start over,
+// so tail recursion runs in constant (native) stack like it does in the
+// interpreter
+HELPER(jit_tail_call) {
+  ref *base = top - a - 1;
+  GUARDED({
+    auto *callee = base[0].isa(lambda_type)
+                       ? base[0].reinterpret<lambda *>()
+                       : nullptr;
+    if (callee == nullptr || callee->code != f->code)
+      return call_value(f, base, a, nullptr) ? -1 : 0;
+    call_state call = callee->prime(a, base + 1);
+    f->fn = callee;
+    f->mod = callee->mod;
+    f->self = call.self;
+    f->locals = f->entry_locals = call.locals;
+    callee->bind_args(nullptr, f->slots, a, base + 1);
+  });
+  return 1;
+}
+
+HELPER(jit_invoke) {
+  auto *site = (vm::attr_cache *)a;
+  ref *base = top - b - 1;
+  GUARDED({
+    ref method_self;
+    site->receivers.record(base[1]);
+    base[0] = vm::lookup_method_cached(site, base[1], method_self);
+    if (call_value(f, base, b, &method_self)) return -1;
+  });
+  return 0;
+}
+
+HELPER(jit_make_func) {
+  GUARDED({
+    auto *template_ptr = (lambda *)f->code->constants[a].get();
+    lambda *function = template_ptr->copy();
+    function->m_closure = f->locals;
+    function->mod = f->mod;
+    function->self = f->self;
+    top[0] = function;
+  });
+  return 0;
+}
+
+HELPER(jit_make_scope) {
+  GUARDED(f->locals = new closure(a, f->locals));
+  return 0;
+}
+
+HELPER(jit_pop_scope) {
+  f->locals = f->locals->m_parent;
+  return 0;
+}
+
+HELPER(jit_recur) {
+  GUARDED({
+    if (a != f->fn->argc)
+      throw cedar::make_exception(
+          "recur call has invalid number of arguments. Given ", a,
+          " expected ", f->fn->argc);
+    // drop any scopes the recur is nested in
+    f->locals = f->entry_locals;
+    f->fn->bind_args(f->locals, f->slots, a, top - a);
+  });
+  return 0;
+}
+
+HELPER(jit_get_attr) {
+  auto *site = (vm::attr_cache *)a;
+  GUARDED({
+    ref obj = top[-1];
+    top[-1] = vm::getattr_cached(site, obj);
+  });
+  return 0;
+}
+
+HELPER(jit_set_attr) {
+  auto *site = (vm::attr_cache *)a;
+  GUARDED({
+    ref val = top[-1];
+    ref obj = top[-2];
+    vm::setattr_cached(site, obj, val);
+    top[-2] = val;
+  });
+  return 0;
+}
+
+HELPER(jit_get_module) {
+  top[0] = f->mod;
+  return 0;
+}
+
+HELPER(jit_get_current_func) {
+  top[0] = f->fn;
+  return 0;
+}
+
+// the arithmetic opcodes, for whatever the inline int paths don't handle
+HELPER(jit_arith) {
+  GUARDED({
+    switch (a) {
+      case OP_ADD:
+        top[-2] = top[-2] + top[-1];
+        break;
+      case OP_SUB:
+        top[-2] = top[-2] - top[-1];
+        break;
+      case OP_INC:
+        top[-1] = top[-1] + 1;
+        break;
+      case OP_DEC:
+        top[-1] = top[-1] - 1;
+        break;
+      case OP_NEG:
+        top[-1] = top[-1] * -1;
+        break;
+    }
+  });
+  return 0;
+}
+
+// is the object on top of the stack false? Returns 1 if so
+HELPER(jit_is_false) {
+  static ref false_val = new symbol("false");
+  GUARDED({
+    ref val = top[-1];
+    if (val.is_nil() || val == false_val) return 1;
+  });
+  return 0;
+}
+
+
+// give up on the native code for a call that broke one of its assumptions.
+// Everything the interpreter needs is already in memory (the slots, the
+// operand stack and the closures), so the call is handed back to the
+// fiber it runs on, and picked up at the instruction whose guard failed.
+// Returns false if it couldn't be, because C++ code made the call
+static bool deoptimize(native_frame *f, u64 address, int depth) {
+  vm::bytecode *code = f->code;
+  stats.deopts++;
+  code->deopts++;
+
+  // stop new calls from coming into code that has been shown wrong. It is
+  // compiled again once it gets hot, and without speculating if it keeps
+  // failing like this
+  u8 expected = vm::jit_compiled;
+  if (code->jit_state.compare_exchange_strong(expected, vm::jit_compiling)) {
+    code->native.store(nullptr, std::memory_order_release);
+    code->hotness.store(0, std::memory_order_relaxed);
+    code->jit_state.store(vm::jit_untried);
+  }
+
+  return hand_back(f, address, depth);
+}
+
+// the rest of a deoptimized call C++ code made, in a fiber of its own
+static ref finish_in_fiber(native_frame *f, u64 address, int depth) {
+  call_state call{f->fn, f->entry_locals, f->self, 0, nullptr};
+  auto *fib = new fiber(call);
+  fib->resume_at(f->fn, f->self, address, f->slots, f->stack, depth,
+                 f->locals, f->entry_locals);
+  return eval_fiber(fib);
+}
+
+
+// a back edge ran the fiber out of reductions. If its worker wants it to
+// yield, the loop is handed back to the interpreter at its head (address
+// a), which parks the fiber before going round again
+HELPER(jit_back_edge) {
+  if (!yield_requested(f) || !hand_back(f, a, 0)) return 0;
+  f->fib->reductions = 0;
+  return -1;
+}
+
+// a guard failed at the instruction at address a, with b values on the
+// operand stack. With nowhere to hand the call back to, the rest of it
+// runs in a fiber of its own, and what that returns is the result
+HELPER(jit_deopt) {
+  if (deoptimize(f, a, b)) return -1;
+  GUARDED(f->result = finish_in_fiber(f, a, b));
+  return 0;
+}
+
+
+
+
+// can the baseline JIT compile this opcode. The ones that park the fiber
+// (or leave the function some other way than returning) can't be done
+// without a fiber to park
+static bool compilable(u8 op) {
+  switch (op) {
+    case OP_SLEEP:
+    case OP_SEND:
+    case OP_RECV:
+    case OP_EVAL:
+    case OP_DEF_MACRO:
+    case OP_DICT_SET:
+    case OP_EXIT:
+    case OP_ARG_POP:
+    case OP_CALL_EXCEPTIONAL:
+      return false;
+  }
+  return op <= OP_GET_CURRENT_FUNC;
+}
+
+
+// how many values an instruction takes off the operand stack. Some may be
+// put back, but anything at or above depth - inputs can change
+static int stack_inputs(vm::instruction &in) {
+  switch (in.op) {
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return in.arg_int + 1;
+    case OP_INVOKE:
+      return in.arg_count + 1;
+    case OP_RECUR:
+      return in.arg_int;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_CONS:
+    case OP_APPEND:
+    case OP_SET_ATTR:
+    case OP_SWAP:
+      return 2;
+    case OP_INC:
+    case OP_DEC:
+    case OP_NEG:
+    case OP_GET_ATTR:
+    case OP_SET_GLOBAL:
+    case OP_SET_PRIVATE:
+    case OP_IS_CORE:
+    case OP_JUMP_IF_FALSE:
+    case OP_SKIP:
+    case OP_RETURN:
+      return 1;
+  }
+  return 0;
+}
+
+
+// the code checks the callee is still the same lambda before inlining it,
+// so rebinding the global later is fine
+lambda *jit::core_comparison_global(u64 id, vm::comparison *kind) {
+  ref *val = nullptr;
+  if (core_mod != nullptr) val = core_mod->find_slot(id);
+  if (val == nullptr) val = get_global_slot(id);
+  if (val == nullptr || !val->isa(lambda_type)) return nullptr;
+  auto *fn = val->reinterpret<lambda *>();
+  if (fn == nullptr || fn->code_type != lambda::raw_function_type)
+    return nullptr;
+  *kind = vm::core_comparison(fn->raw_binding);
+  return *kind == vm::compare_none ? nullptr : fn;
+}
+
+
+
+
+// translate a function's bytecode to machine code. Returns the code, mapped
+// executable, or nullptr if it uses something the JIT can't do. The
+// assembly is logged to `dump` if it isn't null.
+//
+// When speculating, the code assumes what the profiles say has always been
+// true is true: arguments only ever seen as ints are ints, and global
+// bindings don't move. Each assumption is checked by a guard at the start
+// of an instruction, which deoptimizes to the interpreter if it fails
+static void *compile_baseline(lambda *fn, size_t *size, FILE *dump,
+                              bool speculate) {
+  vm::bytecode *code = fn->code;
+  module *mod = fn->mod;
+  auto insts = vm::decode_bytecode(code);
+  bool consistent = true;
+  auto depths = vm::stack_depths(insts, nullptr, &consistent);
+  // every instruction has to be at one known depth for the stack offsets
+  // to be fixed
+  if (!consistent || insts.empty()) return nullptr;
+
+  std::unordered_map<u64, size_t> index;
+  for (size_t i = 0; i < insts.size(); i++) index[insts[i].address] = i;
+
+  std::vector<bool> jump_target(insts.size(), false);
+  // slots the code writes to itself, rather than only through bind_args
+  std::vector<bool> slot_written(code->slot_count, false);
+  for (auto &in : insts) {
+    std::vector<vm::instruction> single = {in};
+    for (auto &part : in.parts.empty() ? single : in.parts) {
+      if (!compilable(part.op)) return nullptr;
+      if (part.is_jump()) {
+        auto it = index.find(part.arg_int);
+        if (it == index.end()) return nullptr;
+        jump_target[it->second] = true;
+      }
+      if ((part.op == OP_SET_SLOT || part.op == OP_CLEAR_SLOT) &&
+          part.arg_int < code->slot_count)
+        slot_written[part.arg_int] = true;
+    }
+  }
+
+  // the arguments that can be assumed to be ints for the whole call. They
+  // are checked on the way in, and recur and self tail calls come back
+  // through the same check. A slot the code assigns could change type part
+  // way through, so those are left alone
+  std::vector<bool> int_slot(code->slot_count, false);
+  std::vector<int> int_args;
+  if (speculate) {
+    auto &captured = code->arg_closure_index;
+    int concrete = fn->vararg ? fn->argc - 1 : fn->argc;
+    for (int i = 0; i < concrete && i < TYPE_PROFILE_ARGS; i++) {
+      if (i >= code->slot_count || slot_written[i]) continue;
+      if (!captured.empty() && captured[i] >= 0) continue;
+      auto &prof = code->arg_types[i];
+      if (prof.monomorphic() != number_type ||
+          prof.number_kinds.load(std::memory_order_relaxed) != 1)
+        continue;
+      int_slot[i] = true;
+      int_args.push_back(i);
+    }
+  }
+
+  CodeHolder holder;
+  holder.init(CodeInfo(ArchInfo::kTypeHost));
+  FileLogger logger(dump);
+  if (dump != nullptr) holder.setLogger(&logger);
+  X86Compiler cc(&holder);
+
+  cc.addFunc(FuncSignature1<void, native_frame *>());
+  X86Gp f = cc.newIntPtr("frame");
+  cc.setArg(0, f);
+  X86Gp stk = cc.newIntPtr("stack");
+  X86Gp slots = cc.newIntPtr("slots");
+  cc.mov(stk, qword_ptr(f, offsetof(native_frame, stack)));
+  cc.mov(slots, qword_ptr(f, offsetof(native_frame, slots)));
+
+  Label bail = cc.newLabel();
+  std::vector<Label> labels;
+  for (size_t i = 0; i < insts.size(); i++) labels.push_back(cc.newLabel());
+  auto label_at = [&](u64 addr) { return labels[index.at(addr)]; };
+
+  // where a failed guard at the start of each instruction goes. The stubs
+  // are emitted out of line, after the rest of the code
+  std::map<size_t, Label> deopt_exits;
+  auto deopt_exit = [&](size_t i) {
+    auto it = deopt_exits.find(i);
+    if (it != deopt_exits.end()) return it->second;
+    Label l = cc.newLabel();
+    deopt_exits[i] = l;
+    return l;
+  };
+
+
+  // copy a ref, addressed by a base register and a byte offset
+  auto copy = [&](X86Gp dst, int doff, X86Gp src, int soff) {
+    X86Gp t = cc.newGpq();
+    cc.mov(t, qword_ptr(src, soff));
+    cc.mov(qword_ptr(dst, doff), t);
+    cc.mov(t, qword_ptr(src, soff + FLAGS_OFFSET));
+    cc.mov(qword_ptr(dst, doff + FLAGS_OFFSET), t);
+  };
+  auto copy_from = [&](int d, void *src) {
+    X86Gp p = cc.newIntPtr();
+    cc.mov(p, imm_ptr(src));
+    copy(stk, d * REF_SIZE, p, 0);
+  };
+  auto store_value = [&](X86Gp base, int off, i64 bits, u8 flags) {
+    X86Gp t = cc.newGpq();
+    cc.mov(t, Imm(bits));
+    cc.mov(qword_ptr(base, off), t);
+    cc.mov(byte_ptr(base, off + FLAGS_OFFSET), Imm(flags));
+  };
+  auto value = [&](int d) { return qword_ptr(stk, d * REF_SIZE); };
+  auto flags = [&](int d) {
+    return byte_ptr(stk, d * REF_SIZE + FLAGS_OFFSET);
+  };
+
+  // call a helper with the stack top at depth d. Bails if it threw, and
+  // hands back what it returned otherwise
+  auto call_helper = [&](helper fn, int d, i64 a, i64 b) {
+    X86Gp top = cc.newIntPtr();
+    X86Gp ra = cc.newI64();
+    X86Gp rb = cc.newI64();
+    X86Gp ret = cc.newI32();
+    cc.lea(top, qword_ptr(stk, d * REF_SIZE));
+    cc.mov(ra, Imm(a));
+    cc.mov(rb, Imm(b));
+    auto *call = cc.call(
+        imm_ptr((void *)fn),
+        FuncSignature4<int, native_frame *, ref *, i64, i64>());
+    call->setArg(0, f);
+    call->setArg(1, top);
+    call->setArg(2, ra);
+    call->setArg(3, rb);
+    call->setRet(0, ret);
+    cc.test(ret, ret);
+    cc.js(bail);
+    return ret;
+  };
+
+  // a call at instruction i picks up at the next one if it's handed back to
+  // the interpreter. A call is always the last part of a superinstruction,
+  // so that's the start of an instruction the interpreter can go to
+  auto set_resume = [&](size_t i) {
+    X86Gp t = cc.newGpq();
+    cc.mov(t, Imm(i + 1 < insts.size() ? insts[i + 1].address : JIT_NO_RESUME));
+    cc.mov(qword_ptr(f, offsetof(native_frame, resume_address)), t);
+  };
+
+  // a back edge to the top of the code spends a reduction, and when they
+  // run out the helper checks in with the scheduler like REDUCE does
+  auto back_edge = [&]() {
+    X86Gp r = cc.newIntPtr();
+    cc.mov(r, qword_ptr(f, offsetof(native_frame, reductions)));
+    cc.sub(dword_ptr(r), Imm(1));
+    cc.jg(labels[0]);
+    call_helper(jit_back_edge, 0, insts[0].address, 0);
+    cc.jmp(labels[0]);
+  };
+
+  // the stack entries known to hold ints, so their flags needn't be checked.
+  // Forgotten like pushed_by below
+  std::vector<bool> known_int(code->stack_size + 1, false);
+
+  // an inline int op on the top one or two values, with the helper as the
+  // way out for anything that isn't an int. lhs and rhs say if the operands
+  // are already known to be, and if both are there is no way out at all.
+  // Returns if the result is known to be an int
+  auto int_op = [&](u8 op, int d, bool lhs, bool rhs) {
+    Label slow = cc.newLabel();
+    Label done = cc.newLabel();
+    bool binary = op == OP_ADD || op == OP_SUB;
+    int res = binary ? d - 2 : d - 1;
+    bool checked = !rhs || (binary && !lhs);
+    if (!rhs) {
+      cc.cmp(flags(d - 1), Imm(INT_FLAGS));
+      cc.jne(slow);
+    }
+    if (binary && !lhs) {
+      cc.cmp(flags(d - 2), Imm(INT_FLAGS));
+      cc.jne(slow);
+    }
+    X86Gp t = cc.newGpq();
+    cc.mov(t, value(res));
+    // ints wrap, like ref::binary_op's do
+    switch (op) {
+      case OP_ADD:
+        cc.add(t, value(d - 1));
+        break;
+      case OP_SUB:
+        cc.sub(t, value(d - 1));
+        break;
+      case OP_INC:
+        cc.add(t, Imm(1));
+        break;
+      case OP_DEC:
+        cc.sub(t, Imm(1));
+        break;
+    }
+    cc.mov(value(res), t);
+    if (!checked) return true;
+    cc.jmp(done);
+    cc.bind(slow);
+    if (binary) {
+      // two floats are common enough in numeric loops to do inline too
+      Label generic = cc.newLabel();
+      cc.cmp(flags(d - 1), Imm(FLOAT_FLAGS));
+      cc.jne(generic);
+      cc.cmp(flags(d - 2), Imm(FLOAT_FLAGS));
+      cc.jne(generic);
+      X86Xmm x = cc.newXmmSd();
+      cc.movsd(x, value(res));
+      if (op == OP_ADD)
+        cc.addsd(x, value(d - 1));
+      else
+        cc.subsd(x, value(d - 1));
+      cc.movsd(value(res), x);
+      cc.jmp(done);
+      cc.bind(generic);
+    }
+    call_helper(jit_arith, d, op, 0);
+    cc.bind(done);
+    return false;
+  };
+
+  // a (< a b) style call with the callee at d - 3, when the callee is the
+  // core's comparison and both arguments are ints. ref::compare orders ints
+  // by the sign of the low 32 bits of their difference, so this does too
+  auto compare = [&](lambda *fn, vm::comparison kind, int d, Label slow,
+                     bool lhs, bool rhs) {
+    Label yes = cc.newLabel();
+    Label done = cc.newLabel();
+    X86Gp t = cc.newGpq();
+    cc.mov(t, imm_ptr(fn));
+    cc.cmp(value(d - 3), t);
+    cc.jne(slow);
+    cc.cmp(flags(d - 3), Imm(0));
+    cc.jne(slow);
+    if (!lhs) {
+      cc.cmp(flags(d - 2), Imm(INT_FLAGS));
+      cc.jne(slow);
+    }
+    if (!rhs) {
+      cc.cmp(flags(d - 1), Imm(INT_FLAGS));
+      cc.jne(slow);
+    }
+    cc.mov(t, value(d - 2));
+    cc.sub(t, value(d - 1));
+    cc.test(t.r32(), t.r32());
+    switch (kind) {
+      case vm::compare_lt:
+        cc.js(yes);
+        break;
+      case vm::compare_lte:
+        cc.jle(yes);
+        break;
+      case vm::compare_gt:
+        cc.jg(yes);
+        break;
+      default:
+        cc.jge(yes);
+        break;
+    }
+    store_value(stk, (d - 3) * REF_SIZE, 0, 0);
+    cc.jmp(done);
+    cc.bind(yes);
+    copy_from(d - 3, &true_value);
+    cc.jmp(done);
+    return done;
+  };
+
+
+  // the global site that pushed each stack entry, if one did, so calls can
+  // tell what they are calling. Forgotten whenever the entry might change
+  std::vector<int> pushed_by(code->stack_size + 1, -1);
+
+  for (size_t i = 0; i < insts.size(); i++) {
+    auto &in = insts[i];
+    cc.bind(labels[i]);
+    if (depths[i] == INT_MIN) continue;
+    // values can come in from other paths at a jump target
+    if (jump_target[i]) {
+      std::fill(pushed_by.begin(), pushed_by.end(), -1);
+      std::fill(known_int.begin(), known_int.end(), false);
+    }
+
+    // every way into the call (entry, recur and self tail calls) starts
+    // here, so this is where the arguments are checked
+    if (i == 0) {
+      for (int a : int_args) {
+        cc.cmp(byte_ptr(slots, a * REF_SIZE + FLAGS_OFFSET), Imm(INT_FLAGS));
+        cc.jne(deopt_exit(0));
+      }
+    }
+
+    int d = depths[i];
+    std::vector<vm::instruction> single = {in};
+    bool first = true;
+    for (auto &part : in.parts.empty() ? single : in.parts) {
+      // a guard can only send the interpreter to the start of an
+      // instruction, not into the middle of a superinstruction
+      bool can_guard = speculate && first;
+      first = false;
+      int site = -1;
+      bool lhs_int = false, rhs_int = false;
+      if (part.op == OP_CALL && part.arg_int == 2 && d >= 3)
+        site = pushed_by[d - 3];
+      if (d >= 2) {
+        lhs_int = known_int[d - 2];
+        rhs_int = known_int[d - 1];
+      } else if (d >= 1) {
+        rhs_int = known_int[d - 1];
+      }
+      for (int k = std::max(0, d - stack_inputs(part)); k < (int)pushed_by.size();
+           k++) {
+        pushed_by[k] = -1;
+        known_int[k] = false;
+      }
+
+      switch (part.op) {
+        case OP_NOP:
+          break;
+
+        case OP_NIL:
+          store_value(stk, d * REF_SIZE, 0, 0);
+          break;
+
+        case OP_CONST:
+          copy_from(d, &code->constants[part.arg_int]);
+          break;
+
+        case OP_FLOAT: {
+          double flt = part.arg_float;
+          i64 bits;
+          memcpy(&bits, &flt, sizeof(bits));
+          store_value(stk, d * REF_SIZE, bits, 1 << FLAG_FLOAT);
+          break;
+        }
+
+        case OP_INT:
+        case OP_INT_8:
+          store_value(stk, d * REF_SIZE, part.arg_int, INT_FLAGS);
+          known_int[d] = true;
+          break;
+
+        case OP_INT_NEG_1:
+        case OP_INT_0:
+        case OP_INT_1:
+        case OP_INT_2:
+        case OP_INT_3:
+        case OP_INT_4:
+        case OP_INT_5:
+          store_value(stk, d * REF_SIZE, (i64)part.op - OP_INT_0, INT_FLAGS);
+          known_int[d] = true;
+          break;
+
+        case OP_LOAD_LOCAL:
+          call_helper(jit_load_local, d, part.arg_slot, part.arg_int);
+          break;
+
+        case OP_SET_LOCAL:
+          call_helper(jit_set_local, d, part.arg_slot, part.arg_int);
+          break;
+
+        case OP_LOAD_SLOT:
+          copy(stk, d * REF_SIZE, slots, part.arg_int * REF_SIZE);
+          known_int[d] = part.arg_int < code->slot_count && int_slot[part.arg_int];
+          break;
+
+        case OP_SET_SLOT:
+          copy(slots, part.arg_int * REF_SIZE, stk, (d - 1) * REF_SIZE);
+          break;
+
+        case OP_CLEAR_SLOT:
+          store_value(slots, part.arg_int * REF_SIZE, 0, 0);
+          break;
+
+        case OP_LOAD_GLOBAL: {
+          auto *site = &code->global_caches[part.arg_slot];
+          vm::global_cache *entry = site->load(std::memory_order_acquire);
+          if (can_guard && entry != nullptr && mod != nullptr &&
+              entry->mod == mod && entry->mod_layout == mod->layout.load() &&
+              (core_mod == nullptr ||
+               entry->core_layout == core_mod->layout.load())) {
+            // assume the binding the interpreter found stays put, and read
+            // it straight from its cell. The cell only changes, or gets
+            // shadowed, when the module or the core changes layout, so
+            // those are all the guard watches
+            X86Gp t = cc.newGpq();
+            X86Gp e = cc.newGpq();
+            auto watch = [&](module *m, u64 layout) {
+              cc.mov(t, imm_ptr(&m->layout));
+              cc.mov(t, qword_ptr(t));
+              cc.mov(e, Imm(layout));
+              cc.cmp(t, e);
+              cc.jne(deopt_exit(i));
+            };
+            watch(mod, entry->mod_layout);
+            if (core_mod != nullptr && core_mod != mod)
+              watch(core_mod, entry->core_layout);
+            cc.mov(t, qword_ptr(f, offsetof(native_frame, mod)));
+            cc.mov(e, imm_ptr(mod));
+            cc.cmp(t, e);
+            cc.jne(deopt_exit(i));
+            cc.mov(e, imm_ptr(entry->slot));
+            copy(stk, d * REF_SIZE, e, 0);
+            pushed_by[d] = part.arg_slot;
+            break;
+          }
+          // the interpreter's inline cache check, with the same cache
+          Label slow = cc.newLabel();
+          Label done = cc.newLabel();
+          X86Gp c = cc.newIntPtr();
+          X86Gp t = cc.newIntPtr();
+          cc.mov(t, imm_ptr(site));
+          cc.mov(c, qword_ptr(t));
+          cc.test(c, c);
+          cc.jz(slow);
+          cc.mov(t, qword_ptr(f, offsetof(native_frame, mod)));
+          cc.cmp(qword_ptr(c, offsetof(vm::global_cache, mod)), t);
+          cc.jne(slow);
+          cc.mov(t, imm_ptr(&binding_version));
+          cc.mov(t, qword_ptr(t));
+          cc.cmp(qword_ptr(c, offsetof(vm::global_cache, version)), t);
+          cc.jne(slow);
+          cc.mov(c, qword_ptr(c, offsetof(vm::global_cache, slot)));
+          copy(stk, d * REF_SIZE, c, 0);
+          cc.jmp(done);
+          cc.bind(slow);
+          call_helper(jit_load_global, d, (i64)site, 0);
+          cc.bind(done);
+          pushed_by[d] = part.arg_slot;
+          break;
+        }
+
+        case OP_SET_GLOBAL:
+          call_helper(jit_set_global, d, part.arg_int, 0);
+          break;
+
+        case OP_SET_PRIVATE:
+          call_helper(jit_set_private, d, part.arg_int, 0);
+          break;
+
+        case OP_CONS:
+          call_helper(jit_cons, d, 0, 0);
+          break;
+
+        case OP_APPEND:
+          call_helper(jit_append, d, 0, 0);
+          break;
+
+        case OP_CALL: {
+          vm::comparison kind = vm::compare_none;
+          lambda *cmp =
+              site < 0 ? nullptr
+                       : core_comparison_global(code->global_names[site], &kind);
+          if (cmp != nullptr) {
+            Label slow = cc.newLabel();
+            Label done = compare(cmp, kind, d, slow, lhs_int, rhs_int);
+            cc.bind(slow);
+            set_resume(i);
+            call_helper(jit_call, d, part.arg_int, 0);
+            cc.bind(done);
+          } else {
+            set_resume(i);
+            call_helper(jit_call, d, part.arg_int, 0);
+          }
+          break;
+        }
+
+        case OP_TAIL_CALL: {
+          Label next = cc.newLabel();
+          set_resume(i);
+          X86Gp ret = call_helper(jit_tail_call, d, part.arg_int, 0);
+          cc.cmp(ret, Imm(0));
+          cc.je(next);
+          back_edge();
+          cc.bind(next);
+          break;
+        }
+
+        case OP_MAKE_FUNC:
+          call_helper(jit_make_func, d, part.arg_int, 0);
+          break;
+
+        case OP_MAKE_SCOPE:
+          call_helper(jit_make_scope, d, part.arg_int, 0);
+          break;
+
+        case OP_POP_SCOPE:
+          call_helper(jit_pop_scope, d, 0, 0);
+          break;
+
+        case OP_RETURN:
+          copy(f, offsetof(native_frame, result), stk, (d - 1) * REF_SIZE);
+          cc.ret();
+          break;
+
+        case OP_SKIP:
+          break;
+
+        case OP_JUMP:
+          cc.jmp(label_at(part.arg_int));
+          break;
+
+        case OP_JUMP_IF_FALSE: {
+          // numbers are always true, and nil is always false. Objects other
+          // than the true symbol need a real check
+          Label target = label_at(part.arg_int);
+          Label next = cc.newLabel();
+          cc.test(flags(d - 1), Imm(NUMBER_FLAGS));
+          cc.jnz(next);
+          X86Gp v = cc.newIntPtr();
+          X86Gp t = cc.newIntPtr();
+          cc.mov(v, value(d - 1));
+          cc.test(v, v);
+          cc.jz(target);
+          cc.mov(t, imm_ptr(true_value.m_obj));
+          cc.cmp(v, t);
+          cc.je(next);
+          X86Gp ret = call_helper(jit_is_false, d, 0, 0);
+          cc.cmp(ret, Imm(0));
+          cc.jne(target);
+          cc.bind(next);
+          break;
+        }
+
+        case OP_RECUR:
+          call_helper(jit_recur, d, part.arg_int, 0);
+          back_edge();
+          break;
+
+        case OP_DUP:
+          copy(stk, d * REF_SIZE, stk, (d - part.arg_int) * REF_SIZE);
+          known_int[d] = known_int[d - part.arg_int];
+          break;
+
+        case OP_SWAP: {
+          X86Gp a = cc.newGpq();
+          X86Gp b = cc.newGpq();
+          for (int off = 0; off <= FLAGS_OFFSET; off += FLAGS_OFFSET) {
+            cc.mov(a, qword_ptr(stk, (d - 1) * REF_SIZE + off));
+            cc.mov(b, qword_ptr(stk, (d - 2) * REF_SIZE + off));
+            cc.mov(qword_ptr(stk, (d - 2) * REF_SIZE + off), a);
+            cc.mov(qword_ptr(stk, (d - 1) * REF_SIZE + off), b);
+          }
+          break;
+        }
+
+        case OP_GET_ATTR:
+          call_helper(jit_get_attr, d, (i64)&code->attr_caches[part.arg_slot],
+                      0);
+          break;
+
+        case OP_SET_ATTR:
+          call_helper(jit_set_attr, d, (i64)&code->attr_caches[part.arg_slot],
+                      0);
+          break;
+
+        case OP_INVOKE:
+          set_resume(i);
+          call_helper(jit_invoke, d, (i64)&code->attr_caches[part.arg_slot],
+                      part.arg_count);
+          break;
+
+        case OP_GET_MODULE:
+          call_helper(jit_get_module, d, 0, 0);
+          break;
+
+        case OP_ADD:
+        case OP_SUB:
+          known_int[d - 2] = int_op(part.op, d, lhs_int, rhs_int);
+          break;
+
+        case OP_INC:
+        case OP_DEC:
+          known_int[d - 1] = int_op(part.op, d, false, rhs_int);
+          break;
+
+        case OP_NEG:
+          call_helper(jit_arith, d, OP_NEG, 0);
+          break;
+
+        case OP_LOAD_SELF:
+          copy(stk, d * REF_SIZE, f, offsetof(native_frame, self));
+          break;
+
+        case OP_GET_CURRENT_FUNC:
+          call_helper(jit_get_current_func, d, 0, 0);
+          break;
+
+        case OP_IS_CORE: {
+          // the compiler only emits this for originals that were recorded,
+          // so comparing the value and flags is all is_core_original does
+          Label no = cc.newLabel();
+          Label done = cc.newLabel();
+          X86Gp p = cc.newIntPtr();
+          X86Gp t = cc.newGpq();
+          cc.mov(p, imm_ptr(&core_originals[part.arg_int]));
+          cc.mov(t, qword_ptr(p));
+          cc.cmp(t, value(d - 1));
+          cc.jne(no);
+          cc.movzx(t.r32(), byte_ptr(p, FLAGS_OFFSET));
+          cc.cmp(flags(d - 1), t.r8());
+          cc.jne(no);
+          copy_from(d - 1, &true_value);
+          cc.jmp(done);
+          cc.bind(no);
+          store_value(stk, (d - 1) * REF_SIZE, 0, 0);
+          cc.bind(done);
+          break;
+        }
+      }
+      d += vm::stack_effect(part);
+    }
+  }
+
+  for (auto &exit : deopt_exits) {
+    size_t i = exit.first;
+    cc.bind(exit.second);
+    call_helper(jit_deopt, depths[i], insts[i].address, depths[i]);
+    cc.ret();
+  }
+
+  // running off the end of the code, and anything that threw, just returns
+  cc.bind(bail);
+  cc.ret();
+  cc.endFunc();
+  if (cc.finalize() != kErrorOk) return nullptr;
+
+  *size = holder.getCodeSize();
+  void *mem =
+      mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+  if (mem == MAP_FAILED) return nullptr;
+  holder.relocate(mem);
+  // a host that won't make the pages executable leaves the function in the
+  // interpreter, which compile_queued counts as a failure
+  if (mprotect(mem, *size, PROT_EXEC | PROT_READ) != 0) {
+    munmap(mem, *size);
+    return nullptr;
+  }
+  return mem;
+}
+
+
+
+
+jit::jit_stats jit::stats;
+
+
+// compile one queued function and swap the native code in. The handle is
+// published before the entry point, so anyone who sees `native` can also
+// see what keeps it alive
+static void compile_queued(lambda *fn) {
+  vm::bytecode *code = fn->code;
+  std::string name;
+  if (describing()) name = code_name(fn->name, fn->defining, fn->mod);
+  FILE *dump = open_dump(name);
+
+  auto start = std::chrono::steady_clock::now();
+  size_t size = 0;
+  void *mem = nullptr;
+  try {
+    // code that keeps breaking its assumptions isn't worth speculating on
+    bool speculate = code->deopts.load() < JIT_MAX_DEOPTS;
+    mem = compile_baseline(fn, &size, dump, speculate);
+  } catch (...) {
+    mem = nullptr;
+  }
+  auto took = std::chrono::steady_clock::now() - start;
+  stats.compile_ns +=
+      std::chrono::duration_cast<std::chrono::nanoseconds>(took).count();
+  if (dump != nullptr) fclose(dump);
+
+  if (mem == nullptr) {
+    stats.failed++;
+    code->jit_state.store(vm::jit_failed);
+    return;
+  }
+  describe_code(mem, size, {{name, 0, size}});
+  auto *handle = new code_handle(mem, size);
+  handle->previous = code->native_handle;
+  code->native_handle = handle;
+  code->native.store((vm::native_code)mem, std::memory_order_release);
+  code->jit_state.store(vm::jit_compiled);
+  stats.compiled++;
+}
+
+
+static std::mutex queue_lock;
+static std::condition_variable queue_cv;
+static std::deque<lambda *> *queue;
+static std::once_flag compile_thread_started;
+
+
+static void compile_thread(void) {
+  register_thread();
+  while (true) {
+    lambda *fn;
+    {
+      std::unique_lock<std::mutex> lock(queue_lock);
+      queue_cv.wait(lock, [] { return !queue->empty(); });
+      fn = queue->front();
+      queue->pop_front();
+      stats.queue_depth--;
+    }
+    compile_queued(fn);
+  }
+}
+
+
+void jit::tier_up(lambda *fn) {
+  vm::bytecode *code = fn->code;
+  static bool disabled = getenv("CDRNOJIT") != nullptr;
+  static bool sync = getenv("CDRJITSYNC") != nullptr;
+  if (disabled) return;
+
+  // only one caller gets to queue it, the rest keep interpreting
+  u8 expected = vm::jit_untried;
+  if (!code->jit_state.compare_exchange_strong(expected, vm::jit_compiling))
+    return;
+
+  if (sync) {
+    stats.queued++;
+    compile_queued(fn);
+    return;
+  }
+
+  std::call_once(compile_thread_started, [] {
+    queue = new std::deque<lambda *>();
+    std::thread(compile_thread).detach();
+  });
+
+  {
+    std::unique_lock<std::mutex> lock(queue_lock);
+    if (queue->size() < JIT_QUEUE_SIZE) {
+      queue->push_back(fn);
+      stats.queue_depth++;
+      stats.queued++;
+      lock.unlock();
+      queue_cv.notify_one();
+      return;
+    }
+  }
+
+  // the queue is full. Start the code cooling off again so it gets
+  // another chance once the compile thread has caught up
+  stats.dropped++;
+  code->hotness.store(0, std::memory_order_relaxed);
+  code->jit_state.store(vm::jit_untried);
+}
+
+
+
+
+// run a function's native code, with the captured arguments already in
+// locals. The rest go in the slots like in fiber::bind_frame. caller is the
+// native frame making the call, if there is one, and handed_back (if not
+// null) is set if the call was handed back to the fiber's interpreter
+static ref run_native(lambda *fn, ref self, closure *locals, int argc,
+                      ref *argv, fiber *fib, native_frame *caller,
+                      int handback, bool *handed_back) {
+  static thread_local int spare_reductions = REDUCTION_BUDGET;
+  vm::bytecode *code = fn->code;
+  native_frame f;
+  f.fn = fn;
+  f.code = code;
+  f.mod = fn->mod;
+  f.self = self;
+  f.locals = f.entry_locals = locals;
+  f.fib = fib;
+  f.caller = caller;
+  f.resume_address = JIT_NO_RESUME;
+  f.resume_depth = 0;
+  f.handback = fib != nullptr ? handback : handback_none;
+  f.handed_back = false;
+  f.reductions = fib != nullptr ? &fib->reductions : &spare_reductions;
+
+  // the slots and the operand stack live on the native stack
+  int count = code->slot_count + code->stack_size;
+  ref *space = (ref *)alloca(count * sizeof(ref));
+  for (int i = 0; i < count; i++) new (space + i) ref();
+  f.slots = space;
+  f.stack = space + code->slot_count;
+  fn->bind_args(nullptr, f.slots, argc, argv);
+
+  // the code may have deoptimized since the caller checked for it, in
+  // which case the interpreter starts the call instead
+  vm::native_code entry = code->native.load(std::memory_order_acquire);
+  if (entry == nullptr) {
+    if (hand_back(&f, 0, 0)) {
+      if (handed_back != nullptr) *handed_back = true;
+      return nullptr;
+    }
+    call_state call{fn, locals, self, argc, argv};
+    return eval_lambda(call);
+  }
+
+  native_depth++;
+  entry(&f);
+  native_depth--;
+
+  if (f.error) std::rethrow_exception(f.error);
+  if (handed_back != nullptr) *handed_back = f.handed_back;
+  return f.result;
+}
+
+
+ref jit::call_native(lambda *fn, ref self, int argc, ref *argv, fiber *fib) {
+  // prime profiles the arguments and builds the closure for the captured
+  // ones
+  call_state call = fn->prime(argc, argv);
+  return run_native(fn, self, call.locals, argc, argv, fib, nullptr,
+                    handback_none, nullptr);
+}
+
+
+bool jit::enter_native(lambda *fn, ref self, int argc, ref *argv,
+                       fiber *fib, ref *result) {
+  call_state call = fn->prime(argc, argv);
+  bool handed_back = false;
+  *result = run_native(fn, self, call.locals, argc, argv, fib, nullptr,
+                       handback_push, &handed_back);
+  return !handed_back;
+}
+
+
+bool jit::enter_at_recur(lambda *fn, ref self, closure *locals, int argc,
+                         ref *argv, fiber *fib, ref *result) {
+  // the interpreter's recur would bind the captured arguments into the
+  // closure its frame started with, so they go there too
+  if (fn->code->closure_size != 0) fn->bind_args(locals, nullptr, argc, argv);
+  bool handed_back = false;
+  *result = run_native(fn, self, locals, argc, argv, fib, nullptr,
+                       handback_replace, &handed_back);
+  return !handed_back;
+}
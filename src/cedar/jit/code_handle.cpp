@@ -29,44 +29,20 @@ using namespace cedar;
 using namespace cedar::jit;
 
 
-code_handle::code_handle(void *c, size_t s) {
-  compiled = true;
-  size = s;
-  code = c;
-}
-
-
-code_handle::code_handle(ref e, module *m) {
-  compiled = false;
-  expr = e;
-  mod = m;
-}
-
+code_handle::code_handle(void *c, size_t s) { adopt(c, s); }
 
-void code_handle::apply(const function_callback &cb) {
-  // if the object is not compiled, try to get a lock in order to compile
-  // it. Then once we have the lock, check again as some other thread
-  // could have done the compilation while we were waiting on it.
-  if (!compiled) {
-    std::unique_lock lk(compile_lock);
-    if (!compiled) {
-      // TODO delayed compilation
-      compiler c(expr);
-      code = c.run(mod, &size);
-      compiled = true;
-    }
-  }
 
-  // the code is now compiled for sure
-  calls++;
-  cb.get_return() = 1;
-  return ptr_as_func<jit_function_handle>(code)(cb);
+void code_handle::adopt(void *c, size_t s) {
+  code = c;
+  size = s;
+  if (code != nullptr) stats.code_bytes += size;
 }
 
 
 code_handle::~code_handle(void) {
   if (code != nullptr) {
+    forget_code(code);
     munmap(code, size);
-    printf("code handle deleted %zu %p. %d calls\n", size, code, calls.load());
+    stats.code_bytes -= size;
   }
 }
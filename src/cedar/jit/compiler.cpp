@@ -23,18 +23,32 @@
  */
 
 
+// the AST JIT. A top level form is parsed into an AST (see ast.h), which
+// knows which variables escape into closures and which can live in a
+// function's frame, and every function in it is compiled straight to
+// x86-64. A compiled function is wrapped in a natively bound lambda, so the
+// interpreter, the baseline JIT and the runtime can call it like any other
+// native function
+
+#include <cedar/ast.h>
 #include <cedar/globals.h>
 #include <cedar/jit.h>
 #include <cedar/native_interface.h>
+#include <cedar/object/fiber.h>
 #include <cedar/object/lambda.h>
 #include <cedar/object/list.h>
 #include <cedar/object/module.h>
-#include <cedar/object/string.h>
 #include <cedar/object/symbol.h>
 #include <cedar/objtype.h>
 #include <cedar/parser.h>
+#include <cedar/passes.h>
 #include <cedar/scheduler.h>
-#include <mutex>
+#include <cedar/simd.h>
+#include <cedar/vm/compiler.h>
+#include <cedar/vm/machine.h>
+#include <alloca.h>
+#include <cstddef>
+#include <cstdlib>
 #include <string>
 #include <vector>
 
@@ -45,529 +59,1165 @@ using namespace asmjit;
 using namespace asmjit::x86;
 
 
-// static JitRuntime rt;
+// defined with the core bindings
+extern ref true_value;
 
-#define JIT_DEBUG
-#define JIT_REG_DEBUG
 
-#ifdef JIT_DEBUG
-#define COMMENT(m) cc.comment(";; " m)
-#else
-#define COMMENT(m)
-#endif
-
-#define REG_DEBUG(name) debug_reg_print(cc, name, #name);
-static void debug_reg_print(X86Compiler &cc, reg r, const char *msg) {
-#ifdef JIT_JIT_DEBUG
-  COMMENT("++++++ DEBUG ++++++");
-  auto call =
-      cc.call(imm_ptr(printf),
-              FuncSignature3<int, const char *, const char *, uint64_t>());
-  call->setArg(0, imm_ptr("[JIT DEBUG] %16x: %s\n"));
-  call->setArg(1, r);
-  call->setArg(2, imm_ptr(msg));
-  COMMENT("------ DEBUG ------");
-#endif
-}
+// like the baseline JIT, the generated code only knows the uncompressed
+// ref layout
+static_assert(sizeof(ref) == 16 && offsetof(ref, m_flags) == 8,
+              "the AST JIT needs uncompressed refs");
+#define REF_SIZE 16
+#define FLAGS_OFFSET 8
+#define INT_FLAGS (1 << FLAG_INT)
+#define FLOAT_FLAGS (1 << FLAG_FLOAT)
+#define NUMBER_FLAGS (INT_FLAGS | FLOAT_FLAGS)
 
 
 
-typedef void (*binary_func)(ref &, ref &, ref &);
 
-// various binary operations on the JIT. This needs to be done because the
-// jit cannot access or call virtual methods on a ref
-static void jit_do_add(ref &dst, ref &a, ref &b) { dst = a + b; }
-static void jit_do_sub(ref &dst, ref &a, ref &b) { dst = a - b; }
-static void jit_do_mul(ref &dst, ref &a, ref &b) { dst = a * b; }
-static void jit_do_div(ref &dst, ref &a, ref &b) { dst = a / b; }
+static ref run_function(ast_function *, lambda *, closure *, module *,
+                        ref self, int argc, ref *argv, fiber *);
 
 
+// what a lambda made from an ast_function calls. The lambda fills itself
+// in right after it's made, for *func*
+struct ast_closure {
+  ast_function *fn;
+  closure *env;
+  module *mod;
+  lambda *func;
 
-static reg alloc_ref(X86Compiler &cc) {
-  COMMENT("+ alloc_ref");
-  auto mem = cc.newStack(sizeof(ref), 8, "stack");
-  mem.setSize(sizeof(ref));
-  auto addr = cc.newIntPtr();
-  cc.lea(addr, mem);
-  debug_reg_print(cc, addr, "alloc_ref addr");
-  COMMENT("- alloc_ref");
-  return addr;
+  void operator()(const function_callback &cb) const {
+    cb.get_return() = run_function(fn, func, env, mod, cb.self(), cb.len(),
+                                   cb.argv(), cb.get_fiber());
+  }
+};
+
+
+static lambda *make_function(ast_function *fn, closure *env, module *mod,
+                             ref self) {
+  auto *l = new lambda(native_callback(ast_closure{fn, env, mod, nullptr}));
+  l->function_binding.target<ast_closure>()->func = l;
+  l->name = fn->name;
+  l->argc = fn->argc;
+  l->vararg = fn->vararg;
+  l->mod = mod;
+  l->self = self;
+  return l;
 }
 
 
-static reg compile_binary_op(X86Compiler &cc, binary_func func, reg a, reg b) {
-  auto res = alloc_ref(cc);
-  debug_reg_print(cc, res, "bop res");
+// put the arguments of a call where the code expects them: a new closure
+// for the ones that escape, and the frame's slots for the rest
+static void bind_args(ast_frame *f, int argc, ref *argv) {
+  ast_function *fn = f->fn;
+  int concrete = fn->vararg ? fn->argc - 1 : fn->argc;
+  if (fn->vararg ? argc < concrete : argc != concrete) {
+    throw cedar::make_exception("invalid arg count passed to function. given: ",
+                                argc, " expected: ", fn->argc, " - ",
+                                fn->name);
+  }
 
-  auto call = cc.call(
-      imm_ptr(func),  //   Function address or Label.
-      FuncSignature3<void, ref *, ref *, ref *>());  //   Function signature.
-  call->setArg(0, res);
-  call->setArg(1, a);
-  call->setArg(2, b);
+  ref valist = nullptr;
+  if (fn->vararg) {
+    for (int i = argc - 1; i >= concrete; i--) {
+      valist = new_obj<list>(argv[i], valist);
+    }
+  }
 
-  return res;
+  f->env = fn->closure_size != 0 ? new closure(fn->closure_size, f->outer)
+                                 : f->outer;
+  for (int i = 0; i < fn->argc; i++) {
+    ref val = i < concrete ? argv[i] : valist;
+    if (fn->arg_slot[i] >= 0) {
+      f->slots[fn->arg_slot[i]] = val;
+    } else {
+      f->env->at(fn->arg_closure[i]) = val;
+    }
+  }
 }
 
 
-
-static void ref_copy(X86Compiler &cc, reg dst, reg src) {
-  COMMENT("+ ref_copy");
-  reg buf = cc.newInt64("ref_copy_buf");
-  // copy 8 bytes of ref at a time
-  for (int i = 0; i < sizeof(ref); i += 8) {
-    cc.mov(buf, qword_ptr(src, i));
-    cc.mov(qword_ptr(dst, i), buf);
+static ref run_function(ast_function *fn, lambda *func, closure *env,
+                        module *mod, ref self, int argc, ref *argv,
+                        fiber *fib) {
+  // every call takes native stack, and unlike the baseline JIT there is no
+  // interpreter to fall back to, so recursion this deep is an error
+  if (native_depth >= JIT_MAX_DEPTH) {
+    throw cedar::make_exception("maximum call depth (", JIT_MAX_DEPTH,
+                                ") exceeded in compiled code calling ",
+                                fn->name);
   }
-  COMMENT("- ref_copy");
+
+  ast_frame f;
+  f.fn = fn;
+  f.func = func;
+  f.mod = mod;
+  f.self = self;
+  f.env = f.outer = env;
+  f.fib = fib;
+
+  // the slots live on the native stack, where the GC can see them
+  ref *space = (ref *)alloca(fn->slot_count * sizeof(ref));
+  for (int i = 0; i < fn->slot_count; i++) new (space + i) ref();
+  f.slots = space;
+  bind_args(&f, argc, argv);
+
+  native_depth++;
+  fn->code(&f);
+  native_depth--;
+
+  if (f.error) std::rethrow_exception(f.error);
+  return f.result;
 }
 
 
 
 
-static reg get_argc(X86Compiler &cc, reg cb) {
-  COMMENT("+ get_argc");
-  reg argc = cc.newGpz();
-  cc.mov(argc, qword_ptr(cb, offsetof(function_callback, m_argc)));
-  COMMENT("-  get_argc");
-  return argc;
-}
+// Every helper takes the frame, a pointer to the slot it works on, and up
+// to two operands. They return a negative number if something was thrown,
+// which the generated code answers by returning
+using helper = int (*)(ast_frame *, ref *, i64, i64);
 
+#define HELPER(name) static int name(ast_frame *f, ref *p, i64 a, i64 b)
 
-static reg get_argv(X86Compiler &cc, reg cb) {
-  reg argv = cc.newGpz();
-  cc.mov(argv, qword_ptr(cb, offsetof(function_callback, m_argv)));
-  return argv;
-}
-
+#define GUARDED(body)                       \
+  try {                                     \
+    body;                                   \
+  } catch (...) {                           \
+    f->error = std::current_exception();    \
+    return -1;                              \
+  }
 
 
-static reg get_arg(X86Compiler &cc, reg cb, int i) {
-  COMMENT("+ get_arg");
-  auto argv = get_argv(cc, cb);
-  auto arg = cc.newGpz();
-  cc.lea(arg, qword_ptr(argv, (uint64_t)sizeof(ref) * i));
-  COMMENT("- get_arg");
-  return arg;
+HELPER(ast_load_global) {
+  auto *site = (ast_global_site *)a;
+  GUARDED(*p = vm::load_global_slow(site->id, &site->cache, f->mod));
+  return 0;
 }
 
+// b is set for def-private*
+HELPER(ast_set_global) {
+  GUARDED({
+    if (f->mod == nullptr) {
+      def_global((u64)a, *p);
+    } else if (b) {
+      f->mod->set_private(a, *p);
+    } else {
+      f->mod->setattr_fast(a, *p);
+    }
+  });
+  return 0;
+}
 
+HELPER(ast_def_macro) {
+  GUARDED(vm::set_macro(a, *p));
+  *p = nullptr;
+  return 0;
+}
 
-static reg get_return(X86Compiler &cc, reg cb) {
-  COMMENT("+ get_return");
-  reg r = cc.newGpz();
-  cc.lea(r, qword_ptr(cb, offsetof(function_callback, return_value)));
-  COMMENT("- get_return");
-  return r;
+HELPER(ast_load_local) {
+  GUARDED(*p = f->env->at(a, b));
+  return 0;
 }
 
+HELPER(ast_set_local) {
+  GUARDED(f->env->at(a, b) = *p);
+  return 0;
+}
 
-static reg get_module(X86Compiler &cc, reg cb) {
-  COMMENT("+ get_module");
-  reg r = cc.newGpz();
-  cc.mov(r, qword_ptr(cb, offsetof(function_callback, m_mod)));
-  COMMENT("- get_module");
-  return r;
+HELPER(ast_push_scope) {
+  GUARDED(f->env = new closure(a, f->env));
+  return 0;
 }
 
+HELPER(ast_pop_scope) {
+  f->env = f->env->m_parent;
+  return 0;
+}
 
-lambda *jit::compile(ref obj, module *mod) {
-  auto ch = new code_handle(obj, mod);
-  return new lambda([=](const function_callback &cb) { ch->apply(cb); });
+HELPER(ast_call) {
+  GUARDED(call_value(p, a, nullptr, f->self, f->fib, f->mod));
+  return 0;
 }
 
+// a call in tail position. If it calls the function being run, the frame is
+// set up for the new call and 1 tells the code to start over, so tail
+// recursion doesn't grow the native stack
+HELPER(ast_tail_call) {
+  GUARDED({
+    auto *callee =
+        p[0].isa(lambda_type) ? p[0].reinterpret<lambda *>() : nullptr;
+    ast_closure *target = nullptr;
+    if (callee != nullptr &&
+        callee->code_type == lambda::function_binding_type) {
+      target = callee->function_binding.target<ast_closure>();
+    }
+    if (target == nullptr || target->fn != f->fn) {
+      call_value(p, a, nullptr, f->self, f->fib, f->mod);
+      return 0;
+    }
+    f->func = target->func;
+    f->mod = target->mod;
+    f->outer = target->env;
+    bind_args(f, a, p + 1);
+  });
+  return 1;
+}
 
-lambda *jit::compile(runes s, module *mod) {
-  reader reader;
-  reader.lex_source(s);
-  bool v;
-  return compile(reader.read_one(&v), mod);
+HELPER(ast_recur) {
+  GUARDED({
+    if (a != f->fn->argc)
+      throw cedar::make_exception(
+          "recur call has invalid number of arguments. Given ", a,
+          " expected ", f->fn->argc);
+    bind_args(f, a, p);
+  });
+  return 0;
 }
 
+HELPER(ast_make_func) {
+  GUARDED(*p = make_function((ast_function *)a, f->env, f->mod, f->self));
+  return 0;
+}
 
-static type *jit_get_type(ref &r) { return r.get_type(); }
+HELPER(ast_get_attr) {
+  auto *site = (vm::attr_cache *)a;
+  GUARDED({
+    ref obj = *p;
+    *p = vm::getattr_cached(site, obj);
+  });
+  return 0;
+}
 
+// sets the attribute of p[0] to p[1], leaving the value in p[0]
+HELPER(ast_set_attr) {
+  auto *site = (vm::attr_cache *)a;
+  GUARDED({
+    ref obj = p[0];
+    ref val = p[1];
+    vm::setattr_cached(site, obj, val);
+    p[0] = val;
+  });
+  return 0;
+}
 
-static reg get_type(X86Compiler &cc, reg arg) {
-  reg ret = cc.newGpz("ret");
+// calls the method of p[1] with the b - 1 arguments after it, leaving the
+// result in p[0]
+HELPER(ast_invoke) {
+  auto *site = (vm::attr_cache *)a;
+  GUARDED({
+    ref method_self;
+    site->receivers.record(p[1]);
+    p[0] = vm::lookup_method_cached(site, p[1], method_self);
+    call_value(p, b, &method_self, f->self, f->fib, f->mod);
+  });
+  return 0;
+}
 
-  auto call = cc.call(imm_ptr(jit_get_type), FuncSignature1<type *, ref *>());
+HELPER(ast_get_module) {
+  *p = f->mod;
+  return 0;
+}
 
-  call->setArg(0, arg);
-  call->setRet(0, ret);
-  return ret;
+HELPER(ast_get_func) {
+  *p = f->func;
+  return 0;
 }
 
+// a math tree done the long way, on the values of its leaves in order
+static ref eval_math_tree(ast::node *n, ref *&leaf) {
+  if (auto *num = dynamic_cast<ast::number_node *>(n))
+    return num->is_float ? ref{num->d} : ref{(i64)num->i};
+  auto *m = dynamic_cast<ast::math_op_node *>(n);
+  if (m == nullptr) return *leaf++;
+  ref acc = eval_math_tree(m->arguments[0], leaf);
+  if (m->arguments.size() == 1) return m->op == '-' ? ref{-1} * acc : acc;
+  for (size_t i = 1; i < m->arguments.size(); i++) {
+    ref rhs = eval_math_tree(m->arguments[i], leaf);
+    switch (m->op) {
+      case '+':
+        acc = acc + rhs;
+        break;
+      case '-':
+        acc = acc - rhs;
+        break;
+      case '*':
+        acc = acc * rhs;
+        break;
+      case '/':
+        acc = acc / rhs;
+        break;
+    }
+  }
+  return acc;
+}
 
-compiler::compiler(ref obj) : cc{&code} {
-  base_obj = obj;
-  init();
+// a float tree (see compile_float_tree) with a leaf that wasn't a float.
+// a is the tree, and its leaves start b slots above p
+HELPER(ast_math_tree) {
+  GUARDED({
+    ref *leaf = p + b;
+    *p = eval_math_tree((ast::node *)a, leaf);
+  });
+  return 0;
 }
 
-compiler::compiler(std::string expr) : cc{&code} {
-  reader reader;
-  reader.lex_source(expr);
-  bool v;
-  base_obj = reader.read_one(&v);
-  init();
+// the arithmetic the inline paths don't handle, with the right hand side b
+// slots above p. 'n' negates
+HELPER(ast_arith) {
+  GUARDED({
+    ref rhs = p[b];
+    switch (a) {
+      case '+':
+        *p = *p + rhs;
+        break;
+      case '-':
+        *p = *p - rhs;
+        break;
+      case '*':
+        *p = *p * rhs;
+        break;
+      case '/':
+        *p = *p / rhs;
+        break;
+      case 'n':
+        *p = ref{-1} * *p;
+        break;
+    }
+  });
+  return 0;
 }
 
-void compiler::init(void) {}
+// is the value false? Returns 1 if so
+HELPER(ast_is_false) {
+  static ref false_val = new symbol("false");
+  GUARDED({
+    ref val = *p;
+    if (val.is_nil() || val == false_val) return 1;
+  });
+  return 0;
+}
 
+// the same as the interpreter's OP_EVAL
+HELPER(ast_eval) {
+  GUARDED({
+    vm::compiler c;
+    ref compiled_lambda = c.compile(*p, nullptr);
+    lambda *func = compiled_lambda.as<lambda>();
+    call_state call = func->prime(0, nullptr);
+    fiber eval_fiber(call);
+    *p = eval_fiber.run();
+  });
+  return 0;
+}
 
 
 
-void *compiler::run(module *m, size_t *sz) {
-  code.init(CodeInfo(ArchInfo::kTypeHost));
-#ifdef JIT_DEBUG
-  logger.setStream(stdout);
-  logger.setIndentation("   ");
-  code.setLogger(&logger);
-#endif
-  cc.~X86Compiler();
-  new (&cc) X86Compiler(&code);
 
-  stk = cc.newStack(1, 8, "STACK");
+compiler::compiler(module *m) {
   mod = m;
-  auto *root = ast::parse(base_obj, m, nullptr);
+  holder.init(CodeInfo(ArchInfo::kTypeHost));
+  holder.attach(&cc);
+  handle = new code_handle(nullptr, 0);
+}
 
 
-  // run analysis on the variables and finalize closure information
-  root->sc->finalize();
+lambda *compiler::run(ref obj) {
+  // the same passes the bytecode compiler runs first
+  vm::compiler passes;
+  passes.mod = mod;
+  obj = optimize(obj, &passes);
+
+  ast::node *root = ast::parse(obj, mod);
+  ast::scope *sc = root->sc;
+  while (sc->parent != nullptr) sc = sc->parent;
+  sc->finalize();
+
+  // the whole form is one piece of code, so it is dumped as one
+  std::string unit;
+  if (describing()) unit = code_name(nullptr, obj, mod);
+  FILE *dump = open_dump(unit);
+  FileLogger logger(dump);
+  if (dump != nullptr) holder.setLogger(&logger);
+
+  auto *top = new ast_function();
+  top->handle = handle;
+  handle->functions.push_back(top);
+  work.push_back(
+      {nullptr, root, top, cc.newFunc(FuncSignature1<void, ast_frame *>())});
+  // compiling a function can find more of them
+  for (size_t i = 0; i < work.size(); i++) emit_function(work[i]);
+
+  Error err = cc.finalize();
+  if (dump != nullptr) {
+    holder.resetLogger();
+    fclose(dump);
+  }
+  if (err != kErrorOk) return nullptr;
 
+  size_t size = holder.getCodeSize();
+  void *mem =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+  if (mem == MAP_FAILED) return nullptr;
+  holder.relocate(mem);
+  // a host that won't make the pages executable gets the form compiled to
+  // bytecode instead
+  if (mprotect(mem, size, PROT_EXEC | PROT_READ) != 0) {
+    munmap(mem, size);
+    stats.failed++;
+    return nullptr;
+  }
+  handle->adopt(mem, size);
 
+  for (auto &p : work) {
+    p.fn->code = (void (*)(ast_frame *))((char *)mem +
+                                         holder.getLabelOffset(p.func->getLabel()));
+  }
 
-  cc.addFunc(FuncSignature1<void, function_callback *>());
+  if (describing()) {
+    // functions are laid out in the order they were emitted, so each one
+    // runs up to the start of the next
+    std::vector<code_symbol> syms;
+    for (size_t i = 0; i < work.size(); i++) {
+      size_t start = holder.getLabelOffset(work[i].func->getLabel());
+      size_t end = i + 1 < work.size()
+                       ? holder.getLabelOffset(work[i + 1].func->getLabel())
+                       : size;
+      auto name = i == 0 ? unit
+                         : code_name(work[i].fn->name, nullptr, mod);
+      syms.push_back({name, start, end - start});
+    }
+    describe_code(mem, size, syms);
+  }
+  return make_function(top, nullptr, mod, nullptr);
+}
 
-  cb = cc.newGpz("cb");
-  cc.setArg(0, cb);
 
+void compiler::emit_function(pending p) {
+  fn = p.fn;
+  slot_top = 0;
+  var_slots.clear();
+
+  cc.addFunc(p.func);
+  frame = cc.newIntPtr("frame");
+  cc.setArg(0, frame);
+  slots = cc.newIntPtr("slots");
+  cc.mov(slots, qword_ptr(frame, offsetof(ast_frame, slots)));
+
+  // the arguments that don't escape take the first slots
+  if (p.node != nullptr) {
+    auto *node = p.node;
+    fn->name = node->name.empty() ? ref{nullptr} : newsymbol(node->name);
+    fn->argc = node->args.size();
+    fn->vararg = node->vararg;
+    fn->closure_size = node->sc->closure_size;
+    for (auto *v : node->args) {
+      if (v->escapes) {
+        fn->arg_slot.push_back(-1);
+        fn->arg_closure.push_back(v->closure_index);
+      } else {
+        int s = push_slots(1);
+        var_slots[v] = s;
+        fn->arg_slot.push_back(s);
+        fn->arg_closure.push_back(-1);
+      }
+    }
+  }
 
-  auto reta = cc.newGpz("return_value");
+  start = cc.newLabel();
+  bail = cc.newLabel();
+  cc.bind(start);
 
-  cc.lea(reta, qword_ptr(cb, offsetof(function_callback, return_value)));
+  int dst = push_slots(1);
+  compile_node(dst, p.body, true);
+  copy(frame, offsetof(ast_frame, result), slots, dst * REF_SIZE);
 
-  compile_node(reta, root);
+  // anything that threw just returns
+  cc.bind(bail);
   cc.ret();
-  cc.finalize();
-
-  size_t size = code.getCodeSize();
+  cc.endFunc();
+}
 
-  // allocate a region of memory to relocate code to
-  auto ptr =
-      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
 
-  code.relocate(ptr);  // Relocate & store the output in 'ptr'.
 
-  mprotect(ptr, size, PROT_EXEC | PROT_READ);
 
-  *sz = size;
-  return ptr;
+int compiler::push_slots(int n) {
+  int base = slot_top;
+  slot_top += n;
+  fn->slot_count = std::max(fn->slot_count, slot_top);
+  return base;
 }
 
+void compiler::pop_slots(int n) { slot_top -= n; }
 
 
+mem compiler::value(int slot) { return qword_ptr(slots, slot * REF_SIZE); }
 
-#define ISA(obj, t) (dynamic_cast<t *>(obj) != nullptr)
-void compiler::compile_node(reg dst, ast::node *obj) {
-  if (ISA(obj, number_node)) return compile_number(dst, obj);
-  if (ISA(obj, symbol_node)) return compile_symbol(dst, obj);
-  if (ISA(obj, call_node)) return compile_call(dst, obj);
-  if (ISA(obj, if_node)) return compile_if(dst, obj);
+mem compiler::flags(int slot) {
+  return byte_ptr(slots, slot * REF_SIZE + FLAGS_OFFSET);
+}
 
-  if (ISA(obj, string_node)) return compile_string(dst, obj);
 
-  return compile_nil(dst);
-  return;
+// copy a ref, addressed by a base register and a byte offset
+void compiler::copy(reg dst, int doff, reg src, int soff) {
+  reg t = cc.newGpq();
+  cc.mov(t, qword_ptr(src, soff));
+  cc.mov(qword_ptr(dst, doff), t);
+  cc.mov(t, qword_ptr(src, soff + FLAGS_OFFSET));
+  cc.mov(qword_ptr(dst, doff + FLAGS_OFFSET), t);
 }
 
+void compiler::copy_slot(int dst, int src) {
+  if (dst != src) copy(slots, dst * REF_SIZE, slots, src * REF_SIZE);
+}
 
+void compiler::store_value(int slot, i64 bits, u8 fl) {
+  reg t = cc.newGpq();
+  cc.mov(t, Imm(bits));
+  cc.mov(value(slot), t);
+  cc.mov(flags(slot), Imm(fl));
+}
 
-static void _load_ref_int(ref &r, i64 v) { r = v; }
-static void _load_ref_float(ref &r, double v) { r = v; }
-void compiler::compile_number(reg dst, ast::node *obj) {
-  auto n = static_cast<ast::number_node *>(obj);
-  COMMENT("NUMBER:");
-  if (!n->is_float) {
-    reg arg = cc.newI64("num arg");
-    debug_reg_print(cc, arg, "arg");
-    cc.mov(arg, (int64_t)n->i);
 
-    // load the reference with an int
-    auto call =
-        cc.call(imm_ptr(_load_ref_int), FuncSignature2<void, ref *, i64>());
-    call->setArg(0, dst);
-    call->setArg(1, arg);
-    return;
-  } else {
-    auto arg = cc.newXmmSd();
-    double d = n->d;
-    uint64_t d_re = *(uint64_t *)&d;
-
-    auto itmp = cc.newGpz();
-    cc.mov(itmp, d_re);
-    cc.movq(arg, itmp);
-
-    // load a reference with a float (double)
-    auto call =
-        cc.call(imm_ptr(_load_ref_float), FuncSignature2<void, ref *, i64>());
-    call->setArg(0, dst);
-    call->setArg(1, arg);
-    return;
-  }
+// call a helper on a slot. Bails if it threw, and hands back what it
+// returned otherwise
+reg compiler::call_helper(void *fn, int slot, i64 a, i64 b) {
+  reg p = cc.newIntPtr();
+  reg ra = cc.newI64();
+  reg rb = cc.newI64();
+  reg ret = cc.newI32();
+  cc.lea(p, value(slot));
+  cc.mov(ra, Imm(a));
+  cc.mov(rb, Imm(b));
+  auto *call = cc.call(imm_ptr(fn),
+                       FuncSignature4<int, ast_frame *, ref *, i64, i64>());
+  call->setArg(0, frame);
+  call->setArg(1, p);
+  call->setArg(2, ra);
+  call->setArg(3, rb);
+  call->setRet(0, ret);
+  cc.test(ret, ret);
+  cc.js(bail);
+  return ret;
 }
 
 
 
-void jit_do_call(ref &dst, ref &func, int argc, ref *argv) {
-  lambda *fn = ref_cast<lambda>(func);
-  if (fn != nullptr) {
-    call_context c;
-    dst = call_function(fn, argc, argv, &c);
+
+void compiler::compile_node(int dst, ast::node *obj, bool tail) {
+  if (auto *n = dynamic_cast<ast::number_node *>(obj))
+    return compile_number(dst, n);
+  if (dynamic_cast<ast::nil_node *>(obj)) return store_value(dst, 0, 0);
+  if (auto *n = dynamic_cast<ast::const_node *>(obj))
+    return compile_constant(dst, n->val);
+  if (auto *n = dynamic_cast<ast::symbol_node *>(obj))
+    return compile_symbol(dst, n);
+  if (auto *n = dynamic_cast<ast::context_node *>(obj))
+    return compile_context(dst, n);
+  if (auto *n = dynamic_cast<ast::call_node *>(obj))
+    return compile_call(dst, n, tail);
+  if (auto *n = dynamic_cast<ast::if_node *>(obj))
+    return compile_if(dst, n, tail);
+  if (auto *n = dynamic_cast<ast::do_node *>(obj))
+    return compile_do(dst, n, tail);
+  if (auto *n = dynamic_cast<ast::def_node *>(obj)) return compile_def(dst, n);
+  if (auto *n = dynamic_cast<ast::return_node *>(obj))
+    return compile_return(dst, n);
+  if (auto *n = dynamic_cast<ast::scope_node *>(obj))
+    return compile_scope(dst, n, tail);
+  if (auto *n = dynamic_cast<ast::function_node *>(obj))
+    return compile_function(dst, n);
+  if (auto *n = dynamic_cast<ast::math_op_node *>(obj))
+    return compile_math_op(dst, n);
+  if (auto *n = dynamic_cast<ast::dot_node *>(obj)) return compile_dot(dst, n);
+  if (auto *n = dynamic_cast<ast::recur_node *>(obj)) return compile_recur(n);
+  if (auto *n = dynamic_cast<ast::eval_node *>(obj))
+    return compile_eval(dst, n);
+  throw ast::unsupported_form(obj->str());
+}
+
+
+void compiler::compile_number(int dst, ast::number_node *n) {
+  if (n->is_float) {
+    i64 bits;
+    memcpy(&bits, &n->d, sizeof(bits));
+    store_value(dst, bits, FLOAT_FLAGS);
   } else {
-    throw make_exception("Unable to call non-lambda ", func);
+    store_value(dst, n->i, INT_FLAGS);
   }
 }
 
 
-
-void compiler::compile_call(reg dst, ast::node *obj) {
-  auto n = static_cast<ast::call_node *>(obj);
-  COMMENT("call:");
+void compiler::compile_constant(int dst, ref val) {
+  if (val.is_nil()) return store_value(dst, 0, 0);
+  handle->constants.push_back(val);
+  reg t = cc.newIntPtr();
+  cc.mov(t, imm_ptr(&handle->constants.back()));
+  copy(slots, dst * REF_SIZE, t, 0);
+}
 
 
-  auto func_mem = salloc(sizeof(ref));
-  auto func = func_mem.ptr;
+void compiler::compile_symbol(int dst, ast::symbol_node *n) {
+  ast::var *v = n->binding;
 
-  compile_node(func, n->func);
+  if (v->global) {
+    // the interpreter's inline cache check, with a cache of its own
+    handle->globals.emplace_back();
+    auto *site = &handle->globals.back();
+    site->id = v->id;
+    Label slow = cc.newLabel();
+    Label done = cc.newLabel();
+    reg c = cc.newIntPtr();
+    reg t = cc.newIntPtr();
+    cc.mov(t, imm_ptr(&site->cache));
+    cc.mov(c, qword_ptr(t));
+    cc.test(c, c);
+    cc.jz(slow);
+    cc.mov(t, qword_ptr(frame, offsetof(ast_frame, mod)));
+    cc.cmp(qword_ptr(c, offsetof(vm::global_cache, mod)), t);
+    cc.jne(slow);
+    cc.mov(t, imm_ptr(&binding_version));
+    cc.mov(t, qword_ptr(t));
+    cc.cmp(qword_ptr(c, offsetof(vm::global_cache, version)), t);
+    cc.jne(slow);
+    cc.mov(c, qword_ptr(c, offsetof(vm::global_cache, slot)));
+    copy(slots, dst * REF_SIZE, c, 0);
+    cc.jmp(done);
+    cc.bind(slow);
+    call_helper((void *)ast_load_global, dst, (i64)site, 0);
+    cc.bind(done);
+    return;
+  }
 
+  if (v->escapes) {
+    call_helper((void *)ast_load_local, dst, v->sc->closure_index,
+                v->closure_index);
+    return;
+  }
 
-  auto arg_mem = salloc(sizeof(ref) * n->arguments.size());
+  copy_slot(dst, var_slots.at(v));
+}
 
-  auto argc = cc.newGpz("argc");
-  cc.mov(argc, (int64_t)n->arguments.size());
-  auto argv = cc.newGpz("argv");
-  auto arg_dst = cc.newGpz("arg_dst");
 
-  cc.lea(argv, qword_ptr(arg_mem.ptr));
-  for (int i = 0; i < n->arguments.size(); i++) {
-    cc.lea(arg_dst, qword_ptr(argv, sizeof(ref) * i));
-    compile_node(arg_dst, n->arguments[i]);
+void compiler::compile_context(int dst, ast::context_node *n) {
+  switch (n->what) {
+    case ast::context_node::self:
+      copy(slots, dst * REF_SIZE, frame, offsetof(ast_frame, self));
+      break;
+    case ast::context_node::module:
+      call_helper((void *)ast_get_module, dst, 0, 0);
+      break;
+    case ast::context_node::func:
+      call_helper((void *)ast_get_func, dst, 0, 0);
+      break;
   }
-  auto call = cc.call(imm_ptr(jit_do_call),
-                      FuncSignature4<void, ref *, ref *, int, ref *>());
-  call->setArg(0, dst);
-  call->setArg(1, func);
-  call->setArg(2, argc);
-  call->setArg(3, argv);
-
-  sfree(func_mem);
-  sfree(arg_mem);
 }
 
 
-static int jit_do_bool_convert(ref &val) {
-  static ref false_val = new symbol("false");
+void compiler::compile_call(int dst, ast::call_node *n, bool tail) {
+  int argc = n->arguments.size();
+  int base = push_slots(argc + 1);
+  compile_node(base, n->func, false);
+  for (int i = 0; i < argc; i++) {
+    compile_node(base + 1 + i, n->arguments[i], false);
+  }
 
+  Label done = cc.newLabel();
+
+  // (< a b) style calls to the core's comparisons are done inline when
+  // both arguments are ints, as long as the global still holds the same
+  // lambda. ref::compare orders ints by the sign of the low 32 bits of
+  // their difference, so this does too
+  vm::comparison kind = vm::compare_none;
+  lambda *cmp = nullptr;
+  auto *sym = dynamic_cast<ast::symbol_node *>(n->func);
+  if (argc == 2 && sym != nullptr && sym->binding->global)
+    cmp = core_comparison_global(sym->binding->id, &kind);
+  if (cmp != nullptr) {
+    Label slow = cc.newLabel();
+    Label yes = cc.newLabel();
+    reg t = cc.newGpq();
+    cc.mov(t, imm_ptr(cmp));
+    cc.cmp(value(base), t);
+    cc.jne(slow);
+    cc.cmp(flags(base), Imm(0));
+    cc.jne(slow);
+    cc.cmp(flags(base + 1), Imm(INT_FLAGS));
+    cc.jne(slow);
+    cc.cmp(flags(base + 2), Imm(INT_FLAGS));
+    cc.jne(slow);
+    cc.mov(t, value(base + 1));
+    cc.sub(t, value(base + 2));
+    cc.test(t.r32(), t.r32());
+    switch (kind) {
+      case vm::compare_lt:
+        cc.js(yes);
+        break;
+      case vm::compare_lte:
+        cc.jle(yes);
+        break;
+      case vm::compare_gt:
+        cc.jg(yes);
+        break;
+      default:
+        cc.jge(yes);
+        break;
+    }
+    store_value(base, 0, 0);
+    cc.jmp(done);
+    cc.bind(yes);
+    cc.mov(t, imm_ptr(&true_value));
+    copy(slots, base * REF_SIZE, t, 0);
+    cc.jmp(done);
+    cc.bind(slow);
+  }
 
-  if (val.is_nil() || val == false_val) {
-    return 0;
+  if (tail) {
+    reg ret = call_helper((void *)ast_tail_call, base, argc, 0);
+    cc.cmp(ret, Imm(0));
+    cc.jne(start);
+  } else {
+    call_helper((void *)ast_call, base, argc, 0);
   }
-  return 1;
+  cc.bind(done);
+  copy_slot(dst, base);
+  pop_slots(argc + 1);
 }
 
-void compiler::compile_if(reg dst, ast::node *obj) {
-  COMMENT("IF:");
-  auto n = static_cast<ast::if_node *>(obj);
-  auto is_false = cc.newLabel();
-  auto br_join = cc.newLabel();
-  auto cond_bool = cc.newGpd();
 
+// numbers are always true, and nil is always false. Objects other than the
+// true symbol need a real check
+void compiler::jump_if_false(int slot, Label target) {
+  Label next = cc.newLabel();
+  cc.test(flags(slot), Imm(NUMBER_FLAGS));
+  cc.jnz(next);
+  reg v = cc.newIntPtr();
+  reg t = cc.newIntPtr();
+  cc.mov(v, value(slot));
+  cc.test(v, v);
+  cc.jz(target);
+  cc.mov(t, imm_ptr(true_value.m_obj));
+  cc.cmp(v, t);
+  cc.je(next);
+  reg ret = call_helper((void *)ast_is_false, slot, 0, 0);
+  cc.cmp(ret, Imm(0));
+  cc.jne(target);
+  cc.bind(next);
+}
 
-  COMMENT("COND:");
-  compile_node(dst, n->cond);
-
-  auto call =
-      cc.call(imm_ptr(jit_do_bool_convert), FuncSignature1<int, ref *>());
-  call->setArg(0, dst);
-  call->setRet(0, cond_bool);
-
-  cc.cmp(cond_bool, 0);
-  cc.je(is_false);
-
-  // true
-  compile_node(dst, n->true_body);
-  cc.jmp(br_join);
-  // false
-  cc.bind(is_false);
-  compile_node(dst, n->false_body);
 
-  // final join node
-  cc.bind(br_join);
+void compiler::compile_if(int dst, ast::if_node *n, bool tail) {
+  Label fls = cc.newLabel();
+  Label end = cc.newLabel();
+  compile_node(dst, n->cond, false);
+  jump_if_false(dst, fls);
+  compile_node(dst, n->true_body, tail);
+  cc.jmp(end);
+  cc.bind(fls);
+  compile_node(dst, n->false_body, tail);
+  cc.bind(end);
 }
 
 
-static void jit_do_module_lookup(ref &dst, uint64_t id, module *m) {
-  bool f;
-  dst = m->find(id, &f);
-  if (!f) {
-    if (is_global(id)) dst = get_global(id);
+void compiler::compile_do(int dst, ast::do_node *n, bool tail) {
+  for (size_t i = 0; i < n->body.size(); i++) {
+    compile_node(dst, n->body[i], tail && i + 1 == n->body.size());
   }
 }
 
-void compiler::compile_symbol(reg dst, ast::node *obj) {
-  auto n = static_cast<ast::symbol_node *>(obj);
-  COMMENT("SYMBOL:");
-  auto v = n->binding;
 
-  // global lookups should go to the module for lookup
-  if (v->global) {
-    auto id = cc.newGpz();
-    cc.mov(id, v->id);
-    auto call = cc.call(imm_ptr(jit_do_module_lookup),
-                        FuncSignature3<void, ref *, uint64_t, module *>());
-
-    call->setArg(0, dst);
-    call->setArg(1, id);
-    call->setArg(2, imm_ptr(mod));
+void compiler::compile_def(int dst, ast::def_node *n) {
+  compile_node(dst, n->val, false);
+  ast::var *v = static_cast<ast::symbol_node *>(n->dst)->binding;
+
+  if (n->macro) {
+    call_helper((void *)ast_def_macro, dst, v->id, 0);
+    return;
+  }
+  // def-private* always defines in the module, like OP_SET_PRIVATE
+  if (v->global || n->priv) {
+    call_helper((void *)ast_set_global, dst, v->id, n->priv);
     return;
   }
+  if (v->escapes) {
+    call_helper((void *)ast_set_local, dst, v->sc->closure_index,
+                v->closure_index);
+    return;
+  }
+  copy_slot(var_slots.at(v), dst);
+}
 
-  printf("STILL NEED TO COMPILE VARS OF TYPE: %s\n", v->str().c_str());
-  exit(0);
+
+void compiler::compile_return(int dst, ast::return_node *n) {
+  compile_node(dst, n->val, false);
+  copy(frame, offsetof(ast_frame, result), slots, dst * REF_SIZE);
+  cc.ret();
 }
 
-void compiler::compile_nil(reg dst) {
-  // the nil reference is just all 0s:
-  // copy 8 bytes of ref at a time
-  COMMENT("NIL");
 
+void compiler::compile_scope(int dst, ast::scope_node *n, bool tail) {
+  ast::scope *sc = n->sc;
+  int base = push_slots(sc->stack_size);
+  for (auto *v : n->names) {
+    if (v->escapes) continue;
+    var_slots[v] = base + v->stack_index;
+    store_value(base + v->stack_index, 0, 0);
+  }
+  if (sc->allocate_closure)
+    call_helper((void *)ast_push_scope, dst, sc->closure_size, 0);
 
-  cc.mov(oword_ptr(dst), 0);
-  /*
-  auto xmm = cc.newXmmPs();
-  cc.xorps(xmm, xmm);
+  compile_node(dst, n->body, tail);
 
-  cc.movups(ptr(dst), xmm);
-  */
+  if (sc->allocate_closure) call_helper((void *)ast_pop_scope, dst, 0, 0);
+  pop_slots(sc->stack_size);
+}
 
-  return;
 
-  for (int i = 0; i < sizeof(ref); i += 8) {
-    cc.mov(qword_ptr(dst, i), 0);
-  }
+// the function's code is compiled once the current one is done, and the
+// lambda is made at runtime, closing over the current closure
+void compiler::compile_function(int dst, ast::function_node *n) {
+  auto *info = new ast_function();
+  info->handle = handle;
+  handle->functions.push_back(info);
+  work.push_back(
+      {n, n->body, info, cc.newFunc(FuncSignature1<void, ast_frame *>())});
+  call_helper((void *)ast_make_func, dst, (i64)info, 0);
 }
 
 
+void compiler::compile_math_op(int dst, ast::math_op_node *n) {
+  if (compile_float_tree(dst, n)) return;
 
-void compile_scope_init(ast::scope *sc) {}
+  auto &args = n->arguments;
+  if (args.empty()) {
+    store_value(dst, n->op == '*' ? 1 : 0, INT_FLAGS);
+    return;
+  }
 
+  compile_node(dst, args[0], false);
+
+  if (args.size() == 1) {
+    // (+ x) and (* x) are just x
+    if (n->op != '-') return;
+    Label slow = cc.newLabel();
+    Label done = cc.newLabel();
+    cc.cmp(flags(dst), Imm(INT_FLAGS));
+    cc.jne(slow);
+    reg t = cc.newGpq();
+    cc.mov(t, value(dst));
+    cc.neg(t);
+    cc.jo(slow);
+    cc.mov(value(dst), t);
+    cc.jmp(done);
+    cc.bind(slow);
+    call_helper((void *)ast_arith, dst, 'n', 0);
+    cc.bind(done);
+    return;
+  }
 
+  int rhs = push_slots(1);
+  for (size_t i = 1; i < args.size(); i++) {
+    compile_node(rhs, args[i], false);
+    arith(n->op, dst, rhs);
+  }
+  pop_slots(1);
+}
 
 
-static void jit_build_string(ref &dst, const char *src) {
-  printf("%p\n", src);
-  dst = new string(src);
+// what a math tree gives back if all its leaves (anything that isn't a
+// literal or more math) are floats: 2 for a float, 1 for an int literal and
+// 0 for something compile_float_tree can't do. Every step needs a float on
+// one side, or it would be int math. The leaves are collected in the order
+// they are evaluated
+static int float_kind(ast::node *n, std::vector<ast::node *> &leaves) {
+  if (auto *num = dynamic_cast<ast::number_node *>(n))
+    return num->is_float ? 2 : 1;
+  auto *m = dynamic_cast<ast::math_op_node *>(n);
+  if (m == nullptr) {
+    leaves.push_back(n);
+    return 2;
+  }
+  auto &args = m->arguments;
+  // (+) and (*) are ints, and (/ x) is a reciprocal method call
+  if (args.empty() || (args.size() == 1 && m->op == '/')) return 0;
+  int acc = float_kind(args[0], leaves);
+  if (args.size() == 1) return acc == 2 ? 2 : 0;
+  for (size_t i = 1; i < args.size(); i++) {
+    if (acc == 0) return 0;
+    int k = float_kind(args[i], leaves);
+    if (k == 0 || (acc != 2 && k != 2)) return 0;
+    acc = 2;
+  }
+  return acc;
 }
-void compiler::compile_string(reg dst, ast::node *obj) {
-  auto n = static_cast<ast::string_node *>(obj);
-  std::u32string &str = n->val.buf;
-  const char32_t *ptr = str.c_str();
-  X86Mem mem =
-      cc.newConst(kConstScopeLocal, ptr, str.size() * sizeof(char32_t));
 
-  auto pval = cc.newIntPtr("pval");
-  cc.lea(pval, mem);
-  /*
-  // auto str_ptr = cc.newGpz("string literal");
-  // cc.lea(str_ptr, mem);
 
-  auto call =
-      cc.call(imm_ptr(jit_build_string),
-              FuncSignature2<void, ref*, const char *>());
+// does a math tree have a float literal in it. Without one there's nothing
+// to say the leaves are floats rather than ints
+static bool has_float_literal(ast::node *n) {
+  if (auto *num = dynamic_cast<ast::number_node *>(n)) return num->is_float;
+  auto *m = dynamic_cast<ast::math_op_node *>(n);
+  if (m == nullptr) return false;
+  for (auto *a : m->arguments)
+    if (has_float_literal(a)) return true;
+  return false;
+}
+
 
-  call->setArg(0, dst);
-  call->setArg(1, str_ptr);
-  */
+// math nested in more math, that works out to floats when its leaves are
+// floats, is done in XMM registers from the leaves to the result, so only
+// the result is written back to a slot. The leaves are evaluated first, so
+// if one of them isn't a number its math happens after the rest of them
+// instead of in between. Only trees with a float literal in them are done
+// this way: (+ (* a b) c) is usually int math, which the inline int paths
+// in arith do much better than the tree's way out. Returns false if the
+// tree isn't like that
+bool compiler::compile_float_tree(int dst, ast::math_op_node *n) {
+  bool nested = false;
+  for (auto *a : n->arguments)
+    if (dynamic_cast<ast::math_op_node *>(a) != nullptr) nested = true;
+  std::vector<ast::node *> leaves;
+  if (!nested || !has_float_literal(n) || float_kind(n, leaves) != 2)
+    return false;
+
+  int base = push_slots(leaves.size());
+  for (size_t i = 0; i < leaves.size(); i++)
+    compile_node(base + i, leaves[i], false);
+
+  Label slow = cc.newLabel();
+  Label done = cc.newLabel();
+  for (size_t i = 0; i < leaves.size(); i++) {
+    cc.cmp(flags(base + i), Imm(FLOAT_FLAGS));
+    cc.jne(slow);
+  }
+  size_t next = 0;
+  X86Xmm x = float_expr(n, base, next);
+  cc.movsd(value(dst), x);
+  cc.mov(flags(dst), Imm(FLOAT_FLAGS));
+  cc.jmp(done);
+
+  cc.bind(slow);
+  handle->nodes.push_back(n);
+  call_helper((void *)ast_math_tree, dst, (i64)n, base - dst);
+  cc.bind(done);
+  pop_slots(leaves.size());
+  return true;
 }
 
 
+// emit a float tree's math, with its leaves' values in the slots from
+// `leaves` on. Uses the VEX encodings when the CPU has AVX2, which saves
+// the copies the two operand SSE forms need
+X86Xmm compiler::float_expr(ast::node *n, int leaves, size_t &next) {
+  static bool vex = simd::host_level() >= simd::avx2;
+  X86Xmm x = cc.newXmmSd();
+
+  auto constant = [&](double d) {
+    X86Xmm c = cc.newXmmSd();
+    reg t = cc.newGpq();
+    i64 bits;
+    memcpy(&bits, &d, sizeof(bits));
+    cc.mov(t, Imm(bits));
+    cc.movq(c, t);
+    return c;
+  };
+
+  if (auto *num = dynamic_cast<ast::number_node *>(n))
+    return constant(num->is_float ? num->d : (double)num->i);
+
+  auto *m = dynamic_cast<ast::math_op_node *>(n);
+  if (m == nullptr) {
+    cc.movsd(x, value(leaves + next++));
+    return x;
+  }
 
-static int round_up(int numToRound, int multiple) {
-  if (multiple == 0) return numToRound;
-  int remainder = numToRound % multiple;
-  if (remainder == 0) return numToRound;
-  return numToRound + multiple - remainder;
+  auto op = [&](char o, X86Xmm a, X86Xmm b) {
+    switch (o) {
+      case '+':
+        vex ? cc.vaddsd(a, a, b) : cc.addsd(a, b);
+        break;
+      case '-':
+        vex ? cc.vsubsd(a, a, b) : cc.subsd(a, b);
+        break;
+      case '*':
+        vex ? cc.vmulsd(a, a, b) : cc.mulsd(a, b);
+        break;
+      case '/':
+        vex ? cc.vdivsd(a, a, b) : cc.divsd(a, b);
+        break;
+    }
+  };
+
+  x = float_expr(m->arguments[0], leaves, next);
+  if (m->arguments.size() == 1) {
+    // negating is multiplying by -1, like ref::binary_op does it
+    if (m->op == '-') op('*', x, constant(-1.0));
+    return x;
+  }
+  for (size_t i = 1; i < m->arguments.size(); i++)
+    op(m->op, x, float_expr(m->arguments[i], leaves, next));
+  return x;
 }
 
 
-stkregion compiler::salloc(short size) {
-  size = round_up(size, alignment);
-  int region_count = size / alignment;
-  stkregion r;
-  r.size = size;
-  for (int i = 0; i < regions.size(); i++) {
-    r.ind = i;
-    bool valid = true;
-    for (int j = 0; j < region_count; j++) {
-      if (regions[i + j]) {
-        valid = false;
+// ints and floats are done inline. Anything else, mixed ints and floats,
+// int division and ints that overflow go through ref::binary_op, which is
+// what decides what the answer is
+void compiler::arith(char op, int dst, int rhs) {
+  Label slow = cc.newLabel();
+  Label done = cc.newLabel();
+  Label not_int = cc.newLabel();
+
+  cc.cmp(flags(dst), Imm(INT_FLAGS));
+  cc.jne(not_int);
+  if (op == '/') {
+    cc.jmp(slow);
+  } else {
+    cc.cmp(flags(rhs), Imm(INT_FLAGS));
+    cc.jne(slow);
+    reg t = cc.newGpq();
+    cc.mov(t, value(dst));
+    switch (op) {
+      case '+':
+        cc.add(t, value(rhs));
+        break;
+      case '-':
+        cc.sub(t, value(rhs));
+        break;
+      case '*':
+        cc.imul(t, value(rhs));
         break;
-      }
     }
-    if (valid) goto found;
+    cc.jo(slow);
+    cc.mov(value(dst), t);
+    cc.jmp(done);
+  }
+
+  cc.bind(not_int);
+  cc.cmp(flags(dst), Imm(FLOAT_FLAGS));
+  cc.jne(slow);
+  cc.cmp(flags(rhs), Imm(FLOAT_FLAGS));
+  cc.jne(slow);
+  X86Xmm x = cc.newXmmSd();
+  cc.movsd(x, value(dst));
+  switch (op) {
+    case '+':
+      cc.addsd(x, value(rhs));
+      break;
+    case '-':
+      cc.subsd(x, value(rhs));
+      break;
+    case '*':
+      cc.mulsd(x, value(rhs));
+      break;
+    case '/':
+      cc.divsd(x, value(rhs));
+      break;
   }
-  r.ind = sbrk(region_count);
-  goto found;
-found:
-  for (int i = 0; i < region_count; i++) {
-    regions[r.ind + i] = true;
+  cc.movsd(value(dst), x);
+  cc.jmp(done);
+
+  cc.bind(slow);
+  call_helper((void *)ast_arith, dst, op, rhs - dst);
+  cc.bind(done);
+}
+
+
+void compiler::compile_dot(int dst, ast::dot_node *n) {
+  compile_node(dst, n->obj, false);
+
+  for (auto &st : n->steps) {
+    handle->attrs.emplace_back();
+    auto *site = &handle->attrs.back();
+    site->id = st.id;
+
+    if (st.val != nullptr) {
+      int base = push_slots(2);
+      copy_slot(base, dst);
+      compile_node(base + 1, st.val, false);
+      call_helper((void *)ast_set_attr, base, (i64)site, 0);
+      copy_slot(dst, base);
+      pop_slots(2);
+      break;
+    }
+
+    if (!st.call) {
+      call_helper((void *)ast_get_attr, dst, (i64)site, 0);
+      continue;
+    }
+
+    // the method goes in the first slot, then the object as self and the
+    // arguments after it
+    int argc = st.args.size() + 1;
+    int base = push_slots(argc + 1);
+    copy_slot(base, dst);
+    copy_slot(base + 1, dst);
+    for (size_t i = 0; i < st.args.size(); i++) {
+      compile_node(base + 2 + i, st.args[i], false);
+    }
+    call_helper((void *)ast_invoke, base, (i64)site, argc);
+    copy_slot(dst, base);
+    pop_slots(argc + 1);
   }
-  r.ptr = cc.newGpz();
-  r.used = true;
-  cc.lea(r.ptr, stk.adjusted(r.ind * alignment));
-#ifdef JIT_DEBUG
-  printf("+ %4d bytes: ", r.size);
-  dump_stack();
-#endif
-  return r;
 }
 
-void compiler::sfree(stkregion &r) {
-  r.used = false;
-  int region_count = r.size / alignment;
-  int ind = r.ind;
 
-  for (int i = 0; i < region_count; i++) {
-    regions[ind + i] = false;
+void compiler::compile_recur(ast::recur_node *n) {
+  int argc = n->arguments.size();
+  int base = push_slots(argc);
+  for (int i = 0; i < argc; i++) {
+    compile_node(base + i, n->arguments[i], false);
   }
+  call_helper((void *)ast_recur, base, argc, 0);
+  cc.jmp(start);
+  pop_slots(argc);
+}
+
 
-#ifdef JIT_DEBUG
-  printf("- %4d bytes: ", r.size);
-  dump_stack();
-#endif
+void compiler::compile_eval(int dst, ast::eval_node *n) {
+  compile_node(dst, n->val, false);
+  call_helper((void *)ast_eval, dst, 0, 0);
 }
 
-int compiler::sbrk(int rc) {
-  int oi = regions.size();
-  for (int i = 0; i < rc; i++) {
-    regions.push_back(false);
+
+
+
+lambda *jit::compile(ref obj, module *mod) {
+  static bool disabled = getenv("CDRNOJIT") != nullptr;
+  if (!disabled) {
+    try {
+      compiler c(mod);
+      lambda *fn = c.run(obj);
+      if (fn != nullptr) return fn;
+    } catch (ast::unsupported_form &) {
+      // compiled below instead
+    }
   }
-  // resize the stack virtual register
-  VirtReg *vr = cc.getVirtRegById(stk.getBaseId());
-  vr->_size = regions.size() * alignment;
 
-  return oi;
+  vm::compiler c;
+  c.mod = mod;
+  lambda *fn = ref_cast<lambda>(c.compile(obj, mod));
+  fn->mod = mod;
+  return fn;
+}
+
+
+lambda *jit::compile(runes s, module *mod) {
+  reader reader;
+  reader.lex_source(s);
+  bool v;
+  return compile(reader.read_one(&v), mod);
 }
 
 
-void compiler::dump_stack() {
-#ifdef JIT_DEBUG
-  printf("stack: {");
-  for (int i = 0; i < regions.size(); i++) {
-    auto r = regions[i];
-    printf("%c", r ? '#' : ' ');
+ref jit::eval(ref obj, module *mod) {
+  lambda *fn = compile(obj, mod);
+  if (fn->code_type == lambda::bytecode_type) {
+    return eval_lambda(fn->prime(0, nullptr));
   }
-  printf("}\n");
-#endif
+  call_context c;
+  c.mod = mod;
+  return call_function(fn, 0, nullptr, &c);
 }
@@ -0,0 +1,260 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Nick Wanninger
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// telling profilers and debuggers where JIT code lives. perf reads a plain
+// text map of address ranges to names, and gdb is handed a small in memory
+// ELF object per piece of code, with a symbol for every function in it
+
+#include <cedar/jit.h>
+#include <cedar/object/module.h>
+#include <elf.h>
+#include <unistd.h>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+
+using namespace cedar;
+using namespace cedar::jit;
+
+
+// the interface gdb breaks on to find JIT code. The names and layout are
+// fixed by gdb (see "JIT Compilation Interface" in its manual)
+extern "C" {
+enum jit_actions_t { JIT_NOACTION = 0, JIT_REGISTER_FN, JIT_UNREGISTER_FN };
+
+struct jit_code_entry {
+  jit_code_entry *next_entry;
+  jit_code_entry *prev_entry;
+  const char *symfile_addr;
+  uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+  uint32_t version;
+  uint32_t action_flag;
+  jit_code_entry *relevant_entry;
+  jit_code_entry *first_entry;
+};
+
+void __attribute__((noinline)) __jit_debug_register_code(void) {
+  asm volatile("" ::: "memory");
+}
+
+jit_descriptor __jit_debug_descriptor = {1, JIT_NOACTION, nullptr, nullptr};
+}
+
+
+std::string jit::dump_dir;
+
+static bool perf_map = getenv("CDRPERFMAP") != nullptr;
+static bool gdb_jit = getenv("CDRGDBJIT") != nullptr;
+
+static std::mutex describe_lock;
+static FILE *perf_file = nullptr;
+// gdb entries by the code they describe, so they can be taken out again
+static std::unordered_map<void *, jit_code_entry *> gdb_entries;
+
+
+bool jit::describing(void) {
+  return perf_map || gdb_jit || !dump_dir.empty();
+}
+
+
+std::string jit::code_name(ref name, ref defining, module *mod) {
+  std::string s;
+  if (!name.is_nil()) {
+    s = name.to_string(true);
+  } else if (!defining.is_nil()) {
+    // the start of the form is usually enough to find it
+    s = defining.to_string(true);
+    for (auto &c : s)
+      if (c == '\n' || c == '\t') c = ' ';
+    if (s.size() > 48) s = s.substr(0, 45) + "...";
+  } else {
+    s = "lambda";
+  }
+  if (mod != nullptr && !mod->path.empty()) s += " (" + mod->path + ")";
+  return s;
+}
+
+
+FILE *jit::open_dump(const std::string &name) {
+  static std::atomic<u64> next_dump{0};
+  if (dump_dir.empty()) return nullptr;
+  std::string file = name;
+  for (auto &c : file)
+    if (c == '/' || c == ' ' || c == '(' || c == ')') c = '_';
+  if (file.size() > 64) file.resize(64);
+  file = dump_dir + "/" + std::to_string(next_dump++) + "-" + file + ".s";
+  FILE *fp = fopen(file.c_str(), "w");
+  if (fp != nullptr) fprintf(fp, "; %s\n", name.c_str());
+  return fp;
+}
+
+
+// build an ELF relocatable whose only section is a NOBITS .text placed at
+// the code, so gdb can symbolize it without us copying any of it
+static std::string make_symfile(void *code, size_t size,
+                                const std::vector<code_symbol> &syms) {
+  enum { s_null, s_text, s_shstrtab, s_strtab, s_symtab, s_count };
+  static const char shstrtab[] = "\0.text\0.shstrtab\0.strtab\0.symtab";
+
+  std::string strtab(1, '\0');
+  std::vector<Elf64_Sym> symtab(1);
+  memset(&symtab[0], 0, sizeof(Elf64_Sym));
+  for (auto &sym : syms) {
+    Elf64_Sym s;
+    memset(&s, 0, sizeof(s));
+    s.st_name = strtab.size();
+    s.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+    s.st_shndx = s_text;
+    s.st_value = sym.offset;
+    s.st_size = sym.size;
+    symtab.push_back(s);
+    strtab += sym.name;
+    strtab.push_back('\0');
+  }
+
+  size_t shoff = sizeof(Elf64_Ehdr);
+  size_t shstr_off = shoff + s_count * sizeof(Elf64_Shdr);
+  size_t str_off = shstr_off + sizeof(shstrtab);
+  size_t sym_off = (str_off + strtab.size() + 7) & ~(size_t)7;
+  size_t total = sym_off + symtab.size() * sizeof(Elf64_Sym);
+
+  std::string out(total, '\0');
+  char *buf = &out[0];
+
+  auto *eh = (Elf64_Ehdr *)buf;
+  memcpy(eh->e_ident, ELFMAG, SELFMAG);
+  eh->e_ident[EI_CLASS] = ELFCLASS64;
+  eh->e_ident[EI_DATA] = ELFDATA2LSB;
+  eh->e_ident[EI_VERSION] = EV_CURRENT;
+  eh->e_ident[EI_OSABI] = ELFOSABI_NONE;
+  eh->e_type = ET_REL;
+  eh->e_machine = EM_X86_64;
+  eh->e_version = EV_CURRENT;
+  eh->e_shoff = shoff;
+  eh->e_ehsize = sizeof(Elf64_Ehdr);
+  eh->e_shentsize = sizeof(Elf64_Shdr);
+  eh->e_shnum = s_count;
+  eh->e_shstrndx = s_shstrtab;
+
+  auto *sh = (Elf64_Shdr *)(buf + shoff);
+  sh[s_text].sh_name = 1;
+  sh[s_text].sh_type = SHT_NOBITS;
+  sh[s_text].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  sh[s_text].sh_addr = (Elf64_Addr)code;
+  sh[s_text].sh_size = size;
+  sh[s_text].sh_addralign = 16;
+
+  sh[s_shstrtab].sh_name = 7;
+  sh[s_shstrtab].sh_type = SHT_STRTAB;
+  sh[s_shstrtab].sh_offset = shstr_off;
+  sh[s_shstrtab].sh_size = sizeof(shstrtab);
+  sh[s_shstrtab].sh_addralign = 1;
+
+  sh[s_strtab].sh_name = 17;
+  sh[s_strtab].sh_type = SHT_STRTAB;
+  sh[s_strtab].sh_offset = str_off;
+  sh[s_strtab].sh_size = strtab.size();
+  sh[s_strtab].sh_addralign = 1;
+
+  sh[s_symtab].sh_name = 25;
+  sh[s_symtab].sh_type = SHT_SYMTAB;
+  sh[s_symtab].sh_offset = sym_off;
+  sh[s_symtab].sh_size = symtab.size() * sizeof(Elf64_Sym);
+  sh[s_symtab].sh_link = s_strtab;
+  // every symbol after the null one is global
+  sh[s_symtab].sh_info = 1;
+  sh[s_symtab].sh_addralign = 8;
+  sh[s_symtab].sh_entsize = sizeof(Elf64_Sym);
+
+  memcpy(buf + shstr_off, shstrtab, sizeof(shstrtab));
+  memcpy(buf + str_off, strtab.data(), strtab.size());
+  memcpy(buf + sym_off, symtab.data(), symtab.size() * sizeof(Elf64_Sym));
+  return out;
+}
+
+
+void jit::describe_code(void *code, size_t size,
+                        const std::vector<code_symbol> &syms) {
+  if (!perf_map && !gdb_jit) return;
+  std::unique_lock<std::mutex> lock(describe_lock);
+
+  if (perf_map) {
+    if (perf_file == nullptr) {
+      auto path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+      perf_file = fopen(path.c_str(), "a");
+    }
+    if (perf_file != nullptr) {
+      for (auto &sym : syms)
+        fprintf(perf_file, "%lx %lx %s\n",
+                (unsigned long)((char *)code + sym.offset),
+                (unsigned long)sym.size, sym.name.c_str());
+      fflush(perf_file);
+    }
+  }
+
+  if (gdb_jit) {
+    std::string obj = make_symfile(code, size, syms);
+    // gdb reads these out of our memory whenever it likes, so they are
+    // kept off the GC heap and only freed by forget_code
+    char *file = (char *)malloc(obj.size());
+    memcpy(file, obj.data(), obj.size());
+    auto *entry = (jit_code_entry *)calloc(1, sizeof(jit_code_entry));
+    entry->symfile_addr = file;
+    entry->symfile_size = obj.size();
+    entry->next_entry = __jit_debug_descriptor.first_entry;
+    if (entry->next_entry != nullptr) entry->next_entry->prev_entry = entry;
+    __jit_debug_descriptor.first_entry = entry;
+    __jit_debug_descriptor.relevant_entry = entry;
+    __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+    __jit_debug_register_code();
+    gdb_entries[code] = entry;
+  }
+}
+
+
+void jit::forget_code(void *code) {
+  if (!gdb_jit) return;
+  std::unique_lock<std::mutex> lock(describe_lock);
+  auto it = gdb_entries.find(code);
+  if (it == gdb_entries.end()) return;
+  jit_code_entry *entry = it->second;
+  gdb_entries.erase(it);
+
+  if (entry->prev_entry != nullptr)
+    entry->prev_entry->next_entry = entry->next_entry;
+  else
+    __jit_debug_descriptor.first_entry = entry->next_entry;
+  if (entry->next_entry != nullptr)
+    entry->next_entry->prev_entry = entry->prev_entry;
+  __jit_debug_descriptor.relevant_entry = entry;
+  __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+  __jit_debug_register_code();
+
+  free((void *)entry->symfile_addr);
+  free(entry);
+}
@@ -23,18 +23,29 @@
  */
 
 #include <apathy.h>
+#include <cedar/globals.h>
+#include <cedar/jit.h>
 #include <cedar/modules.h>
 #include <cedar/object/lambda.h>
 #include <cedar/object/module.h>
 #include <cedar/object/string.h>
 #include <cedar/object/symbol.h>
+#include <cedar/objtype.h>
 #include <cedar/parser.h>
+#include <cedar/serialize.h>
+#include <cedar/version.h>
 #include <cedar/vm/compiler.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/filesystem.hpp>
 #include <cedar/util.hpp>
 #include <flat_hash_map.hpp>
 #include <mutex>
+#include <stdexcept>
 #include <unordered_map>
 
 #ifndef BUILD_DIR
@@ -68,7 +79,267 @@ static ska::flat_hash_map<std::string, module *> modules;
 
 
 
-static module *require_file(apathy::Path p) {
+// Compiled modules are cached in a .cdrc file next to their source (or in
+// $CDRCACHE if it's set), so requiring them again skips reading, expanding
+// and compiling. The cache holds the top level forms' lambdas in the order
+// they ran, and is only used if it was written by this version of cedar from
+// the same source. Macros a module uses from the core and the modules it
+// requires are baked in, so the cache also lists those modules with their
+// fingerprints (a hash of their source and of their own dependencies) and is
+// thrown out when any of them has changed. CDRNOCACHE turns the cache off.
+// Bump CACHE_FORMAT when the bytecode changes
+#define CACHE_FORMAT 2
+
+struct cache_header {
+  char magic[4];
+  u32 format;
+  char version[16];
+  // FNV-1a of the source
+  u64 hash;
+  u64 forms;
+  // how many dependencies follow the header, each a u32 length, the path
+  // and the u64 fingerprint it had. The forms come after them
+  u64 deps;
+};
+
+
+// the fingerprint of every module loaded from a file, by path
+static ska::flat_hash_map<std::string, u64> fingerprints;
+// the modules each module that's being loaded has required so far
+static ska::flat_hash_map<std::string, std::vector<std::string>> loading;
+
+
+static u64 fnv(u64 h, const void *data, size_t len) {
+  auto *p = (const unsigned char *)data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+static u64 source_hash(const std::string &src) {
+  return fnv(14695981039346656037ULL, src.data(), src.size());
+}
+
+
+static cache_header make_header(const std::string &src, u64 forms, u64 deps) {
+  cache_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "CDRC", 4);
+  h.format = CACHE_FORMAT;
+  strncpy(h.version, CEDAR_VERSION, sizeof(h.version) - 1);
+  h.hash = source_hash(src);
+  h.forms = forms;
+  h.deps = deps;
+  return h;
+}
+
+
+// a module's fingerprint covers its own source and everything it was built
+// from, so a change anywhere below it changes it too
+static u64 fingerprint(const std::string &src,
+                       const std::vector<std::pair<std::string, u64>> &deps) {
+  u64 h = source_hash(src);
+  for (auto &dep : deps) h = fnv(h, &dep.second, sizeof(dep.second));
+  return h;
+}
+
+
+static module *require_file(apathy::Path p, const std::string &from = "");
+
+
+// load a module the cache depends on, and give back its fingerprint. 0 if
+// it's gone
+static u64 dependency_fingerprint(const std::string &path) {
+  if (!apathy::Path(path).is_file()) return 0;
+  require_file(path);
+  std::lock_guard<std::mutex> lock(mod_mutex);
+  auto it = fingerprints.find(path);
+  return it == fingerprints.end() ? 0 : it->second;
+}
+
+
+static std::string cache_path(const std::string &path) {
+  const char *dir = getenv("CDRCACHE");
+  if (dir == nullptr) return path + "c";
+  // flatten the whole path into one file name in the cache dir
+  std::string name = path;
+  for (char &c : name)
+    if (c == '/') c = '%';
+  return std::string(dir) + "/" + name + "c";
+}
+
+
+// run a module from its cache. Returns false, without having run anything,
+// if there is no cache or it's stale or damaged. The dependencies it lists
+// are loaded to check them, and come back in deps
+static bool load_cache(const std::string &path, const std::string &src,
+                       module *mod,
+                       std::vector<std::pair<std::string, u64>> &deps) {
+  int fd = open(cache_path(path).c_str(), O_RDONLY);
+  if (fd == -1) return false;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(cache_header)) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  auto *found = (cache_header *)map;
+  cache_header want = make_header(src, found->forms, found->deps);
+  std::vector<lambda *> forms;
+  bool valid = memcmp(found, &want, sizeof(want)) == 0;
+
+  // the dependencies, which all have to still have the fingerprint they
+  // had when the cache was written
+  size_t off = sizeof(cache_header);
+  for (u64 i = 0; valid && i < found->deps; i++) {
+    u32 len;
+    u64 print;
+    valid = size - off >= sizeof(len);
+    if (!valid) break;
+    memcpy(&len, (char *)map + off, sizeof(len));
+    off += sizeof(len);
+    valid = size - off >= (size_t)len + sizeof(print);
+    if (!valid) break;
+    std::string dep((char *)map + off, len);
+    off += len;
+    memcpy(&print, (char *)map + off, sizeof(print));
+    off += sizeof(print);
+    valid = dependency_fingerprint(dep) == print;
+    deps.push_back({dep, print});
+  }
+
+  if (valid) {
+    // the serializer reads from a FILE, so read the mapping through one
+    FILE *fp = fmemopen((char *)map + off, size - off, "r");
+    if (fp == nullptr) valid = false;
+    if (valid) {
+      serializer s(fp);
+      // a cache that was cut short or garbled makes the reads throw, and
+      // is a miss like any other
+      try {
+        for (u64 i = 0; i < found->forms && valid; i++) {
+          ref obj = s.read();
+          if (obj.get_type() != lambda_type) valid = false;
+          if (valid) forms.push_back(ref_cast<lambda>(obj));
+        }
+      } catch (std::runtime_error &) {
+        valid = false;
+      }
+      // and one with anything after the forms isn't the one we wrote
+      valid = valid && ftell(fp) == (long)(size - off);
+      fclose(fp);
+    }
+  }
+  munmap(map, size);
+  if (!valid) {
+    deps.clear();
+    return false;
+  }
+
+  for (auto *fn : forms) {
+    fn->mod = mod;
+    eval_lambda(fn->prime(0, nullptr));
+  }
+  return true;
+}
+
+
+// write the top level lambdas a module ran to its cache. The file is written
+// to the side and renamed in, so a concurrent require never sees half of one
+static void write_cache(const std::string &path, const std::string &src,
+                        std::vector<lambda *> &forms,
+                        std::vector<std::pair<std::string, u64>> &deps) {
+  std::string dst = cache_path(path);
+  std::string tmp = dst + ".tmp" + std::to_string(getpid());
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  // not being able to write the cache isn't an error, it's just slower
+  if (fp == nullptr) return;
+
+  cache_header h = make_header(src, forms.size(), deps.size());
+  bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+  for (auto &dep : deps) {
+    u32 len = dep.first.size();
+    ok = ok && fwrite(&len, sizeof(len), 1, fp) == 1;
+    ok = ok && fwrite(dep.first.data(), 1, len, fp) == len;
+    ok = ok && fwrite(&dep.second, sizeof(dep.second), 1, fp) == 1;
+  }
+  try {
+    serializer s(fp);
+    for (auto *fn : forms) s.write(fn);
+  } catch (std::exception &) {
+    // a constant the serializer doesn't know (from a macro, usually)
+    ok = false;
+  }
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), dst.c_str()) != 0) unlink(tmp.c_str());
+}
+
+
+// evaluate a module's source one top level form at a time, like
+// eval_string_in_module, keeping the compiled forms for the cache. Gives
+// back the module's fingerprint
+static u64 eval_module_source(const std::string &path, const std::string &str,
+                              module *mod) {
+  static bool no_cache =
+      getenv("CDRNOCACHE") != nullptr || getenv("CDRASTJIT") != nullptr;
+  cedar::runes src = str;
+  std::vector<std::pair<std::string, u64>> deps;
+  if (no_cache) {
+    eval_string_in_module(src, mod);
+    return fingerprint(str, deps);
+  }
+  if (load_cache(path, str, mod, deps)) return fingerprint(str, deps);
+
+  // everything but the core is built with the core's macros
+  std::vector<std::string> required;
+  if (core_mod != nullptr && core_mod != mod) required.push_back(core_mod->path);
+  {
+    std::lock_guard<std::mutex> lock(mod_mutex);
+    loading[path] = required;
+  }
+
+  reader reader;
+  reader.lex_source(src);
+  bool valid = true;
+  std::vector<lambda *> forms;
+  while (true) {
+    ref obj = reader.read_one(&valid);
+    if (!valid) break;
+    vm::compiler c;
+    c.mod = mod;
+    lambda *fn = ref_cast<cedar::lambda>(c.compile(obj, mod));
+    fn->mod = mod;
+    forms.push_back(fn);
+    eval_lambda(fn->prime(0, nullptr));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mod_mutex);
+    required = loading[path];
+    loading.erase(path);
+    for (auto &dep : required) {
+      auto it = fingerprints.find(dep);
+      // the core and modules loaded from files are the only ones with
+      // fingerprints. Built in modules go with the version of cedar
+      if (it != fingerprints.end()) deps.push_back({dep, it->second});
+    }
+  }
+  write_cache(path, str, forms, deps);
+  return fingerprint(str, deps);
+}
+
+
+
+// load a module from a file, if it hasn't been already. from is the path of
+// the module requiring it, which depends on it
+static module *require_file(apathy::Path p, const std::string &from) {
   std::string path = p.string();
 
   // lock the module mutex
@@ -77,6 +348,8 @@ static module *require_file(apathy::Path p) {
   if (modules.count(path) != 0) {
     // if it has, grab it
     auto m = modules.at(path);
+    auto it = loading.find(from);
+    if (it != loading.end()) it->second.push_back(path);
     // unlock
     mod_mutex.unlock();
     return m;
@@ -89,16 +362,17 @@ static module *require_file(apathy::Path p) {
   std::string str((std::istreambuf_iterator<char>(fp)),
                   std::istreambuf_iterator<char>());
 
-  cedar::runes src = str;
-
   module *mod = new module(path);
   mod->path = path;
   static auto file_id = symbol::intern("*file*");
   mod->setattr_fast(file_id, new string(path));
-  eval_string_in_module(src, mod);
+  u64 print = eval_module_source(path, str, mod);
 
   mod_mutex.lock();
   modules[path] = mod;
+  fingerprints[path] = print;
+  auto it = loading.find(from);
+  if (it != loading.end()) it->second.push_back(path);
   mod_mutex.unlock();
   return mod;
 }
@@ -119,13 +393,13 @@ module *cedar::require(std::string name, std::string base) {
   for (std::string p : path) {
     apathy::Path f = p;
     f.append(name);
-    if (f.is_directory()) return require_file(f.append("main.cdr"));
-    if (f.is_file()) return require_file(f);
+    if (f.is_directory()) return require_file(f.append("main.cdr"), base);
+    if (f.is_file()) return require_file(f, base);
     // well the above stuff didn't work...
     // so lets try adding .cdr to the end :)
     f = p;
     f.append(name + ".cdr");
-    if (f.is_file()) return require_file(f);
+    if (f.is_file()) return require_file(f, base);
   }
   throw cedar::make_exception("unable to find module, '", name, "' in path");
 }
@@ -155,6 +429,11 @@ ref cedar::eval_string_in_module(cedar::runes &src, module *mod) {
 
 
 ref cedar::eval(ref obj, module *mod) {
+  // CDRASTJIT compiles top level forms straight to native code with the
+  // AST JIT instead
+  static bool ast_jit = getenv("CDRASTJIT") != nullptr;
+  if (ast_jit) return jit::eval(obj, mod);
+
   vm::compiler c;
   c.mod = mod;
   ref compiled_lambda = c.compile(obj, mod);
@@ -111,6 +111,39 @@ FOUND:
   return val;
 }
 
+
+
+ref cedar::lookup_method(ref obj, u64 id, ref &method_self) {
+  static auto __class__ID = symbol::intern("__class__");
+  static auto __addr__ID = symbol::intern("__addr__");
+
+  object *o = obj.get();
+  // resolve the same way object::getattr_fast does, just without the copy.
+  // Anything it doesn't handle (modules, numbers, nil) goes through getattr
+  if (o != nullptr && o->m_type != nullptr && o->m_type != module_type &&
+      id != __class__ID && id != __addr__ID) {
+    if (auto *b = o->m_attrs.buck(id); b != nullptr) {
+      ref val = b->val;
+      if (val.get_type() == lambda_type) method_self = val.as<lambda>()->self;
+      return val;
+    }
+    method_self = obj;
+    if (auto *b = o->m_type->m_fields.buck(id); b != nullptr) return b->val;
+    for (auto *t : o->m_type->m_parents) {
+      if (auto *b = t->m_fields.buck(id); b != nullptr) return b->val;
+    }
+    return object_type->get_field_fast(id);
+  }
+
+  symbol s;
+  s.id = id;
+  ref val = obj.getattr(&s);
+  if (val.get_type() == lambda_type) method_self = val.as<lambda>()->self;
+  return val;
+}
+
+
+
 attr_map::bucket *object::getattrbucket(u64 i) { return m_attrs.buck(i); }
 
 void object::setattr_fast(u64 k, ref v) { m_attrs.set(k, v); }
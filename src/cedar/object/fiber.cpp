@@ -24,45 +24,312 @@
 
 
 #include <cedar/globals.h>
+#include <cedar/jit.h>
 #include <cedar/object/channel.h>
 #include <cedar/object/fiber.h>
 #include <cedar/object/list.h>
 #include <cedar/object/module.h>
 #include <cedar/objtype.h>
+#include <cedar/passes.h>
 #include <cedar/thread.h>
 #include <cedar/vm/compiler.h>
+#include <cedar/vm/instruction.h>
 #include <cedar/vm/machine.h>
 #include <cedar/vm/opcode.h>
 #include <gc/gc.h>
 #include <unistd.h>
-#include <chrono>
+#include <algorithm>
 #include <mutex>
+#include <unordered_map>
 
 using namespace cedar;
 
 
 
 
-// the frame pool is a mechanism that attempts to
-// limit allocations on call stack changes
-static std::mutex frame_pool_lock;
-static int frame_pool_size = 0;
-static frame *frame_pool = nullptr;
+// methods found through a type are bound to the object they were looked up
+// on, the same way object::getattr_fast does it
+static inline ref bind_attr(object *o, ref val) {
+  if (val.get_type() == lambda_type) {
+    lambda *fn = ref_cast<lambda>(val)->copy();
+    fn->self = o;
+    return fn;
+  }
+  return val;
+}
+
+
+// can lookups of some attribute on this object be cached? Modules have their
+// own getattr_fast, and __class__ and __addr__ aren't stored anywhere
+static bool attr_cacheable(object *o, u64 id) {
+  static auto __class__ID = symbol::intern("__class__");
+  static auto __addr__ID = symbol::intern("__addr__");
+  return o != nullptr && o->m_type != nullptr && o->m_type != module_type &&
+         id != __class__ID && id != __addr__ID;
+}
+
+
+// find the entry for some receiver type that is still valid
+static inline vm::attr_cache_entry *find_attr_entry(vm::attr_cache *site,
+                                                    type *t) {
+  for (auto &way : site->entries) {
+    auto *entry = way.load(std::memory_order_acquire);
+    // ways are filled in order and never emptied
+    if (entry == nullptr) return nullptr;
+    if (entry->t == t &&
+        entry->version == t->version.load(std::memory_order_acquire))
+      return entry;
+  }
+  return nullptr;
+}
+
+
+static void fill_attr_cache(vm::attr_cache *site, type *t) {
+  auto *entry = new vm::attr_cache_entry();
+  entry->t = t;
+  // read the version before resolving, so a change in the middle of the
+  // lookup leaves the entry already stale
+  entry->version = t->version.load(std::memory_order_acquire);
+  // resolve like object::getattr_fast, but stop before object_type
+  if (auto *b = t->m_fields.buck(site->id); b != nullptr) {
+    entry->field = &b->val;
+  } else {
+    for (auto *p : t->m_parents) {
+      if (auto *b = p->m_fields.buck(site->id); b != nullptr) {
+        entry->field = &b->val;
+        break;
+      }
+    }
+  }
+
+  // take the first empty way, or the one holding a stale entry for this
+  // type. Otherwise replace them round robin
+  for (auto &way : site->entries) {
+    vm::attr_cache_entry *old = nullptr;
+    if (way.compare_exchange_strong(old, entry)) return;
+    if (old->t == t) {
+      way.store(entry, std::memory_order_release);
+      return;
+    }
+  }
+  site->entries[site->next++ % ATTR_CACHE_WAYS].store(
+      entry, std::memory_order_release);
+}
+
+
+ref vm::getattr_cached(vm::attr_cache *site, ref &obj) {
+  object *o = obj.get();
+  if (o != nullptr) {
+    if (auto *entry = find_attr_entry(site, o->m_type); entry != nullptr) {
+      // the object's own attributes shadow everything on the type
+      if (o->m_attrs.m_buckets != nullptr) {
+        if (auto *b = o->m_attrs.buck(site->id); b != nullptr) return b->val;
+      }
+      if (entry->field != nullptr) return bind_attr(o, *entry->field);
+    }
+  }
+
+  symbol s;
+  s.id = site->id;
+  ref val = obj.getattr(&s);
+  if (attr_cacheable(o, site->id) && find_attr_entry(site, o->m_type) == nullptr)
+    fill_attr_cache(site, o->m_type);
+  return val;
+}
+
+
+// the method lookup for OP_INVOKE. Shares the attribute caches with GET_ATTR,
+// but hands back methods found on the type unbound, with method_self set to
+// the receiver (see cedar::lookup_method)
+ref vm::lookup_method_cached(vm::attr_cache *site, ref &obj,
+                             ref &method_self) {
+  object *o = obj.get();
+  if (o != nullptr) {
+    if (auto *entry = find_attr_entry(site, o->m_type); entry != nullptr) {
+      if (o->m_attrs.m_buckets == nullptr ||
+          o->m_attrs.buck(site->id) == nullptr) {
+        if (entry->field != nullptr) {
+          method_self = obj;
+          return *entry->field;
+        }
+      }
+    }
+  }
+
+  ref val = lookup_method(obj, site->id, method_self);
+  if (attr_cacheable(o, site->id) && find_attr_entry(site, o->m_type) == nullptr)
+    fill_attr_cache(site, o->m_type);
+  return val;
+}
+
+
+void vm::setattr_cached(vm::attr_cache *site, ref &obj, ref &val) {
+  object *o = obj.get();
+  // only types whose instances keep attributes in m_attrs are ever cached
+  if (o != nullptr && find_attr_entry(site, o->m_type) != nullptr) {
+    o->m_attrs.set(site->id, val);
+    return;
+  }
+
+  symbol s;
+  s.id = site->id;
+  obj.setattr(&s, val);
+  if (attr_cacheable(o, site->id) && find_attr_entry(site, o->m_type) == nullptr)
+    fill_attr_cache(site, o->m_type);
+}
+
+
+
+
+// not a real opcode, anything without a handler dispatches here
+#define OP_UNKNOWN 0xFF
+
+// how many threaded words an instruction takes, its handler included
+static u64 threaded_size(vm::instruction &in) {
+  u64 n = 1;
+  if (in.type() == vm::imm_super) {
+    for (auto &p : in.parts)
+      if (p.type() != vm::no_arg) n++;
+  } else if (in.type() == vm::imm_invoke || in.type() == vm::imm_local) {
+    n += 2;
+  } else if (in.type() != vm::no_arg) {
+    n++;
+  }
+  return n;
+}
+
+
+// the word in some bytecode's threaded code that the instruction at address
+// starts at
+static u64 threaded_offset(vm::bytecode *code, u64 address) {
+  u64 nwords = 0;
+  for (auto &in : vm::decode_bytecode(code)) {
+    if (in.address == address) break;
+    nwords += threaded_size(in);
+  }
+  return nwords;
+}
 
 
-static frame *alloc_frame(void) { return new frame(); }
+// translate some bytecode into the direct threaded form fiber::run executes.
+// labels is the interpreter's handler table, indexed by opcode
+static vm::threaded_word *thread_bytecode(vm::bytecode *code, void **labels) {
+  auto insts = vm::decode_bytecode(code);
 
-static void dispose_frame(frame *f) { delete f; }
+  // the word each instruction starts at, so jumps can point right at it
+  std::unordered_map<u64, u64> word_at;
+  u64 nwords = 0;
+  for (auto &in : insts) {
+    word_at[in.address] = nwords;
+    nwords += threaded_size(in);
+  }
+  // running off the end lands on the unknown opcode handler
+  word_at[code->get_size()] = nwords++;
 
+  auto *words = new vm::threaded_word[nwords];
+  u64 w = 0;
 
+  auto operand = [&](vm::instruction &in) {
+    switch (in.type()) {
+      case vm::no_arg:
+      case vm::imm_super:
+        return;
+      case vm::imm_float:
+        words[w++].f = in.arg_float;
+        return;
+      case vm::imm_ptr:
+        words[w++].label = in.arg_voidptr;
+        return;
+      case vm::imm_object:
+        words[w++].label = in.arg_object;
+        return;
+      case vm::imm_global:
+        words[w++].cache = &code->global_caches[in.arg_slot];
+        return;
+      case vm::imm_attr:
+        words[w++].attr = &code->attr_caches[in.arg_slot];
+        return;
+      case vm::imm_invoke:
+        words[w++].attr = &code->attr_caches[in.arg_slot];
+        words[w++].i = in.arg_count;
+        return;
+      case vm::imm_local:
+        words[w++].i = in.arg_slot;
+        words[w++].i = in.arg_int;
+        return;
+      default:
+        break;
+    }
+    if (in.op == OP_CONST || in.op == OP_MAKE_FUNC) {
+      words[w++].cref = &code->constants[in.arg_int];
+    } else if (in.is_jump()) {
+      words[w++].target = words + word_at.at(in.arg_int);
+    } else {
+      // imm_name operands decode to the symbol id itself
+      words[w++].i = in.arg_int;
+    }
+  };
 
-static u64 time_microseconds(void) {
-  auto ms = std::chrono::duration_cast<std::chrono::microseconds>(
-      std::chrono::system_clock::now().time_since_epoch());
-  return ms.count();
+  for (auto &in : insts) {
+    words[w++].label = labels[in.op];
+    if (in.type() == vm::imm_super) {
+      for (auto &p : in.parts) operand(p);
+    } else {
+      operand(in);
+    }
+  }
+  words[w++].label = labels[OP_UNKNOWN];
+
+  // two workers might translate the same code at once, only one is kept
+  vm::threaded_word *expected = nullptr;
+  if (!code->threaded.compare_exchange_strong(expected, words)) {
+    delete[] words;
+    return expected;
+  }
+  return words;
+}
+
+
+extern ref true_value;
+
+
+// the cache miss path for OP_LOAD_GLOBAL. Does the full lookup (module, core,
+// then the global table) and if it found a binding, publishes a new inline
+// cache entry for the site
+ref vm::load_global_slow(vm::bytecode *code,
+                         std::atomic<vm::global_cache *> *site, module *m) {
+  return load_global_slow(code->global_names[site - code->global_caches], site,
+                          m);
 }
 
 
+ref vm::load_global_slow(u64 id, std::atomic<vm::global_cache *> *site,
+                         module *m) {
+  // read the version *before* looking anything up, so a change that happens
+  // in the middle of the lookup leaves the entry already stale
+  u64 version = binding_version.load(std::memory_order_acquire);
+  u64 mod_layout = m != nullptr ? m->layout.load() : 0;
+  u64 core_layout = core_mod != nullptr ? core_mod->layout.load() : 0;
+  ref *val = nullptr;
+  if (m != nullptr) val = m->find_slot(id, m);
+  if (val == nullptr && core_mod != nullptr) val = core_mod->find_slot(id, m);
+  if (val == nullptr) val = get_global_slot(id);
+
+  if (val == nullptr) {
+    // throws the "Unable to find global variable" exception
+    return get_global(id);
+  }
+
+  auto *entry = new vm::global_cache();
+  entry->mod = m;
+  entry->version = version;
+  entry->slot = val;
+  entry->mod_layout = mod_layout;
+  entry->core_layout = core_layout;
+  site->store(entry, std::memory_order_release);
+  return *val;
+}
+
 
 
 static std::mutex jid_mutex;
@@ -83,14 +350,18 @@ fiber::fiber(call_state entry) {
 
 fiber::~fiber(void) {
   delete[] stack;
+  delete[] frames;
 }
 
 
 
 
 void fiber::adjust_stack(int required) {
-  if (required == 0) required = 32;
-  if (required >= 0 && (stack_size < required || stack == nullptr)) {
+  if (required < 32) required = 32;
+  if (stack_size < required || stack == nullptr) {
+    // grow geometrically so deep recursion doesn't copy the stack on
+    // every new frame
+    required = std::max(required, stack_size * 2);
     ref *new_stack = new ref[required];
     if (stack != nullptr) {
       for (int i = 0; i < stack_size; i++) {
@@ -106,41 +377,112 @@ void fiber::adjust_stack(int required) {
 
 
 inline frame *fiber::add_call_frame(call_state call) {
+  if (frame_count == frame_cap) {
+    // the frames hold the only reference to some closures, so they
+    // have to stay in (gc visible) memory from operator new
+    int new_cap = frame_cap == 0 ? 16 : frame_cap * 2;
+    frame *new_frames = new frame[new_cap];
+    std::copy(frames, frames + frame_count, new_frames);
+    delete[] frames;
+    frames = new_frames;
+    frame_cap = new_cap;
+    // the old top frame went with the old array
+    if (top_frame != nullptr) top_frame = &frames[frame_count - 1];
+  }
 
-  frame *frm = new frame();
+  frame *frm = &frames[frame_count++];
   frm->call = call;
-  frm->caller = top_frame;
   frm->sp = top_frame == nullptr ? 0 : top_frame->sp;
-  frm->ip = call.func->code->code;
+  frm->bp = frm->sp;
+  frm->constructing = nullptr;
+  // the interpreter fills this in with the threaded code when it loads
+  // the frame, as only it knows where the handlers are
+  frm->ip = nullptr;
+  frm->resume = -1;
   top_frame = frm;
-  adjust_stack(frm->sp + call.func->code->stack_size);
+  bind_frame(frm);
   return frm;
+}
 
 
-  frame &old = frames.back();
-  frames.push_back(frame{});
-  frame &back = frames.back();
-  back.call = call;
-  back.sp = top_frame == nullptr ? 0 : old.sp;
-  back.ip = call.func->code->code;
-  top_frame = &back;
-  adjust_stack(back.sp + call.func->code->stack_size);
-  return &back;
+
+// set a frame up for the call it holds, starting at its bp. The arguments
+// the callee doesn't capture are copied into its stack slots, which is safe
+// to do in place when they are already on the stack above bp
+void fiber::bind_frame(frame *frm) {
+  call_state &call = frm->call;
+  auto *code = call.func->code;
+  ref *argv = call.argv;
+  // the arguments move with the stack if it has to grow
+  bool on_stack = argv != nullptr && argv >= stack && argv < stack + stack_size;
+  long arg_offset = on_stack ? argv - stack : 0;
+  // reserve all the stack this frame could ever need up front, so the
+  // interpreter doesn't have to check on each push
+  adjust_stack(frm->bp + code->slot_count + code->stack_size);
+  if (on_stack) argv = stack + arg_offset;
+
+  call.func->bind_args(nullptr, stack + frm->bp, call.argc, argv);
+  call.argc = 0;
+  call.argv = nullptr;
+  frm->sp = frm->bp + code->slot_count;
+  frm->entry_locals = call.locals;
 }
 
 
 
 frame *fiber::pop_call_frame(void) {
   frame *frm = top_frame;
-  top_frame = top_frame->caller;
+  // drop the references so the gc can collect what the frame was using
+  frm->call = call_state{nullptr, nullptr, nullptr, 0, nullptr};
+  frm->constructing = nullptr;
+  frm->entry_locals = nullptr;
+  frame_count--;
+  top_frame = frame_count == 0 ? nullptr : &frames[frame_count - 1];
   return frm;
 }
 
 
 
 
+// the slots and operand stack go where bind_frame would have put them, and
+// the scopes the code had pushed come along in locals
+void fiber::resume_at(lambda *fn, ref self, u64 address, ref *slots,
+                      ref *operands, int depth, closure *locals,
+                      closure *entry_locals) {
+  frame *frm = top_frame;
+  // a self tail call in native code may have moved on to another closure
+  // over the same code
+  frm->call.func = fn;
+  frm->call.self = self;
+  auto *code = fn->code;
+  for (int i = 0; i < code->slot_count; i++) stack[frm->bp + i] = slots[i];
+  int base = frm->bp + code->slot_count;
+  for (int i = 0; i < depth; i++) stack[base + i] = operands[i];
+  frm->sp = base + depth;
+  frm->call.locals = locals;
+  frm->entry_locals = entry_locals;
+  // the interpreter finds its place in the threaded code when it loads the
+  // frame
+  frm->ip = nullptr;
+  frm->resume = address;
+}
+
+
+void fiber::resume_call(lambda *fn, ref self, u64 address, ref *slots,
+                        ref *operands, int depth, closure *locals,
+                        closure *entry_locals) {
+  add_call_frame(call_state{fn, entry_locals, self, 0, nullptr});
+  resume_at(fn, self, address, slots, operands, depth, locals, entry_locals);
+}
+
+
+frame *fiber::push_call(call_state call) { return add_call_frame(call); }
+
+
+
+
 ref fiber::resume() {
-  run(4);
+  run(true);
   return return_value;
   return co.resume();
 }
@@ -159,7 +501,7 @@ void fiber::yield(ref v) {
 
 void fiber::co_run(void) {
   while (!done) {
-    run(4);
+    run(true);
     yield(return_value);
   }
 }
@@ -167,7 +509,7 @@ void fiber::co_run(void) {
 // run a fiber for its first return value
 // be it a yield or a real return
 ref fiber::run(void) {
-  run(-1);
+  run(false);
   return nullptr;
 }
 
@@ -175,31 +517,36 @@ ref fiber::run(void) {
 
 
 // the primary run loop for fibers in cedar
-void fiber::run(int max_ms) {
+void fiber::run(bool preemptible) {
   state = RUNNING;
-  u64 max_time = max_ms * 1000;
   // this function should have very minimal initialization code at the start
   // in order to make the yield operations easier. It should just act on
-  u64 start_time = time_microseconds();
 
-  reductions = 2000;
+  reductions = REDUCTION_BUDGET;
 
 
   int sp;
-  u8 *ip;
+  vm::threaded_word *ip;
 
   u8 op = 0;
-  u64 ran = 0;
   state.store(RUNNING);
-  u64 instructions_per_check = 1000;
 
 
 
 
-#define LOAD_CTX()            \
-  if (top_frame != nullptr) { \
-    sp = top_frame->sp;       \
-    ip = top_frame->ip;       \
+#define LOAD_CTX()                                                 \
+  if (top_frame != nullptr) {                                      \
+    sp = top_frame->sp;                                            \
+    ip = top_frame->ip;                                            \
+    if (ip == nullptr) {                                           \
+      vm::bytecode *__code = PROG()->code;                         \
+      ip = THREADED(__code);                                       \
+      /* a call native code handed back starts part way through */ \
+      if (top_frame->resume >= 0) {                                \
+        ip += threaded_offset(__code, top_frame->resume);          \
+        top_frame->resume = -1;                                    \
+      }                                                            \
+    }                                                              \
   }
 
 #define STORE_CTX()           \
@@ -208,9 +555,6 @@ void fiber::run(int max_ms) {
     top_frame->ip = ip;       \
   }
 
-  LOAD_CTX();
-
-
 #define PROG() top_frame->call.func
 #define LOCALS() top_frame->call.locals
 
@@ -219,8 +563,15 @@ void fiber::run(int max_ms) {
 
 #define PUSH(val) (stack[sp++] = (val))
 #define POP() (stack[--sp])
-#define CODE_READ(type) (*(type *)(void *)ip)
-#define CODE_SKIP(type) (ip += sizeof(type))
+// the next operand word of the current instruction
+#define OPERAND() (*ip++)
+// the threaded code for some bytecode, translating it if it hasn't been yet
+#define THREADED(bc)                                              \
+  ({                                                              \
+    vm::bytecode *__bc = (bc);                                    \
+    vm::threaded_word *__t = __bc->threaded.load(std::memory_order_acquire); \
+    __t != nullptr ? __t : thread_bytecode(__bc, threaded_labels); \
+  })
 #define LABEL(op) DO_##op
 #define CONSTANT(i) (PROG()->code->constants[(i)])
 #define SET_LABEL(op) threaded_labels[op] = &&DO_##op;
@@ -235,19 +586,18 @@ void fiber::run(int max_ms) {
   yield();
 
 
-#define OP_UNKNOWN 0xFF
-
   static bool created_thread_labels = false;
-  static void *threaded_labels[255];
+  static void *threaded_labels[256];
   // if the global thread label vector isn't initialized, we need to do that
   // first before executing any bytecode
   if (!created_thread_labels) {
-    for (int i = 0; i < 255; i++) threaded_labels[i] = &&LABEL(OP_UNKNOWN);
+    for (int i = 0; i < 256; i++) threaded_labels[i] = &&LABEL(OP_UNKNOWN);
     SET_LABEL(OP_NOP);
     SET_LABEL(OP_NIL);
     SET_LABEL(OP_CONST);
     SET_LABEL(OP_FLOAT);
     SET_LABEL(OP_INT);
+    SET_LABEL(OP_INT_8);
     SET_LABEL(OP_INT_NEG_1);
     SET_LABEL(OP_INT_0);
     SET_LABEL(OP_INT_1);
@@ -259,12 +609,16 @@ void fiber::run(int max_ms) {
 
     SET_LABEL(OP_LOAD_LOCAL);
     SET_LABEL(OP_SET_LOCAL);
+    SET_LABEL(OP_LOAD_SLOT);
+    SET_LABEL(OP_SET_SLOT);
+    SET_LABEL(OP_CLEAR_SLOT);
     SET_LABEL(OP_LOAD_GLOBAL);
     SET_LABEL(OP_SET_GLOBAL);
     SET_LABEL(OP_SET_PRIVATE);
     SET_LABEL(OP_CONS);
     SET_LABEL(OP_APPEND);
     SET_LABEL(OP_CALL);
+    SET_LABEL(OP_TAIL_CALL);
     SET_LABEL(OP_MAKE_FUNC);
 
     SET_LABEL(OP_MAKE_SCOPE);
@@ -279,6 +633,7 @@ void fiber::run(int max_ms) {
     SET_LABEL(OP_DUP);
     SET_LABEL(OP_GET_ATTR);
     SET_LABEL(OP_SET_ATTR);
+    SET_LABEL(OP_INVOKE);
     SET_LABEL(OP_SWAP);
     SET_LABEL(OP_DEF_MACRO);
     SET_LABEL(OP_EVAL);
@@ -297,61 +652,321 @@ void fiber::run(int max_ms) {
     SET_LABEL(OP_SEND);
     SET_LABEL(OP_RECV);
     SET_LABEL(OP_DICT_SET);
+    SET_LABEL(OP_IS_CORE);
     SET_LABEL(OP_GET_CURRENT_FUNC);
+
+#define SUPER_LABEL(name, code, size, effect, parts) SET_LABEL(code);
+    CEDAR_FOREACH_SUPERINSTRUCTION(SUPER_LABEL, SUPER_PART);
+#undef SUPER_LABEL
     created_thread_labels = true;
   }
 
+  LOAD_CTX();
 
 
 
-#define PRELUDE \
-  if (sp > stack_size - 10) adjust_stack(stack_size + 200);
-
 
+#ifdef CEDAR_DEBUG
 #define DISPATCH goto loop;
+#else
+#define DISPATCH goto *(ip++)->label;
+#endif
+
+
+// spend a reduction, and when the budget runs out, park the fiber if the
+// scheduler's timer has said this worker's time slice is over. Only used
+// right after ip has been moved to a new function (or the start of this
+// one), so the fiber picks up there when it's resumed
+#define REDUCE()                                                   \
+  if (--reductions <= 0) {                                         \
+    reductions = REDUCTION_BUDGET;                                 \
+    if (preemptible && worker != nullptr &&                        \
+        worker->yield_requested.load(std::memory_order_relaxed)) { \
+      state.store(PARKED);                                         \
+      YIELD();                                                     \
+    }                                                              \
+  }
 
 
 
-#define PREDICT(NEXTOP)   \
-  do {                    \
-    u8 next = *ip;        \
-    if (next == NEXTOP) { \
-      ip++;               \
-      goto DO_##NEXTOP;   \
-    }                     \
+#define PREDICT(NEXTOP)                 \
+  do {                                  \
+    if (ip->label == &&DO_##NEXTOP) {   \
+      ip++;                             \
+      goto DO_##NEXTOP;                 \
+    }                                   \
   } while (0);
 
 
 
-loop:
+// The bodies of the opcodes that can be fused into superinstructions. They
+// are macros so the superinstruction handlers can be pasted together from
+// them (see CEDAR_FOREACH_SUPERINSTRUCTION in opcode.h). A body must fall
+// through to the next part unless it's something that can only be the last
+// part of a superinstruction, like CALL or JUMP_IF_FALSE
 
-  if (ran > instructions_per_check) {
-    auto t = time_microseconds();
-    auto elapsed = time_microseconds() - start_time;
-    ran = 0;
-    if (elapsed > max_time) {
-      state.store(PARKED);
-      start_time = t;
-      YIELD();
-    }
+#define OP_BODY_LOAD_LOCAL              \
+  {                                     \
+    auto depth = OPERAND().i;           \
+    auto ind = OPERAND().i;             \
+    PUSH(LOCALS()->at(depth, ind));     \
+  }
+
+#define OP_BODY_LOAD_SLOT                    \
+  {                                          \
+    auto ind = OPERAND().i;                  \
+    PUSH(stack[top_frame->bp + ind]);        \
+  }
+
+#define OP_BODY_LOAD_GLOBAL                                                 \
+  {                                                                         \
+    auto *site = OPERAND().cache;                                           \
+    module *m = PROG()->mod;                                                \
+    auto *cache = site->load(std::memory_order_acquire);                    \
+    /* steady state: the cache was filled for this module and no binding    \
+       table has changed shape since, so the slot is still good */          \
+    if (cache != nullptr && cache->mod == m &&                              \
+        cache->version == binding_version.load(std::memory_order_acquire)) { \
+      PUSH(*cache->slot);                                                   \
+    } else {                                                                \
+      PUSH(vm::load_global_slow(PROG()->code, site, m));               \
+    }                                                                       \
+  }
+
+#define OP_BODY_ADD    \
+  {                    \
+    ref b = POP();     \
+    ref a = POP();     \
+    PUSH(a + b);       \
+  }
+
+#define OP_BODY_SUB    \
+  {                    \
+    ref b = POP();     \
+    ref a = POP();     \
+    PUSH(a - b);       \
+  }
+
+#define OP_BODY_INC    \
+  {                    \
+    ref a = POP();     \
+    PUSH(a + 1);       \
+  }
+
+#define OP_BODY_DEC    \
+  {                    \
+    ref a = POP();     \
+    PUSH(a - 1);       \
+  }
+
+#define OP_BODY_IS_CORE                                              \
+  {                                                                  \
+    auto k = OPERAND().i;                                            \
+    stack[sp - 1] = is_core_original(k, stack[sp - 1]) ? true_value  \
+                                                       : ref{nullptr}; \
+  }
+
+#define OP_BODY_JUMP_IF_FALSE                      \
+  {                                                \
+    static ref false_val = new symbol("false");    \
+    auto *target = OPERAND().target;               \
+    auto val = POP();                              \
+    if (val.is_nil() || val == false_val) {        \
+      ip = target;                                 \
+    }                                              \
+    DISPATCH;                                      \
+  }
+
+// the body of every call, with argc already read. SELF_PTR points at the self
+// to call a function with, or is null to use the function's own
+#define CALL_BODY(SELF_PTR)                                                  \
+  {                                                                          \
+    ref *argv = stack + sp - argc;                                           \
+    i64 new_fp = sp - argc - 1;                                              \
+    int abp = sp - argc; /* argumement base pointer, represents the base     \
+                            of the argument list */                          \
+    if (stack[new_fp].isa(lambda_type)) {                                    \
+      auto *new_program = stack[new_fp].reinterpret<cedar::lambda *>();     \
+      if (new_program == nullptr) {                                          \
+        throw cedar::make_exception(                                         \
+            "Function to be run in call returned nullptr");                  \
+      }                                                                      \
+                                                                             \
+      if (new_program->code_type == lambda::bytecode_type) {                 \
+        vm::bytecode *callee_code = new_program->code;                       \
+        if (callee_code->heat()) jit::tier_up(new_program);                  \
+        if (jit::can_enter(callee_code)) {                                   \
+          /* hot code runs natively, without a frame on this fiber, unless   \
+             it hands the rest of the call back to be interpreted */         \
+          ref val;                                                           \
+          sp = new_fp;                                                       \
+          STORE_CTX();                                                       \
+          if (jit::enter_native(                                             \
+                  new_program,                                               \
+                  (SELF_PTR) != nullptr ? *(SELF_PTR) : new_program->self,   \
+                  argc, argv, this, &val)) {                                 \
+            PUSH(val);                                                       \
+            PREDICT(OP_RETURN);                                              \
+            PREDICT(OP_SET_GLOBAL);                                          \
+            DISPATCH;                                                        \
+          }                                                                  \
+          LOAD_CTX();                                                        \
+          REDUCE();                                                          \
+          DISPATCH;                                                          \
+        }                                                                    \
+        auto call = new_program->prime(argc, stack + abp);                   \
+        if ((SELF_PTR) != nullptr) call.self = *(SELF_PTR);                  \
+                                                                             \
+        sp = new_fp;                                                         \
+        STORE_CTX();                                                         \
+        add_call_frame(call);                                                \
+        LOAD_CTX();                                                          \
+        REDUCE();                                                            \
+                                                                             \
+        PREDICT(OP_RETURN);                                                  \
+        PREDICT(OP_SET_GLOBAL);                                              \
+        DISPATCH;                                                            \
+      } else if (new_program->code_type == lambda::raw_function_type) {      \
+        ref callee_self =                                                    \
+            (SELF_PTR) != nullptr ? *(SELF_PTR) : top_frame->call.self;      \
+        /* the result goes right where the function was on the stack */      \
+        new_program->raw_binding(argc, argv, callee_self, this,              \
+                                 stack + new_fp);                            \
+        sp = new_fp + 1;                                                     \
+        PREDICT(OP_RETURN);                                                  \
+        PREDICT(OP_SET_GLOBAL);                                              \
+        DISPATCH;                                                            \
+      } else if (new_program->code_type == lambda::function_binding_type) {  \
+        call_context ctx;                                                    \
+        ctx.coro = this;                                                     \
+        ctx.mod = PROG()->mod;                                               \
+        function_callback c((SELF_PTR) != nullptr ? *(SELF_PTR)              \
+                                                  : top_frame->call.self,    \
+                            argc, argv, this, PROG()->mod);                  \
+        new_program->call(c);                                                \
+        ref val = c.get_return();                                            \
+        sp = new_fp;                                                         \
+        PUSH(val);                                                           \
+        PREDICT(OP_RETURN);                                                  \
+        PREDICT(OP_SET_GLOBAL);                                              \
+        DISPATCH;                                                            \
+      }                                                                      \
+    } else if (stack[new_fp].is<type>()) {                                   \
+      /**                                                                    \
+       *                                                                     \
+       * create an instance of a type                                        \
+       *                                                                     \
+       */                                                                    \
+      static auto __alloc__id = symbol::intern("__alloc__");                 \
+      static auto new_id = symbol::intern("new");                            \
+      /* if the function to be called was a type, we need to make an        \
+         instance */                                                         \
+      type *cls = stack[new_fp].as<type>();                                  \
+      ref alloc_func_ref = cls->getattr_fast(__alloc__id);                   \
+      call_context ctx;                                                      \
+      ctx.coro = this;                                                       \
+      ctx.mod = PROG()->mod;                                                 \
+      /* allocate the instance */                                            \
+      ref inst =                                                             \
+          call_function(alloc_func_ref.as<lambda>(), 0, stack + new_fp, &ctx); \
+      stack[new_fp] = inst;                                                  \
+      ref new_self;                                                          \
+      ref new_func_ref = lookup_method(inst, new_id, new_self);              \
+      if (!new_func_ref.is<lambda>()) {                                      \
+        throw cedar::make_exception("`new` method for ", ref{cls},           \
+                                    " is not a function");                   \
+      }                                                                      \
+      lambda *new_func = new_func_ref.as<lambda>();                          \
+      if (new_func->code_type == lambda::bytecode_type) {                    \
+        /* run new as a normal frame on this fiber, with the instance as     \
+           its first argument. The frame returns the instance instead of     \
+           whatever new returns */                                           \
+        auto call = new_func->prime(argc + 1, stack + new_fp);               \
+        call.self = new_self;                                                \
+        sp = new_fp;                                                         \
+        STORE_CTX();                                                         \
+        add_call_frame(call)->constructing = inst;                           \
+        LOAD_CTX();                                                          \
+        REDUCE();                                                            \
+        DISPATCH;                                                            \
+      }                                                                      \
+      /* call the new function on the object */                              \
+      call_method(new_func, new_self, argc + 1, stack + new_fp, &ctx);       \
+      sp = new_fp + 1;                                                       \
+      PREDICT(OP_RETURN);                                                    \
+      PREDICT(OP_SET_GLOBAL);                                                \
+      DISPATCH;                                                              \
+    }                                                                        \
+    ref v = self_callv(stack[new_fp], "apply", argc + 1, stack + abp - 1);   \
+    stack[new_fp] = v;                                                       \
+    sp = new_fp + 1;                                                         \
+    DISPATCH;                                                                \
+  }
+
+#define OP_BODY_CALL           \
+  {                            \
+    i64 argc = OPERAND().i;    \
+    CALL_BODY((ref *)nullptr); \
+  }
+
+
+// a bytecode callee in tail position replaces the current frame, so loops
+// written as tail recursion run in constant space. Everything else goes
+// through the normal call path, and the tail of the function (at most a
+// POP_SCOPE and a JUMP to the RETURN) unwinds the frame after it
+#define OP_BODY_TAIL_CALL                                                    \
+  {                                                                          \
+    /* only peek at argc, the normal call path reads it again */          \
+    i64 argc = ip->i;                                                        \
+    i64 new_fp = sp - argc - 1;                                              \
+    if (stack[new_fp].isa(lambda_type)) {                                    \
+      auto *callee = stack[new_fp].reinterpret<cedar::lambda *>();          \
+      /* natively compiled callees return right away, so they just take    \
+         the normal call path */                                             \
+      if (callee != nullptr &&                                               \
+          callee->code_type == lambda::bytecode_type &&                      \
+          !jit::can_enter(callee->code)) {                                   \
+        top_frame->call = callee->prime(argc, stack + sp - argc);            \
+        bind_frame(top_frame);                                               \
+        sp = top_frame->sp;                                                  \
+        ip = THREADED(top_frame->call.func->code);                           \
+        REDUCE();                                                            \
+        DISPATCH;                                                            \
+      }                                                                      \
+    }                                                                        \
+    OP_BODY_CALL;                                                            \
   }
 
 
+#define SUPER_PART(name) OP_BODY_##name
+#define SUPER_TARGET(name, code, size, effect, parts) \
+  TARGET(code) {                                      \
+    parts;                                            \
+    DISPATCH;                                         \
+  }
 
 
-  // grab the next opcode and increment the instruction pointer
-  op = *ip;
-  ip++;
-  ran++;
 
-  // printf("%02x %p\n", op, top_frame);
+loop:
 
-  goto *threaded_labels[op];
+#ifdef CEDAR_DEBUG
+  // make sure the stack depth finalize computed is never exceeded
+  if (sp - top_frame->bp - PROG()->code->slot_count >
+          PROG()->code->stack_size ||
+      sp > stack_size) {
+    throw cedar::make_exception(
+        "stack depth ", sp - top_frame->bp - PROG()->code->slot_count,
+        " exceeds the computed maximum of ", PROG()->code->stack_size, " in ",
+        ref(PROG()));
+  }
+#endif
+
+  // jump straight to the handler the threaded code names
+  goto *(ip++)->label;
 
   switch (op) {
     TARGET(OP_UNKNOWN) {
-      PRELUDE;
-      fprintf(stderr, "Unhandled instruction 0x%02x in lambda ", op);
+      fprintf(stderr, "Unhandled instruction in lambda ");
       std::cout << PROG()->defining << std::endl;
       exit(-1);
       DISPATCH;
@@ -361,130 +976,108 @@ loop:
     TARGET(OP_NOP) { DISPATCH; }
 
     TARGET(OP_NIL) {
-      PRELUDE;
       PUSH(nullptr);
       DISPATCH;
     }
 
     TARGET(OP_CONST) {
-      PRELUDE;
-      const auto ind = CODE_READ(u64);
-      CODE_SKIP(u64);
-      ref val = CONSTANT(ind);
+      ref val = *OPERAND().cref;
       PUSH(val);
       DISPATCH;
     }
 
     TARGET(OP_FLOAT) {
-      PRELUDE;
-      const auto flt = CODE_READ(double);
+      const auto flt = OPERAND().f;
       PUSH(flt);
-      CODE_SKIP(double);
       DISPATCH;
     }
 
     TARGET(OP_INT) {
-      PRELUDE;
-      const auto integer = CODE_READ(i64);
+      const auto integer = OPERAND().i;
+      PUSH(ref{(i64)integer});
+      DISPATCH;
+    }
+
+    TARGET(OP_INT_8) {
+      const auto integer = OPERAND().i;
       PUSH(ref{(i64)integer});
-      CODE_SKIP(i64);
       DISPATCH;
     }
 
 
     TARGET(OP_INT_NEG_1) {
-      PRELUDE;
       PUSH(ref{(i64)-1});
       DISPATCH;
     }
 
     TARGET(OP_INT_0) {
-      PRELUDE;
       PUSH(ref{(i64)0});
       DISPATCH;
     }
     TARGET(OP_INT_1) {
-      PRELUDE;
       PUSH(ref{(i64)1});
       DISPATCH;
     }
     TARGET(OP_INT_2) {
-      PRELUDE;
       PUSH(ref{(i64)2});
       DISPATCH;
     }
     TARGET(OP_INT_3) {
-      PRELUDE;
       PUSH(ref{(i64)3});
       DISPATCH;
     }
     TARGET(OP_INT_4) {
-      PRELUDE;
       PUSH(ref{(i64)4});
       DISPATCH;
     }
     TARGET(OP_INT_5) {
-      PRELUDE;
       PUSH(ref{(i64)5});
       DISPATCH;
     }
 
 
     TARGET(OP_LOAD_LOCAL) {
-      PRELUDE;
-      auto ind = CODE_READ(u8);
-      CODE_SKIP(u8);
-      auto val = LOCALS()->at(ind);
-      PUSH(val);
-
+      OP_BODY_LOAD_LOCAL;
       DISPATCH;
     }
 
 
     TARGET(OP_SET_LOCAL) {
-      PRELUDE;
-      auto ind = CODE_READ(u8);
-      CODE_SKIP(u8);
-      LOCALS()->at(ind) = stack[sp - 1];
+      auto depth = OPERAND().i;
+      auto ind = OPERAND().i;
+      LOCALS()->at(depth, ind) = stack[sp - 1];
+      DISPATCH;
+    }
+
+
+    TARGET(OP_LOAD_SLOT) {
+      OP_BODY_LOAD_SLOT;
+      DISPATCH;
+    }
+
+
+    TARGET(OP_SET_SLOT) {
+      auto ind = OPERAND().i;
+      stack[top_frame->bp + ind] = stack[sp - 1];
+      DISPATCH;
+    }
+
+
+    TARGET(OP_CLEAR_SLOT) {
+      auto ind = OPERAND().i;
+      stack[top_frame->bp + ind] = nullptr;
       DISPATCH;
     }
 
 
     TARGET(OP_LOAD_GLOBAL) {
-      PRELUDE;
-      u64 ind = CODE_READ(u64);
-      CODE_SKIP(u64);
-      ref val = nullptr;
-      module *m = PROG()->mod;
-      if (m != nullptr) {
-        bool has = false;
-        ref v = m->find(ind, &has, m);
-        if (has) {
-          PUSH(v);
-          DISPATCH;
-        }
-      }
-      if (core_mod != nullptr) {
-        bool has = false;
-        ref v = core_mod->find(ind, &has, m);
-        if (has) {
-          PUSH(v);
-          DISPATCH;
-        }
-      }
-      symbol s;
-      s.id = ind;
-      ref c = &s;
-      val = get_global(c);
-      PUSH(val);
+      OP_BODY_LOAD_GLOBAL;
       DISPATCH;
     }
 
 
     TARGET(OP_SET_GLOBAL) {
-      PRELUDE;
-      auto ind = CODE_READ(i64);
-      CODE_SKIP(i64);
+      auto ind = OPERAND().u;
       ref val = POP();
 
       if (PROG()->mod != nullptr) {
@@ -498,9 +1091,7 @@ loop:
     }
 
     TARGET(OP_SET_PRIVATE) {
-      PRELUDE;
-      auto ind = CODE_READ(i64);
-      CODE_SKIP(i64);
+      auto ind = OPERAND().u;
       ref v = POP();
       PROG()->mod->set_private(ind, v);
       PUSH(v);
@@ -509,7 +1100,6 @@ loop:
 
 
     TARGET(OP_CONS) {
-      PRELUDE;
       auto lst = POP();
       auto val = POP();
       PUSH(new list(val, lst));
@@ -519,7 +1109,6 @@ loop:
 
 
     TARGET(OP_APPEND) {
-      PRELUDE;
       auto a = POP();
       auto b = POP();
       ref r = append(a, b);
@@ -531,89 +1120,15 @@ loop:
 
 
     TARGET(OP_CALL) {
-      PRELUDE;
-
-      i64 argc = CODE_READ(i64);
-      ref *argv = stack + sp - argc;
-      CODE_SKIP(i64);
-      i64 new_fp = sp - argc - 1;
-      int abp = sp - argc; /* argumement base pointer, represents the base
-                              of the argument list */
-      if (stack[new_fp].isa(lambda_type)) {
-        auto *new_program = stack[new_fp].reinterpret<cedar::lambda *>();
-        if (new_program == nullptr) {
-          throw cedar::make_exception(
-              "Function to be run in call returned nullptr");
-        }
-
-        if (new_program->code_type == lambda::bytecode_type) {
-          auto call = new_program->prime(argc, stack + abp);
-
-
-          sp = new_fp;
-          STORE_CTX();
-          add_call_frame(call);
-          LOAD_CTX();
+      OP_BODY_CALL;
+    }
 
-          PREDICT(OP_RETURN);
-          PREDICT(OP_SET_GLOBAL);
-          DISPATCH;
-        } else if (new_program->code_type == lambda::function_binding_type) {
-          call_context ctx;
-          ctx.coro = this;
-          ctx.mod = PROG()->mod;
-          function_callback c(PROG()->self, argc, argv, this, PROG()->mod);
-          new_program->call(c);
-          ref val = c.get_return();
-          sp = new_fp;
-          PUSH(val);
-          PREDICT(OP_RETURN);
-          PREDICT(OP_SET_GLOBAL);
-          DISPATCH;
-        }
-      } else if (stack[new_fp].is<type>()) {
-        /**
-         *
-         * create an instance of a type
-         *
-         */
-        static auto __alloc__id = symbol::intern("__alloc__");
-        static auto new_id = symbol::intern("new");
-        // if the function to be called was a type, we need to make an
-        // instance
-        type *cls = stack[new_fp].as<type>();
-        ref alloc_func_ref = cls->getattr_fast(__alloc__id);
-        call_context ctx;
-        ctx.coro = this;
-        ctx.mod = PROG()->mod;
-        // allocate the instance
-        ref inst =
-            call_function(alloc_func_ref.as<lambda>(), 0, stack + new_fp, &ctx);
-        stack[new_fp] = inst;
-        ref new_func_ref = inst->getattr_fast(new_id);
-        if (!new_func_ref.is<lambda>()) {
-          throw cedar::make_exception("`new` method for ", ref{cls},
-                                      " is not a function");
-        }
-        lambda *new_func = new_func_ref.as<lambda>();
-        // call the new function on the object
-        call_function(new_func, argc + 1, stack + new_fp, &ctx);
-        sp = new_fp + 1;
-        PREDICT(OP_RETURN);
-        PREDICT(OP_SET_GLOBAL);
-        DISPATCH;
-      }
-      ref v = self_callv(stack[new_fp], "apply", argc + 1, stack + abp - 1);
-      stack[new_fp] = v;
-      sp = new_fp + 1;
-      DISPATCH;
+    TARGET(OP_TAIL_CALL) {
+      OP_BODY_TAIL_CALL;
     }
 
     TARGET(OP_MAKE_FUNC) {
-      PRELUDE;
-      auto ind = CODE_READ(u64);
-      CODE_SKIP(u64);
-      ref function_template = PROG()->code->constants[ind];
+      ref function_template = *OPERAND().cref;
       auto *template_ptr = (lambda *)function_template.get();
       lambda *function = template_ptr->copy();
       // inherit closures from parent, a new
@@ -622,23 +1137,20 @@ loop:
       // when creating functions, inherit the module object
       function->mod = PROG()->mod;
       // inherit the self object as well
-      function->self = PROG()->self;
+      function->self = top_frame->call.self;
       PUSH(function);
       DISPATCH;
     }
 
 
     TARGET(OP_MAKE_SCOPE) {
-      PRELUDE;
-      auto size = POP().to_int();
-      auto ind = POP().to_int();
-      top_frame->call.locals = new closure(size, top_frame->call.locals, ind);
+      auto size = OPERAND().i;
+      top_frame->call.locals = new closure(size, top_frame->call.locals);
       DISPATCH;
     }
 
 
     TARGET(OP_POP_SCOPE) {
-      PRELUDE;
       top_frame->call.locals = top_frame->call.locals->m_parent;
       DISPATCH;
     }
@@ -647,8 +1159,9 @@ loop:
 
 
     TARGET(OP_RETURN) {
-      PRELUDE;
       ref val = POP();
+      // a type's new method returns the instance it was constructing
+      if (!top_frame->constructing.is_nil()) val = top_frame->constructing;
 
       pop_call_frame();
 
@@ -669,7 +1182,6 @@ loop:
 
 
     TARGET(OP_EXIT) {
-      PRELUDE;
       goto exit;
       DISPATCH;
     }
@@ -677,40 +1189,26 @@ loop:
 
 
     TARGET(OP_SKIP) {
-      PRELUDE;
       sp--;
       DISPATCH;
     }
 
 
     TARGET(OP_JUMP_IF_FALSE) {
-      PRELUDE;
-
-      static ref false_val = new symbol("false");
-      i64 offset = CODE_READ(i64);
-      CODE_SKIP(i64);
-      auto val = POP();
-      if (val.is_nil() || val == false_val) {
-        ip = PROG()->code->code + offset;
-      }
-      DISPATCH;
+      OP_BODY_JUMP_IF_FALSE;
     }
 
 
 
     TARGET(OP_JUMP) {
-      PRELUDE;
-      i64 offset = CODE_READ(i64);
-      ip = PROG()->code->code + offset;
+      ip = ip->target;
       DISPATCH;
     }
 
 
 
     TARGET(OP_RECUR) {
-      PRELUDE;
-      i64 argc = CODE_READ(i64);
-      CODE_SKIP(i64);
+      i64 argc = OPERAND().i;
       if (argc != PROG()->argc)
         throw cedar::make_exception(
             "recur call has invalid number of arguments. Given ", argc,
@@ -719,14 +1217,35 @@ loop:
       int abp = sp - argc; /* argumement base pointer, represents the base
                               of the argument list */
 
-      while (LOCALS()->func == nullptr) {
-        LOCALS() = LOCALS()->m_parent;
+      // a recur is a loop's back edge, and as good a sign of hot code as a
+      // call. Once the code is compiled, the rest of the loop runs natively
+      // and this frame returns whatever it comes back with
+      if (PROG()->code->heat()) jit::tier_up(PROG());
+
+      // drop any scopes the recur is nested in
+      LOCALS() = top_frame->entry_locals;
+
+      if (jit::can_enter(PROG()->code)) {
+        ref val;
+        if (jit::enter_at_recur(PROG(), top_frame->call.self, LOCALS(), argc,
+                                stack + abp, this, &val)) {
+          sp = abp;
+          PUSH(val);
+          goto DO_OP_RETURN;
+        }
+        // the loop needs the interpreter again (to call something that
+        // isn't compiled, or to park), and this frame picks up where the
+        // native code left it
+        LOAD_CTX();
+        REDUCE();
+        DISPATCH;
       }
 
-      PROG()->set_args_closure(LOCALS(), argc, stack + abp);
-      ip = PROG()->code->code;
+      PROG()->bind_args(LOCALS(), stack + top_frame->bp, argc, stack + abp);
+      ip = THREADED(PROG()->code);
 
-      sp = top_frame->caller->sp + 1;
+      sp = top_frame->bp + PROG()->code->slot_count;
+      REDUCE();
 
       DISPATCH;
     }
@@ -734,47 +1253,42 @@ loop:
 
 
     TARGET(OP_GET_ATTR) {
-      PRELUDE;
-      u64 id = CODE_READ(u64);
-      CODE_SKIP(u64);
+      auto *site = OPERAND().attr;
       auto val = POP();
-      // create a stack allocated symbol
-      symbol s;
-      // set it's id
-      s.id = id;
-
-      // actually getattr
-      auto attr = val.getattr(&s);
-      // push the value
-      PUSH(attr);
+      PUSH(vm::getattr_cached(site, val));
       DISPATCH;
     }
 
 
     TARGET(OP_SET_ATTR) {
-      PRELUDE;
-      i64 id = CODE_READ(i64);
-      CODE_SKIP(i64);
+      auto *site = OPERAND().attr;
       auto val = POP();
       auto obj = POP();
-      // create a stack allocated symbol
-      symbol s;
-      // set it's id
-      s.id = id;
-      // actually getattr
-      obj.setattr(&s, val);
+      vm::setattr_cached(site, obj, val);
       // push the value
       PUSH(val);
       DISPATCH;
     }
 
 
+    TARGET(OP_INVOKE) {
+      auto *site = OPERAND().attr;
+      i64 argc = OPERAND().i;
+      i64 new_fp = sp - argc - 1;
+      ref method_self;
+      site->receivers.record(stack[new_fp + 1]);
+      /* the receiver is the first argument, the slot below it gets the
+         method so the rest is just a call */
+      stack[new_fp] =
+          vm::lookup_method_cached(site, stack[new_fp + 1], method_self);
+      CALL_BODY(&method_self);
+    }
+
+
 
     TARGET(OP_DUP) {
-      PRELUDE;
-      i64 off = CODE_READ(i64);
+      i64 off = OPERAND().i;
       auto val = stack[sp - off];
-      CODE_SKIP(i64);
       PUSH(val);
       PREDICT(OP_SWAP);
       DISPATCH;
@@ -783,7 +1297,6 @@ loop:
 
 
     TARGET(OP_SWAP) {
-      PRELUDE;
       auto a = POP();
       auto b = POP();
       PUSH(a);
@@ -793,10 +1306,8 @@ loop:
 
 
     TARGET(OP_DEF_MACRO) {
-      PRELUDE;
       auto func = POP();
-      u64 id = CODE_READ(i64);
-      CODE_SKIP(i64);
+      u64 id = OPERAND().u;
       vm::set_macro(id, func);
 
 
@@ -832,7 +1343,6 @@ loop:
 
 
     TARGET(OP_EVAL) {
-      PRELUDE;
 
       ref expr = POP();
       vm::compiler c;
@@ -847,7 +1357,6 @@ loop:
 
 
     TARGET(OP_SLEEP) {
-      PRELUDE;
       ref dur_ref = POP();
       done = false;
       i64 interval = 0;
@@ -865,7 +1374,6 @@ loop:
     }
 
     TARGET(OP_GET_MODULE) {
-      PRELUDE;
       PUSH(PROG()->mod);
       DISPATCH;
     }
@@ -873,53 +1381,40 @@ loop:
 
 
     TARGET(OP_ADD) {
-      PRELUDE;
-      ref b = POP();
-      ref a = POP();
-      PUSH(a + b);
+      OP_BODY_ADD;
       DISPATCH;
     }
 
 
     TARGET(OP_SUB) {
-      PRELUDE;
-      ref b = POP();
-      ref a = POP();
-      PUSH(a - b);
+      OP_BODY_SUB;
       DISPATCH;
     }
 
 
     TARGET(OP_NEG) {
-      PRELUDE;
       ref a = POP();
       PUSH(a * -1);
       DISPATCH;
     }
 
     TARGET(OP_INC) {
-      PRELUDE;
-      ref a = POP();
-      PUSH(a + 1);
+      OP_BODY_INC;
       DISPATCH;
     }
     TARGET(OP_DEC) {
-      PRELUDE;
-      ref a = POP();
-      PUSH(a - 1);
+      OP_BODY_DEC;
       DISPATCH;
     }
 
 
     TARGET(OP_LOAD_SELF) {
-      PRELUDE;
-      PUSH(PROG()->self);
+      PUSH(top_frame->call.self);
       DISPATCH;
     }
 
 
     TARGET(OP_SEND) {
-      PRELUDE;
 
       ref item = POP();
       ref chanr = POP();
@@ -946,7 +1441,6 @@ loop:
     }
 
     TARGET(OP_RECV) {
-      PRELUDE;
 
       ref chanr = POP();
       auto *chan = ref_cast<channel>(chanr);
@@ -973,18 +1467,26 @@ loop:
 
 
     TARGET(OP_DICT_SET) {
-      PRELUDE;
 
       DISPATCH;
     }
 
 
 
+    TARGET(OP_IS_CORE) {
+      OP_BODY_IS_CORE;
+      DISPATCH;
+    }
+
+
+
     TARGET(OP_GET_CURRENT_FUNC) {
-      PRELUDE;
       PUSH(PROG());
       DISPATCH;
     }
+
+
+    CEDAR_FOREACH_SUPERINSTRUCTION(SUPER_TARGET, SUPER_PART);
   }
 
   goto loop;
@@ -1008,7 +1510,8 @@ void fiber::print_callstack(void) {
   static auto name_id = symbol::intern("*name*");
   printf("Fiber #%d\n", jid);
   int i = 0;
-  for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+  for (int f = frame_count - 1; f >= 0; f--) {
+    frame *it = &frames[f];
     if (i == 0) {
       printf("* ");
     } else {
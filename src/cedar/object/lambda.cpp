@@ -37,26 +37,36 @@ using namespace cedar;
 
 /////////////////////////////////////////////////////
 
-closure::closure(i32 size, closure *parent, i32 index)
-    : m_size(size), m_index(index) {
+closure::closure(i32 size, closure *parent) : m_size(size) {
   m_parent = parent;
   m_vars = std::vector<ref>(size);
+  if (parent != nullptr) {
+    m_depth = parent->m_depth + 1;
+    m_outer = parent->display();
+  }
+}
+
+ref **closure::display(void) {
+  ref **d = m_display.load(std::memory_order_acquire);
+  if (d != nullptr) return d;
+  // the parent's display with this closure on the end
+  d = new ref *[m_depth + 1];
+  for (i32 i = 0; i < m_depth; i++) d[i] = m_outer[i];
+  d[m_depth] = m_vars.data();
+  // whoever loses the race uses the winner's, and theirs is collected
+  ref **built = nullptr;
+  if (!m_display.compare_exchange_strong(built, d, std::memory_order_acq_rel))
+    return built;
+  return d;
 }
 
 cedar::closure::~closure(void) {}
 
 closure *closure::clone(void) {
-  auto c = new closure(m_size, m_parent, m_index);
+  auto c = new closure(m_size, m_parent);
   return c;
 }
 
-ref &cedar::closure::at(int i) {
-  if (i >= m_index) {
-    return m_vars[i - m_index];
-  }
-  return m_parent->at(i);
-}
-
 /////////////////////////////////////////////////////
 
 cedar::lambda::lambda() {
@@ -90,10 +100,21 @@ cedar::lambda::lambda(native_callback func) {
   function_binding = func;
 }
 
+cedar::lambda::lambda(raw_function func) {
+  m_type = cedar::lambda_type;
+  code_type = raw_function_type;
+  raw_binding = func;
+}
+
 cedar::lambda::~lambda() {}
 
 
 void lambda::call(const function_callback & args) {
+  if (code_type == raw_function_type) {
+    raw_binding(args.len(), args.argv(), args.self(), args.get_fiber(),
+                &args.get_return());
+    return;
+  }
   function_binding(args);
 }
 
@@ -107,8 +128,10 @@ u64 lambda::hash(void) {
     }
     return hash;
   }
-  return reinterpret_cast<u64>(code_type == bytecode_type ? (void *)code
-                                                          : &function_binding);
+  if (code_type == raw_function_type) {
+    return reinterpret_cast<u64>(raw_binding);
+  }
+  return reinterpret_cast<u64>(&function_binding);
 }
 
 lambda *lambda::copy(void) {
@@ -121,15 +144,16 @@ lambda *lambda::copy(void) {
   COPY_FIELD(code_type);
   COPY_FIELD(code);
   COPY_FIELD(m_closure);
-  COPY_FIELD(arg_index);
   COPY_FIELD(argc);
   COPY_FIELD(vararg);
   COPY_FIELD(function_binding);
   return new_lambda;
 }
 
-void lambda::set_args_closure(closure *c, int a_argc, ref *a_argv) {
-  // code->record_call(a_argc, a_argv);
+void lambda::bind_args(closure *c, ref *slots, int a_argc, ref *a_argv) {
+  // for each argument, where it lives in the closure. Empty when none of
+  // them are captured, and they all sit in the frame's slots
+  auto &captured = code->arg_closure_index;
   if (a_argc != 0 && a_argv != nullptr) {
     // here we need to setup some variables which will be derived
     // from the argument state passed in.
@@ -159,19 +183,35 @@ void lambda::set_args_closure(closure *c, int a_argc, ref *a_argv) {
       }
     }
 
+    // build the vararg list first, the slots may be written over the
+    // arguments they're copied from
+    ref valist = nullptr;
+    bool va_captured = vararg && !captured.empty() && captured[argc - 1] >= 0;
+    if (vararg && (va_captured ? c != nullptr : slots != nullptr)) {
+      for (int i = a_argc - 1; i >= argc - 1; i--) {
+        valist = new_obj<list>(a_argv[i], valist);
+      }
+    }
 
     // loop over the concrete list...
     for (int i = 0; i < concrete; i++) {
-      c->at(i + arg_index) = a_argv[i];
+      if (!captured.empty() && captured[i] >= 0) {
+        if (c != nullptr) c->at(captured[i]) = a_argv[i];
+      } else if (slots != nullptr) {
+        slots[i] = a_argv[i];
+      }
     }
 
     if (vararg) {
-      ref valist = nullptr;
-      for (int i = a_argc - 1; i >= argc - 1; i--) {
-        valist = new_obj<list>(a_argv[i], valist);
+      if (va_captured) {
+        if (c != nullptr) c->at(captured[argc - 1]) = valist;
+      } else if (slots != nullptr) {
+        slots[argc - 1] = valist;
       }
-      c->at(arg_index + argc - 1) = valist;
     }
+  } else if (slots != nullptr) {
+    // no arguments, so they start out unbound just like in a closure
+    for (int i = 0; i < argc; i++) slots[i] = nullptr;
   }
 }
 
@@ -179,9 +219,20 @@ void lambda::set_args_closure(closure *c, int a_argc, ref *a_argv) {
 call_state lambda::prime(int a_argc, ref *a_argv) {
   call_state p;
   p.func = this;
-  p.locals = new closure(argc, m_closure, arg_index);
-  p.locals->func = this;
-  set_args_closure(p.locals, a_argc, a_argv);
+  p.self = self;
+  code->record_args(a_argc, a_argv);
+  // the arguments that don't escape are copied into the frame's slots when
+  // it is pushed, so only a function with captured arguments needs a new
+  // closure for the call
+  if (code->closure_size == 0) {
+    p.locals = m_closure;
+  } else {
+    p.locals = new closure(code->closure_size, m_closure);
+    p.locals->func = this;
+    bind_args(p.locals, nullptr, a_argc, a_argv);
+  }
+  p.argc = a_argc;
+  p.argv = a_argv;
   return p;
 }
 
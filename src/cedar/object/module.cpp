@@ -62,19 +62,49 @@ void module::def(std::string name, native_callback val) {
   setattr_fast(id, func);
 }
 
+void module::def(std::string name, raw_function val) {
+  u64 id = symbol::intern(name);
+  lambda *func = new lambda(val);
+  func->name = new symbol(name);
+  setattr_fast(id, func);
+}
+
 
 void module::import_into(module *other) {
   for (auto &kv : m_fields) {
-    if (kv.second.type == PUBLIC) other->m_fields[kv.first] = kv.second;
+    // the other module gets its own cell, so reassigning the binding in one
+    // of them doesn't change the other
+    if (kv.second.type == PUBLIC)
+      other->m_fields[kv.first] = {PUBLIC, new ref(*kv.second.cell)};
   }
+  other->layout++;
+  invalidate_global_caches();
+}
+
+
+// write a binding into the field table. If this adds a new binding or
+// changes the visibility of an existing one, any cached global lookups are
+// invalidated. Plain reassignment writes through the binding's cell, so the
+// caches will just see the new value
+static void set_binding(module *m, intern_t k, module::binding_type t,
+                        ref v) {
+  auto &fields = m->m_fields;
+  auto it = fields.find(k);
+  if (it != fields.end() && it->second.type == t) {
+    *it->second.cell = v;
+    return;
+  }
+  module::binding b;
+  b.type = t;
+  b.cell = new ref(v);
+  fields[k] = b;
+  m->layout++;
+  invalidate_global_caches();
 }
 
 
 void module::set_private(intern_t i, ref v) {
-  binding b;
-  b.type = PRIVATE;
-  b.val = v;
-  m_fields[i] = b;
+  set_binding(this, i, PRIVATE, v);
 }
 
 
@@ -85,7 +115,7 @@ ref module::find(u64 id, bool *valid, module *from) {
     // if the binding is public, return it's val
     if ((b.type == PRIVATE && from == this) || b.type == PUBLIC) {
       if (valid != nullptr) *valid = true;
-      return b.val;
+      return *b.cell;
     }
   }
 
@@ -99,6 +129,22 @@ ref module::find(u64 id, bool *valid, module *from) {
 }
 
 
+ref *module::find_slot(u64 id, module *from) {
+  auto it = m_fields.find(id);
+  if (it != m_fields.end()) {
+    binding &b = it->second;
+    if ((b.type == PRIVATE && from == this) || b.type == PUBLIC) {
+      return b.cell;
+    }
+  }
+
+  if (this != core_mod && core_mod != nullptr) {
+    return core_mod->find_slot(id, from);
+  }
+  return nullptr;
+}
+
+
 static std::mutex write_lock;
 
 
@@ -139,7 +185,7 @@ static void store(module *m) {
       sy.id = i.first;
       try {
         s.write(ref(&sy));
-        s.write(i.second.val);
+        s.write(*i.second.cell);
       } catch (...) {
       }
     }
@@ -177,12 +223,6 @@ ref module::getattr_fast(u64 k) {
 
 
 void module::setattr_fast(u64 k, ref v) {
-  binding b;
-  b.type = PUBLIC;
-  b.val = v;
-  if (m_fields.count(k) != 0) {
-    // std::cout << "REASSIGN " << symbol::unintern(k) << std::endl;
-  }
-  m_fields[k] = b;
+  set_binding(this, k, PUBLIC, v);
 }
 
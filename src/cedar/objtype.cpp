@@ -68,9 +68,17 @@ ref type::get_field_fast(u64 i) {
   return val;
 }
 
+void type::invalidate(void) {
+  version++;
+  // instances of the children look in our fields too
+  for (type *c : m_children) c->version++;
+}
+
 void type::set_field(ref k, ref val) {
   if (auto *s = ref_cast<symbol>(k); s != nullptr) {
-    return m_fields.set(s->id, val);
+    m_fields.set(s->id, val);
+    invalidate();
+    return;
   }
   throw cedar::make_exception("unable to set field '", k, "' on class ", m_name,
                               " to ", val);
@@ -80,11 +88,13 @@ void type::set_field(cedar::runes k, bound_function val) {
   auto i = symbol::intern(k);
   ref lam = new lambda(val);
   m_fields.set(i, lam);
+  invalidate();
 }
 void type::set_field(cedar::runes k, native_callback val) {
   auto i = symbol::intern(k);
   ref lam = new lambda(val);
   m_fields.set(i, lam);
+  invalidate();
 }
 
 ////////////////////////////////////////////////////////////
@@ -210,7 +220,10 @@ static void init_type_type(void) {
                                       parent_ref);
         }
 
-        self->m_parents.push_back(parent_ref.as<type>());
+        type *parent = parent_ref.as<type>();
+        self->m_parents.push_back(parent);
+        parent->m_children.push_back(self);
+        self->invalidate();
         return nullptr;
       }));
 
@@ -697,10 +710,15 @@ static void init_lambda_type() {
 
     c += "{";
 
-    if (self->code_type == lambda::function_binding_type) {
+    if (self->is_native()) {
       c += ":native true, ";
       char pbuf[20];
-      sprintf(pbuf, ":addr %p,", (void *)&self->function_binding);
+      // raw natives are a plain function pointer, and their
+      // function_binding is empty
+      if (self->code_type == lambda::raw_function_type)
+        sprintf(pbuf, ":addr %p,", (void *)self->raw_binding);
+      else
+        sprintf(pbuf, ":addr %p,", (void *)&self->function_binding);
     }
 
 
@@ -24,13 +24,23 @@
 
 #include <cedar/passes.h>
 #include <cedar/ref.h>
+#include <cedar/globals.h>
+#include <cedar/objtype.h>
 #include <cedar/object/list.h>
+#include <cedar/object/module.h>
 #include <cedar/object/symbol.h>
 #include <cedar/object/nil.h>
+#include <cedar/object/vector.h>
 #include <cedar/vm/compiler.h>
+#include <cedar/vm/machine.h>
 
 
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <set>
 
 using namespace cedar;
 
@@ -47,8 +57,19 @@ ref passcontroller::get(void) {
 	return m_val;
 }
 
-passcontroller& passcontroller::pipe(pass_function f, const char *) {
+passcontroller& passcontroller::pipe(pass_function f, const char *name) {
+	static bool dump = getenv("CDRPASSDUMP") != nullptr;
+	if (!dump) {
+		m_val = f(m_val, m_compiler);
+		return *this;
+	}
+
+	auto start = std::chrono::steady_clock::now();
 	m_val = f(m_val, m_compiler);
+	auto end = std::chrono::steady_clock::now();
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+	std::cerr << ";; " << name << " (" << us.count() << "us)\n"
+		<< m_val << std::endl;
 	return *this;
 }
 
@@ -63,3 +84,453 @@ ref cedar::wrap_top_level_with_lambdas(ref val, vm::compiler *) {
 
 	return lambda;
 }
+
+
+
+ref cedar::optimize(ref val, vm::compiler *c) {
+	return passcontroller(val, c)
+		.pipe(expand_macros, "expand macros")
+		.pipe(inline_core_functions, "inline core functions")
+		.pipe(fold_constants, "fold constants")
+		.pipe(eliminate_dead_code, "eliminate dead code")
+		.get();
+}
+
+
+
+// the symbols bound as locals where a form is, which shadow the globals the
+// passes know about
+using bound_set = std::set<u64>;
+using rewriter = std::function<ref(ref, const bound_set &)>;
+
+
+static bool is_call_to(const char *name, ref form) {
+	if (!form.isa(list_type)) return false;
+	ref head = form.first();
+	return head.isa(symbol_type) && head.as<symbol>()->get_content() == name;
+}
+
+
+// is b exactly a, so a rewrite can leave the form it came from alone
+static bool same(ref a, ref b) {
+	if (a.is_number() || b.is_number()) {
+		return a.is_number() && b.is_number() && a.is_int() == b.is_int() &&
+			a == b;
+	}
+	return a.get() == b.get();
+}
+
+
+static ref list_from(std::vector<ref> &elems) {
+	ref l = nullptr;
+	for (auto it = elems.rbegin(); it != elems.rend(); it++) {
+		l = new_obj<list>(*it, l);
+	}
+	return l;
+}
+
+
+static void bind_all(ref names, bound_set &bound) {
+	if (names.isa(vector_type)) {
+		vector *v = names.as<vector>();
+		for (int i = 0; i < v->size(); i++) bind_all(v->at(i), bound);
+		return;
+	}
+	if (names.isa(symbol_type)) {
+		bound.insert(names.symbol_hash());
+		return;
+	}
+	if (names.isa(list_type)) {
+		for (ref it = names; !it.is_nil(); it = it.rest()) bind_all(it.first(), bound);
+	}
+}
+
+
+// rebuild a form bottom up, running fn on every expression in it. Only the
+// places where the compiler evaluates something are visited, so parameter
+// lists, quoted data and the like are left as they are. If `expand` is set,
+// macro calls are expanded before they're walked (through the compiler's
+// memo, so they expand the same way when it compiles them)
+static ref walk(ref form, bound_set &bound, const rewriter &fn,
+		vm::compiler *c, bool expand) {
+	if (!form.isa(list_type)) return fn(form, bound);
+
+	if (expand) {
+		while (form.isa(list_type) && form.first().isa(symbol_type) &&
+				vm::is_macro(form.first().as<symbol>()->id)) {
+			ref expanded = c->expand(form);
+			if (expanded == form) break;
+			form = expanded;
+		}
+		if (!form.isa(list_type)) return fn(form, bound);
+	}
+
+	std::vector<ref> elems;
+	for (ref it = form; !it.is_nil(); it = it.rest()) {
+		// leave improper lists alone
+		if (!it.isa(list_type)) return fn(form, bound);
+		elems.push_back(it.first());
+	}
+
+	bool changed = false;
+	auto visit = [&](ref &e, bound_set &b) {
+		ref n = walk(e, b, fn, c, expand);
+		if (!same(n, e)) {
+			e = n;
+			changed = true;
+		}
+	};
+
+	if (is_call_to("quote", form) || is_call_to("defmacro", form)) {
+		return form;
+	} else if (is_call_to("fn", form)) {
+		// (fn name? (params...) body...)
+		size_t body = 2;
+		if (elems.size() > 1 && elems[1].isa(symbol_type)) body = 3;
+		bound_set inner = bound;
+		if (body - 1 < elems.size()) bind_all(elems[body - 1], inner);
+		for (size_t i = body; i < elems.size(); i++) visit(elems[i], inner);
+	} else if (is_call_to("scope*", form)) {
+		bound_set inner = bound;
+		if (elems.size() > 1) bind_all(elems[1], inner);
+		for (size_t i = 2; i < elems.size(); i++) visit(elems[i], inner);
+	} else if (is_call_to("let*", form)) {
+		// ((name val)...) body... Every name is treated as bound everywhere in
+		// the form, which never makes a pass do something it shouldn't
+		bound_set inner = bound;
+		std::vector<ref> bindings;
+		if (elems.size() > 1) {
+			for (ref it = elems[1]; it.isa(list_type); it = it.rest()) {
+				bind_all(it.first().first(), inner);
+				bindings.push_back(it.first());
+			}
+			for (auto &b : bindings) {
+				if (!b.isa(list_type) || !b.rest().isa(list_type)) continue;
+				ref val = b.rest().first();
+				ref n = walk(val, inner, fn, c, expand);
+				if (!same(n, val)) {
+					b = newlist(b.first(), n);
+					changed = true;
+				}
+			}
+			if (changed) elems[1] = list_from(bindings);
+		}
+		for (size_t i = 2; i < elems.size(); i++) visit(elems[i], inner);
+	} else if (is_call_to("def*", form) || is_call_to("def-private*", form) ||
+			is_call_to("defmacro*", form)) {
+		for (size_t i = 2; i < elems.size(); i++) visit(elems[i], bound);
+	} else if (is_call_to(".", form)) {
+		// (. obj attr (method args...)...)
+		if (elems.size() > 1) visit(elems[1], bound);
+		for (size_t i = 2; i < elems.size(); i++) {
+			ref call = elems[i];
+			if (!call.isa(list_type)) continue;
+			std::vector<ref> parts;
+			bool call_changed = false;
+			for (ref it = call; it.isa(list_type); it = it.rest()) {
+				parts.push_back(it.first());
+			}
+			for (size_t j = 1; j < parts.size(); j++) {
+				ref n = walk(parts[j], bound, fn, c, expand);
+				if (!same(n, parts[j])) {
+					parts[j] = n;
+					call_changed = true;
+				}
+			}
+			if (call_changed) {
+				elems[i] = list_from(parts);
+				changed = true;
+			}
+		}
+	} else {
+		for (auto &e : elems) visit(e, bound);
+	}
+
+	if (changed) form = list_from(elems);
+	return fn(form, bound);
+}
+
+
+static ref run_pass(ref form, vm::compiler *c, const rewriter &fn,
+		bool expand = false) {
+	bound_set bound;
+	return walk(form, bound, fn, c, expand);
+}
+
+
+
+// the functions in core_originals, by index
+static const char *core_inlined[] = {
+	"inc", "dec", "not", "identity", "second",
+	"*", "/", "<", "<=", ">", ">=", "=",
+	// what (second x) is inlined into
+	"first", "rest",
+};
+static_assert(sizeof(core_inlined) / sizeof(core_inlined[0]) <= CORE_INLINED_MAX,
+		"core_originals is too small");
+
+ref cedar::core_originals[CORE_INLINED_MAX];
+
+
+// what a global name refers to from a module, looked up the same way
+// OP_LOAD_GLOBAL does it. Nil if it isn't bound
+static ref resolve_global(u64 id, module *mod) {
+	bool found = false;
+	ref val;
+	if (mod != nullptr) val = mod->find(id, &found, mod);
+	if (!found && core_mod != nullptr) val = core_mod->find(id, &found, mod);
+	if (!found && is_global(id)) return get_global(id);
+	return found ? val : nullptr;
+}
+
+
+void cedar::record_core_originals(void) {
+	int k = 0;
+	for (const char *name : core_inlined)
+		core_originals[k++] = resolve_global(symbol::intern(name), core_mod);
+}
+
+
+// a global name the passes know the meaning of. It must not be shadowed by
+// a local, and has to refer to the core function right now. The index of
+// the function in core_originals if so, -1 if not
+static int core_name(ref sym, const bound_set &bound, vm::compiler *c) {
+	if (!sym.isa(symbol_type)) return -1;
+	u64 id = sym.symbol_hash();
+	if (bound.count(id) != 0) return -1;
+	const std::string &name = sym.as<symbol>()->get_content();
+	int count = sizeof(core_inlined) / sizeof(core_inlined[0]);
+	for (int k = 0; k < count; k++) {
+		if (name != core_inlined[k]) continue;
+		return is_core_original(k, resolve_global(id, c->mod)) ? k : -1;
+	}
+	return -1;
+}
+
+
+// a call to one of those functions, by name and, if argc isn't -1, with
+// that many arguments
+static int is_core_call(ref form, const bound_set &bound, vm::compiler *c,
+		const char *name, int argc = -1) {
+	if (!is_call_to(name, form)) return -1;
+	if (argc >= 0) {
+		int n = 0;
+		for (ref it = form.rest(); !it.is_nil(); it = it.rest()) n++;
+		if (n != argc) return -1;
+	}
+	return core_name(form.first(), bound, c);
+}
+
+
+// the form to use instead of a call to core function k: the replacement as
+// long as the name is still bound to it, and the call when it isn't. The
+// core functions the replacement calls itself, by name and index in also,
+// are checked too
+static ref guarded(int k, ref call, ref replacement,
+		std::vector<std::pair<ref, int>> also = {}) {
+	static ref if_sym = new symbol("if");
+	static ref is_core = new symbol("is-core*");
+	also.insert(also.begin(), {call.first(), k});
+	// (if a (if b c)) is a and b and c, without the and macro
+	ref test = nullptr;
+	for (auto it = also.rbegin(); it != also.rend(); it++) {
+		ref check = newlist(is_core, it->second, it->first);
+		test = test.is_nil() ? check : newlist(if_sym, check, test);
+	}
+	return newlist(if_sym, test, replacement, call);
+}
+
+
+// does a form have a guarded call in it. An inlined call has its argument
+// in it twice, so inlining a call around one would double the form at
+// every level of nesting
+static bool has_guard(ref form) {
+	if (!form.isa(list_type)) return false;
+	if (is_call_to("is-core*", form)) return true;
+	for (ref it = form; it.isa(list_type); it = it.rest())
+		if (has_guard(it.first())) return true;
+	return false;
+}
+
+
+static bool refers_to_global(ref sym, const bound_set &bound, vm::compiler *c) {
+	u64 id = sym.symbol_hash();
+	if (bound.count(id) != 0) return false;
+	module *mod = c->mod;
+	return mod == nullptr || mod == core_mod || mod->m_fields.count(id) == 0;
+}
+
+
+// is a form an expression the compiler evaluates to itself
+static bool is_literal(ref form) {
+	if (form.is_nil() || form.is_number()) return true;
+	if (form.isa(string_type) || form.isa(keyword_type)) return true;
+	return is_call_to("quote", form);
+}
+
+
+static ref quoted(ref val) {
+	static ref quote = new symbol("quote");
+	return newlist(quote, val);
+}
+
+
+
+
+ref cedar::expand_macros(ref form, vm::compiler *c) {
+	return run_pass(form, c, [](ref f, const bound_set &) { return f; }, true);
+}
+
+
+
+ref cedar::inline_core_functions(ref form, vm::compiler *c) {
+	static ref plus = new symbol("+");
+	static ref minus = new symbol("-");
+	static ref if_sym = new symbol("if");
+	static ref first = new symbol("first");
+	static ref rest = new symbol("rest");
+	static ref true_sym = new symbol("true");
+
+	return run_pass(form, c, [c](ref f, const bound_set &bound) -> ref {
+		if (!f.isa(list_type)) return f;
+		ref arg = f.rest().first();
+		if (has_guard(arg)) return f;
+		int k, kf, kr;
+		// (inc x) => (+ x 1)
+		if ((k = is_core_call(f, bound, c, "inc", 1)) >= 0)
+			return guarded(k, f, newlist(plus, arg, 1));
+		// (dec x) => (- x 1)
+		if ((k = is_core_call(f, bound, c, "dec", 1)) >= 0)
+			return guarded(k, f, newlist(minus, arg, 1));
+		// (not x) => (if x nil 'true)
+		if ((k = is_core_call(f, bound, c, "not", 1)) >= 0)
+			return guarded(k, f, newlist(if_sym, arg, nullptr, quoted(true_sym)));
+		// (identity x) => x
+		if ((k = is_core_call(f, bound, c, "identity", 1)) >= 0)
+			return guarded(k, f, arg);
+		// (second x) => (first (rest x))
+		if ((k = is_core_call(f, bound, c, "second", 1)) >= 0 &&
+				(kf = core_name(first, bound, c)) >= 0 &&
+				(kr = core_name(rest, bound, c)) >= 0)
+			return guarded(k, f, newlist(first, newlist(rest, arg)),
+					{{first, kf}, {rest, kr}});
+		return f;
+	});
+}
+
+
+
+ref cedar::fold_constants(ref form, vm::compiler *c) {
+	static ref true_sym = new symbol("true");
+	static ref false_sym = new symbol("false");
+
+	return run_pass(form, c, [c](ref f, const bound_set &bound) -> ref {
+		if (!f.isa(list_type)) return f;
+		std::vector<ref> args;
+		for (ref it = f.rest(); !it.is_nil(); it = it.rest()) {
+			if (!it.isa(list_type) || !it.first().is_number()) return f;
+			args.push_back(it.first());
+		}
+		if (args.size() == 0) return f;
+
+		// the folded value is computed with the same operators the runtime
+		// uses. If one throws (dividing by zero) the call is left for the
+		// runtime to throw. + and - are special forms, so they can't be
+		// rebound, but everything else is guarded like an inlined call
+		int k;
+		try {
+			if (is_call_to("+", f)) {
+				ref acc = args[0];
+				for (size_t i = 1; i < args.size(); i++) acc = acc + args[i];
+				return acc;
+			}
+			if ((k = is_core_call(f, bound, c, "*")) >= 0) {
+				ref acc = args[0];
+				for (size_t i = 1; i < args.size(); i++) acc = acc * args[i];
+				return guarded(k, f, acc);
+			}
+			if (is_call_to("-", f)) {
+				// (- x) compiles to a multiply by -1
+				if (args.size() == 1) return args[0] * ref(-1);
+				ref acc = args[0];
+				for (size_t i = 1; i < args.size(); i++) acc = acc - args[i];
+				return acc;
+			}
+			if ((k = is_core_call(f, bound, c, "/")) >= 0 && args.size() > 1) {
+				ref acc = args[0];
+				for (size_t i = 1; i < args.size(); i++) {
+					if (args[i].is_int() && args[i].to_int() == 0) return f;
+					if (args[i].is_flt() && args[i].to_float() == 0.0) return f;
+					acc = acc / args[i];
+				}
+				return guarded(k, f, acc);
+			}
+			auto truth = [](bool b) -> ref { return b ? quoted(true_sym) : nullptr; };
+			if (args.size() == 2) {
+				ref a = args[0], b = args[1];
+				if ((k = is_core_call(f, bound, c, "<")) >= 0) return guarded(k, f, truth(a < b));
+				if ((k = is_core_call(f, bound, c, "<=")) >= 0) return guarded(k, f, truth(a <= b));
+				if ((k = is_core_call(f, bound, c, ">")) >= 0) return guarded(k, f, truth(a > b));
+				if ((k = is_core_call(f, bound, c, ">=")) >= 0) return guarded(k, f, truth(a >= b));
+			}
+			if (args.size() >= 2 && (k = is_core_call(f, bound, c, "=")) >= 0) {
+				for (size_t i = 1; i < args.size(); i++)
+					if (args[i] != args[0]) return guarded(k, f, quoted(false_sym));
+				return guarded(k, f, quoted(true_sym));
+			}
+		} catch (...) {
+			return f;
+		}
+		return f;
+	});
+}
+
+
+
+ref cedar::eliminate_dead_code(ref form, vm::compiler *c) {
+	return run_pass(form, c, [c](ref f, const bound_set &bound) -> ref {
+		if (!f.isa(list_type)) return f;
+
+		if (is_call_to("if", f)) {
+			ref test = f.rest().first();
+			ref tru = f.rest().rest().first();
+			ref fls = f.rest().rest().rest().first();
+			// what the test is when it's a constant, or null if it isn't
+			ref val;
+			bool known = false;
+			if (is_literal(test)) {
+				val = is_call_to("quote", test) ? test.rest().first() : test;
+				known = true;
+			} else if (test.isa(symbol_type) && refers_to_global(test, bound, c)) {
+				auto name = test.as<symbol>()->get_content();
+				if (name == "true" || name == "false") {
+					val = test;
+					known = true;
+				}
+			}
+			if (!known) return f;
+			bool falsy = val.is_nil() ||
+				(val.isa(symbol_type) && val.as<symbol>()->get_content() == "false");
+			return falsy ? fls : tru;
+		}
+
+		if (is_call_to("do", f)) {
+			std::vector<ref> kept;
+			kept.push_back(f.first());
+			size_t count = 1;
+			for (ref it = f.rest(); !it.is_nil(); it = it.rest()) {
+				ref e = it.first();
+				bool last = it.rest().is_nil();
+				count++;
+				// values that are thrown away only matter for their side effects
+				bool pure = is_literal(e) || is_call_to("fn", e) ||
+					(e.isa(symbol_type) && bound.count(e.symbol_hash()) != 0);
+				if (last || !pure) kept.push_back(e);
+			}
+			if (kept.size() == 2) return kept[1];
+			if (kept.size() == count) return f;
+			return list_from(kept);
+		}
+		return f;
+	});
+}
@@ -29,6 +29,7 @@
 #include <cedar/object/fiber.h>
 #include <cedar/object/lambda.h>
 #include <cedar/objtype.h>
+#include <cedar/passes.h>
 #include <cedar/scheduler.h>
 #include <cedar/thread.h>
 #include <cedar/types.h>
@@ -68,6 +69,14 @@ static std::atomic<i64> jobc;
  */
 static unsigned ncpus = 8;
 
+/**
+ * the length of a time slice in milliseconds, configured by $CDRTIMESLICE.
+ * Every slice the timer thread asks each worker's fiber to yield, and
+ * bumps the coarse clock.
+ */
+static int sched_time = 2;
+static std::atomic<u64> coarse_now;
+
 
 
 /**
@@ -109,6 +118,14 @@ static worker_thread *lookup_or_create_worker() {
 
 fiber *cedar::current_fiber() { return _current_fiber; }
 
+u64 cedar::coarse_time_ms(void) { return coarse_now.load(); }
+
+static u64 clock_ms(void) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
 
 void cedar::add_job(fiber *f) {
   std::lock_guard guard(worker_thread_mutex);
@@ -150,28 +167,33 @@ static std::thread spawn_worker_thread(void) {
 
 
 /**
- * schedule a single job on the caller thread, it's up to the caller to manage
- * where the job goes after the job yields
+ * the timer thread is what makes preemption cheap. Instead of fibers reading
+ * the clock, it wakes up once a time slice and raises every worker's
+ * yield_requested flag, which the running fiber checks every so often.
  */
-void schedule_job(fiber *proc) {
-  static int sched_time = 2;
-  static bool read_env = false;
+static std::thread spawn_timer_thread(void) {
+  return std::thread([](void) -> void {
+    register_thread();
+    while (true) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(sched_time));
+      coarse_now.store(clock_ms());
+      std::lock_guard guard(worker_thread_mutex);
+      for (auto *w : worker_threads) w->yield_requested.store(true);
+    }
+  });
+}
+
 
 
-  if (!read_env) {
-    static const char *SCHED_TIME_ENV = getenv("CDRTIMESLICE");
-    if (SCHED_TIME_ENV != nullptr) sched_time = atol(SCHED_TIME_ENV);
-    if (sched_time < 2) {
-      throw cedar::make_exception("$CDRTIMESLICE must be larger than 2ms");
-    }
-  }
-  read_env = true;
 
+/**
+ * schedule a single job on the caller thread, it's up to the caller to manage
+ * where the job goes after the job yields
+ */
+void schedule_job(fiber *proc) {
   if (proc == nullptr) return;
 
-  u64 time = std::chrono::duration_cast<std::chrono::milliseconds>(
-                 std::chrono::system_clock::now().time_since_epoch())
-                 .count();
+  u64 time = coarse_time_ms();
   int state = proc->state.load();
 
   if (state == SLEEPING) {
@@ -188,6 +210,8 @@ void schedule_job(fiber *proc) {
 
   fiber *old_fiber = _current_fiber;
   _current_fiber = proc;
+  // give the job the rest of this slice
+  if (proc->worker != nullptr) proc->worker->yield_requested.store(false);
   proc->resume();
   _current_fiber = old_fiber;
 
@@ -228,6 +252,14 @@ static void init_scheduler(void) {
 
   if (ncpus < 1) ncpus = 1;
 
+  static const char *SCHED_TIME_ENV = getenv("CDRTIMESLICE");
+  if (SCHED_TIME_ENV != nullptr) sched_time = atol(SCHED_TIME_ENV);
+  if (sched_time < 2) {
+    throw cedar::make_exception("$CDRTIMESLICE must be larger than 2ms");
+  }
+  coarse_now.store(clock_ms());
+  spawn_timer_thread().detach();
+
   // spawn 'ncpus' worker threads
   for (unsigned i = 0; i < ncpus; i++) {
     auto t = spawn_worker_thread();
@@ -350,6 +382,9 @@ void cedar::init(void) {
   init_binding(nullptr);
   bind_stdlib();
   core_mod = require("core");
+  // global lookups made while loading core couldn't see core_mod yet
+  invalidate_global_caches();
+  record_core_originals();
 }
 
 
@@ -362,8 +397,10 @@ void cedar::init(void) {
  * when someone tries to get a mutex lock or something from within
  * such a call
  */
-ref cedar::eval_lambda(call_state call) {
-  fiber *f = new fiber(call);
+ref cedar::eval_lambda(call_state call) { return eval_fiber(new fiber(call)); }
+
+
+ref cedar::eval_fiber(fiber *f) {
   worker_thread *my_worker = lookup_or_create_worker();
   add_job(f);
 
@@ -386,13 +423,26 @@ ref cedar::eval_lambda(call_state call) {
 
 
 ref cedar::call_function(lambda *fn, int argc, ref *argv, call_context *ctx) {
-  // printf("%p\n", fn);
-  if (fn->code_type == lambda::function_binding_type) {
-    function_callback c(fn->self, argc, argv, ctx->coro, ctx->mod);
+  return call_method(fn, fn->self, argc, argv, ctx);
+}
+
+
+
+ref cedar::call_method(lambda *fn, ref self, int argc, ref *argv,
+                       call_context *ctx) {
+  if (fn->is_native()) {
+    function_callback c(self, argc, argv, ctx->coro, ctx->mod);
     fn->call(c);
     return c.get_return();
   }
-  return eval_lambda(fn->prime(argc, argv));
+  // compiled code doesn't need a fiber to run on
+  if (fn->code->heat()) jit::tier_up(fn);
+  if (jit::can_enter(fn->code))
+    return jit::call_native(fn, self, argc, argv,
+                            ctx != nullptr ? ctx->coro : nullptr);
+  auto call = fn->prime(argc, argv);
+  call.self = self;
+  return eval_lambda(call);
 }
 
 
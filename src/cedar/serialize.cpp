@@ -33,6 +33,9 @@
 #include <cedar/object/keyword.h>
 #include <cedar/object/string.h>
 
+#include <climits>
+#include <stdexcept>
+
 
 
 using namespace cedar;
@@ -146,8 +149,6 @@ void serializer::write(ref obj) {
       // write the defining structure
       write(l->defining);
 
-      // write the arg index
-      fwrite(&l->arg_index, sizeof(l->arg_index), 1, fp);
       // write the argc
       fwrite(&l->argc, sizeof(l->argc), 1, fp);
       // write the vararg status
@@ -168,6 +169,17 @@ void serializer::write(ref obj) {
       fwrite(&size, sizeof(code->get_size()), 1, fp);
       // the stack size of the bytecode
       fwrite(&code->stack_size, sizeof(code->stack_size), 1, fp);
+      // where the locals live, in the frame's slots or in the closure
+      fwrite(&code->slot_count, sizeof(code->slot_count), 1, fp);
+      fwrite(&code->closure_size, sizeof(code->closure_size), 1, fp);
+      i16 captured_count = code->arg_closure_index.size();
+      fwrite(&captured_count, sizeof(captured_count), 1, fp);
+      fwrite(code->arg_closure_index.data(), sizeof(i16), captured_count, fp);
+      // the symbol tables the instruction stream indexes into. They are
+      // written by name since symbol ids are only stable in one process
+      write_symbol_table(code->global_names);
+      write_symbol_table(code->names);
+      write_symbol_table(code->attr_names);
       // and print the actual instruction stream
       fwrite(code->code, size, 1, fp);
 
@@ -197,21 +209,63 @@ void serializer::write(ref obj) {
 
 
 
-#define READ_INTO(v) fread(&(v), sizeof((v)), 1, fp)
+#define READ_INTO(v) read_bytes(&(v), sizeof((v)))
+
+void serializer::read_bytes(void *dst, size_t n) {
+  if (n != 0 && fread(dst, n, 1, fp) != 1)
+    throw std::runtime_error("serialized data ends early");
+}
 
-static std::string read_string(FILE *fp, int len) {
-  std::string s;
 
-  for (int i = 0; i < len; i++) {
-    char c;
-    READ_INTO(c);
-    s += c;
+// read a length of things each bytes big, which has to fit in what's left
+size_t serializer::read_length(size_t each) {
+  int len;
+  READ_INTO(len);
+  if (end == -1) {
+    long at = ftell(fp);
+    if (at == -1 || fseek(fp, 0, SEEK_END) != 0) end = LONG_MAX;
+    else {
+      end = ftell(fp);
+      fseek(fp, at, SEEK_SET);
+    }
   }
+  if (len < 0 || (size_t)len > (size_t)(end - ftell(fp)) / each)
+    throw std::runtime_error("serialized length is longer than the data");
+  return len;
+}
+
 
+std::string serializer::read_string(void) {
+  std::string s(read_length(1), '\0');
+  read_bytes(&s[0], s.size());
   return s;
 }
 
 
+// symbol tables are a count followed by each symbol's length and name
+void serializer::write_symbol_table(std::vector<u64> &ids) {
+  int count = ids.size();
+  fwrite(&count, sizeof(count), 1, fp);
+  for (u64 id : ids) {
+    std::string s = symbol::unintern(id);
+    int len = s.size();
+    fwrite(&len, sizeof(len), 1, fp);
+    fprintf(fp, "%s", s.c_str());
+  }
+}
+
+
+std::vector<u64> serializer::read_symbol_table(void) {
+  std::vector<u64> ids;
+  // each symbol is at least its length
+  size_t count = read_length(sizeof(int));
+  for (size_t i = 0; i < count; i++) {
+    ids.push_back(symbol::intern(read_string()));
+  }
+  return ids;
+}
+
+
 ref cedar::serializer::read(void) {
   // read the first char
   char t;
@@ -233,25 +287,19 @@ ref cedar::serializer::read(void) {
   }
 
   if (t == 's') {
-    int len;
-    READ_INTO(len);
-    std::string s = read_string(fp, len);
+    std::string s = read_string();
     return new string(s);
   }
 
 
   if (t == 'r') {
-    int len;
-    READ_INTO(len);
-    std::string s = read_string(fp, len);
+    std::string s = read_string();
     return new symbol(s);
   }
 
 
   if (t == 'k') {
-    int len;
-    READ_INTO(len);
-    std::string s = read_string(fp, len);
+    std::string s = read_string();
     return new keyword(s);
   }
 
@@ -264,9 +312,9 @@ ref cedar::serializer::read(void) {
 
   if (t == 'v') {
     immer::flex_vector<ref> items;
-    int len;
-    READ_INTO(len);
-    for (int i = 0; i < len; i++) {
+    // each item is at least its type
+    size_t len = read_length(sizeof(char));
+    for (size_t i = 0; i < len; i++) {
       items = items.push_back(read());
     }
     return new vector(items);
@@ -276,10 +324,9 @@ ref cedar::serializer::read(void) {
   if (t == 'd') {
     dict *d = new dict();
     // print the number of items
-    int size;
-    READ_INTO(size);
+    size_t size = read_length(2 * sizeof(char));
 
-    for (int i = 0; i < size; i++) {
+    for (size_t i = 0; i < size; i++) {
       ref k = read();
       ref v = read();
       d->set(k, v);
@@ -292,23 +339,37 @@ ref cedar::serializer::read(void) {
     lambda *l = new lambda();
     l->name = read();
     l->defining = read();
-    READ_INTO(l->arg_index);
     READ_INTO(l->argc);
     READ_INTO(l->vararg);
     vm::bytecode *code = new vm::bytecode();
-    int const_size;
-    READ_INTO(const_size);
+    size_t const_size = read_length(sizeof(char));
 
-    for (int i = 0; i < const_size; i++) {
+    for (size_t i = 0; i < const_size; i++) {
      code->constants.push_back(read());
     }
 
     READ_INTO(code->size);
+    READ_INTO(code->stack_size);
+    READ_INTO(code->slot_count);
+    READ_INTO(code->closure_size);
+    i16 captured_count;
+    READ_INTO(captured_count);
+    if (captured_count < 0)
+      throw std::runtime_error("serialized lambda captures a negative count");
+    code->arg_closure_index.resize(captured_count);
+    read_bytes(code->arg_closure_index.data(), sizeof(i16) * captured_count);
+    code->global_names = read_symbol_table();
+    code->names = read_symbol_table();
+    code->attr_names = read_symbol_table();
+
+    // the code is the last thing, so its size has to be what's left or less
+    long at = ftell(fp);
+    if (end != -1 && at != -1 && code->size > (u64)(end - at))
+      throw std::runtime_error("serialized length is longer than the data");
     code->cap = code->size;
     code->code = new uint8_t[code->cap];
-    READ_INTO(code->stack_size);
-
-    fread(code->code, code->cap, 1, fp);
+    read_bytes(code->code, code->cap);
+    code->allocate_caches();
 
     l->code = code;
     return l;
@@ -0,0 +1,295 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2018 Nick Wanninger
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// numeric kernels over runs of refs. A ref is a value followed by its flags,
+// so a vector load picks up two or more of them at once, an unpack splits
+// the values from the flags, and one compare checks all the flags. Each
+// kernel is built for one instruction set with a target attribute, and the
+// widest one the CPU runs is picked at startup
+
+#include <cedar/object/lambda.h>
+#include <cedar/simd.h>
+#include <immintrin.h>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include "../asmjit/src/asmjit/asmjit.h"
+
+using namespace cedar;
+
+
+static_assert(sizeof(ref) == 16, "the simd kernels need uncompressed refs");
+
+// the flags are a byte, the rest of their word is padding
+#define FLAGS_MASK 0xFF
+#define FLOAT_FLAGS (1 << FLAG_FLOAT)
+#define INT_FLAGS (1 << FLAG_INT)
+
+
+simd::level simd::host_level(void) {
+  static level lvl = [] {
+    auto &cpu = asmjit::CpuInfo::getHost();
+    level l = sse2;
+    if (cpu.hasFeature(asmjit::CpuInfo::kX86FeatureAVX2)) l = avx2;
+    if (cpu.hasFeature(asmjit::CpuInfo::kX86FeatureAVX512_F)) l = avx512;
+    if (const char *cap = getenv("CDRSIMD")) {
+      for (level c : {sse2, avx2}) {
+        if (strcmp(cap, level_name(c)) == 0 && c < l) l = c;
+      }
+    }
+    return l;
+  }();
+  return lvl;
+}
+
+
+const char *simd::level_name(level l) {
+  switch (l) {
+    case sse2:
+      return "sse2";
+    case avx2:
+      return "avx2";
+    case avx512:
+      return "avx512";
+  }
+  return "unknown";
+}
+
+
+
+
+// the tails the vector loops leave, one ref at a time
+static bool sum_floats_scalar(const ref *v, size_t n, double *sum) {
+  double s = 0;
+  for (size_t i = 0; i < n; i++) {
+    ref r = v[i];
+    if (!r.is_flt()) return false;
+    s += r.to_float();
+  }
+  *sum = s;
+  return true;
+}
+
+static bool sum_ints_scalar(const ref *v, size_t n, i64 *sum) {
+  // ints wrap like ref::binary_op's do
+  u64 s = 0;
+  for (size_t i = 0; i < n; i++) {
+    ref r = v[i];
+    if (!r.is_int()) return false;
+    s += (u64)r.to_int();
+  }
+  *sum = (i64)s;
+  return true;
+}
+
+
+
+
+static bool sum_floats_sse2(const ref *v, size_t n, double *sum) {
+  const __m128i mask = _mm_set1_epi64x(FLAGS_MASK);
+  const __m128i want = _mm_set1_epi64x(FLOAT_FLAGS);
+  __m128d acc = _mm_setzero_pd();
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(v + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(v + i + 1));
+    __m128i flags = _mm_and_si128(_mm_unpackhi_epi64(a, b), mask);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(flags, want)) != 0xFFFF)
+      return false;
+    acc = _mm_add_pd(acc, _mm_castsi128_pd(_mm_unpacklo_epi64(a, b)));
+  }
+  double rest;
+  if (!sum_floats_scalar(v + i, n - i, &rest)) return false;
+  double lanes[2];
+  _mm_storeu_pd(lanes, acc);
+  *sum = lanes[0] + lanes[1] + rest;
+  return true;
+}
+
+static bool sum_ints_sse2(const ref *v, size_t n, i64 *sum) {
+  const __m128i mask = _mm_set1_epi64x(FLAGS_MASK);
+  const __m128i want = _mm_set1_epi64x(INT_FLAGS);
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(v + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(v + i + 1));
+    __m128i flags = _mm_and_si128(_mm_unpackhi_epi64(a, b), mask);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(flags, want)) != 0xFFFF)
+      return false;
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi64(a, b));
+  }
+  i64 rest;
+  if (!sum_ints_scalar(v + i, n - i, &rest)) return false;
+  u64 lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  *sum = (i64)(lanes[0] + lanes[1] + (u64)rest);
+  return true;
+}
+
+
+
+
+// 256 bit unpacks work within each 128 bit half, so the values come out of
+// order. That doesn't matter to a sum
+__attribute__((target("avx2"))) static bool sum_floats_avx2(const ref *v,
+                                                             size_t n,
+                                                             double *sum) {
+  const __m256i mask = _mm256_set1_epi64x(FLAGS_MASK);
+  const __m256i want = _mm256_set1_epi64x(FLOAT_FLAGS);
+  __m256d acc = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(v + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(v + i + 2));
+    __m256i flags = _mm256_and_si256(_mm256_unpackhi_epi64(a, b), mask);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(flags, want)) != -1)
+      return false;
+    acc = _mm256_add_pd(acc, _mm256_castsi256_pd(_mm256_unpacklo_epi64(a, b)));
+  }
+  double rest;
+  if (!sum_floats_sse2(v + i, n - i, &rest)) return false;
+  double lanes[4];
+  _mm256_storeu_pd(lanes, acc);
+  *sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + rest;
+  return true;
+}
+
+__attribute__((target("avx2"))) static bool sum_ints_avx2(const ref *v,
+                                                           size_t n,
+                                                           i64 *sum) {
+  const __m256i mask = _mm256_set1_epi64x(FLAGS_MASK);
+  const __m256i want = _mm256_set1_epi64x(INT_FLAGS);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(v + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(v + i + 2));
+    __m256i flags = _mm256_and_si256(_mm256_unpackhi_epi64(a, b), mask);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(flags, want)) != -1)
+      return false;
+    acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi64(a, b));
+  }
+  i64 rest;
+  if (!sum_ints_sse2(v + i, n - i, &rest)) return false;
+  u64 lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  *sum = (i64)(lanes[0] + lanes[1] + lanes[2] + lanes[3] + (u64)rest);
+  return true;
+}
+
+
+
+
+__attribute__((target("avx512f"))) static bool sum_floats_avx512(
+    const ref *v, size_t n, double *sum) {
+  const __m512i mask = _mm512_set1_epi64(FLAGS_MASK);
+  const __m512i want = _mm512_set1_epi64(FLOAT_FLAGS);
+  __m512d acc = _mm512_setzero_pd();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i a = _mm512_loadu_si512((const void *)(v + i));
+    __m512i b = _mm512_loadu_si512((const void *)(v + i + 4));
+    __m512i flags = _mm512_and_si512(_mm512_unpackhi_epi64(a, b), mask);
+    if (_mm512_cmpneq_epi64_mask(flags, want) != 0) return false;
+    acc = _mm512_add_pd(acc, _mm512_castsi512_pd(_mm512_unpacklo_epi64(a, b)));
+  }
+  double rest;
+  if (!sum_floats_avx2(v + i, n - i, &rest)) return false;
+  *sum = _mm512_reduce_add_pd(acc) + rest;
+  return true;
+}
+
+__attribute__((target("avx512f"))) static bool sum_ints_avx512(const ref *v,
+                                                                size_t n,
+                                                                i64 *sum) {
+  const __m512i mask = _mm512_set1_epi64(FLAGS_MASK);
+  const __m512i want = _mm512_set1_epi64(INT_FLAGS);
+  __m512i acc = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i a = _mm512_loadu_si512((const void *)(v + i));
+    __m512i b = _mm512_loadu_si512((const void *)(v + i + 4));
+    __m512i flags = _mm512_and_si512(_mm512_unpackhi_epi64(a, b), mask);
+    if (_mm512_cmpneq_epi64_mask(flags, want) != 0) return false;
+    acc = _mm512_add_epi64(acc, _mm512_unpacklo_epi64(a, b));
+  }
+  i64 rest;
+  if (!sum_ints_avx2(v + i, n - i, &rest)) return false;
+  *sum = (i64)((u64)_mm512_reduce_add_epi64(acc) + (u64)rest);
+  return true;
+}
+
+
+
+
+bool simd::sum_floats(const ref *v, size_t n, double *sum) {
+  static auto kernel = [] {
+    switch (host_level()) {
+      case avx512:
+        return sum_floats_avx512;
+      case avx2:
+        return sum_floats_avx2;
+      default:
+        return sum_floats_sse2;
+    }
+  }();
+  return kernel(v, n, sum);
+}
+
+
+bool simd::sum_ints(const ref *v, size_t n, i64 *sum) {
+  static auto kernel = [] {
+    switch (host_level()) {
+      case avx512:
+        return sum_ints_avx512;
+      case avx2:
+        return sum_ints_avx2;
+      default:
+        return sum_ints_sse2;
+    }
+  }();
+  return kernel(v, n, sum);
+}
+
+
+
+
+static std::mutex unary_lock;
+static std::unordered_map<lambda *, simd::unary> unary_funcs;
+
+
+void simd::register_unary(lambda *fn, unary func) {
+  std::unique_lock<std::mutex> lock(unary_lock);
+  unary_funcs[fn] = func;
+}
+
+
+simd::unary simd::find_unary(lambda *fn) {
+  std::unique_lock<std::mutex> lock(unary_lock);
+  auto it = unary_funcs.find(fn);
+  return it == unary_funcs.end() ? nullptr : it->second;
+}
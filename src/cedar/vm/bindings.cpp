@@ -32,6 +32,8 @@
 #include <cedar/mutex.h>
 #include <cedar/object/bytes.h>
 #include <cedar/objtype.h>
+#include <cedar/passes.h>
+#include <cedar/simd.h>
 #include <cedar/thread.h>
 #include <cedar/vm/binding.h>
 #include <fcntl.h>
@@ -44,6 +46,7 @@
 #include <thread>
 
 #include <gc/gc.h>
+#include <immer/algorithm.hpp>
 
 
 
@@ -77,32 +80,34 @@ cedar_binding(cedar_is) {
 }
 
 
-static void cedar_add(const function_callback &args) {
-  if (args.len() == 0) {
-    args.get_return() = 0;
+cedar_raw_binding(cedar_add) {
+  if (argc == 0) {
+    *ret = 0;
     return;
   }
-  ref accumulator = args[0];
-  for (int i = 1; i < args.len(); i++) {
-    accumulator = accumulator + args[i];
+  ref accumulator = argv[0];
+  for (int i = 1; i < argc; i++) {
+    accumulator = accumulator + argv[i];
   }
 
-  args.get_return() = accumulator;
+  *ret = accumulator;
 }
 
 
-cedar_binding(cedar_sub) {
+cedar_raw_binding(cedar_sub) {
   if (argc == 1) {
-    return ref{-1} * argv[0];
+    *ret = ref{-1} * argv[0];
+    return;
   }
   if (argc == 0) {
-    return 0;
+    *ret = 0;
+    return;
   }
   ref acc = argv[0];
   for (int i = 1; i < argc; i++) {
     acc = acc - argv[i];
   }
-  return acc;
+  *ret = acc;
 }
 
 cedar_binding(cedar_mul) {
@@ -149,22 +154,42 @@ cedar_binding(cedar_pow) {
 }
 
 
-cedar_binding(cedar_equal) {
+cedar_raw_binding(cedar_equal) {
   static ref fls = new symbol("false");
   if (argc < 2)
     throw cedar::make_exception(
         "(= ...) requires at least two arguments, given ", argc);
   ref first = argv[0];
   for (int i = 1; i < argc; i++) {
-    if (argv[i] != first) return fls;
+    if (argv[i] != first) {
+      *ret = fls;
+      return;
+    }
   }
-  return true_value;
+  *ret = true_value;
+}
+
+cedar_raw_binding(cedar_lt) {
+  *ret = argv[0] < argv[1] ? true_value : nullptr;
+}
+cedar_raw_binding(cedar_lte) {
+  *ret = argv[0] <= argv[1] ? true_value : nullptr;
+}
+cedar_raw_binding(cedar_gt) {
+  *ret = argv[0] > argv[1] ? true_value : nullptr;
+}
+cedar_raw_binding(cedar_gte) {
+  *ret = argv[0] >= argv[1] ? true_value : nullptr;
 }
 
-cedar_binding(cedar_lt) { return argv[0] < argv[1] ? true_value : nullptr; }
-cedar_binding(cedar_lte) { return argv[0] <= argv[1] ? true_value : nullptr; }
-cedar_binding(cedar_gt) { return argv[0] > argv[1] ? true_value : nullptr; }
-cedar_binding(cedar_gte) { return argv[0] >= argv[1] ? true_value : nullptr; }
+
+vm::comparison vm::core_comparison(raw_function fn) {
+  if (fn == cedar_lt) return vm::compare_lt;
+  if (fn == cedar_lte) return vm::compare_lte;
+  if (fn == cedar_gt) return vm::compare_gt;
+  if (fn == cedar_gte) return vm::compare_gte;
+  return vm::compare_none;
+}
 
 cedar_binding(cedar_print) {
   for (int i = 0; i < argc; i++) {
@@ -183,12 +208,12 @@ cedar_binding(cedar_println) {
 }
 
 
-cedar_binding(cedar_cons) {
+cedar_raw_binding(cedar_cons) {
   if (argc != 2)
     throw cedar::make_exception("(cons ...) requires two argument, given ",
                                 argc);
 
-  return new list(argv[0], argv[1]);
+  *ret = new list(argv[0], argv[1]);
 }
 
 cedar_binding(cedar_newlist) {
@@ -217,7 +242,7 @@ cedar_binding(cedar_newdict) {
   return d;
 }
 
-cedar_binding(cedar_get) {
+cedar_raw_binding(cedar_get) {
   if (argc < 2 || argc > 3)
     throw cedar::make_exception(
         "(get coll field [default]) requires two or three arguments, given ",
@@ -225,10 +250,12 @@ cedar_binding(cedar_get) {
   ref d = argv[0];
   ref k = argv[1];
   try {
-    return self_call(d, "get", k);
+    *ret = self_call(d, "get", k);
   } catch (...) {
-    if (argc == 3) return argv[2];
-    throw cedar::make_exception("collection has no value at index, '", k, "'");
+    if (argc != 3)
+      throw cedar::make_exception("collection has no value at index, '", k,
+                                  "'");
+    *ret = argv[2];
   }
 }
 
@@ -252,17 +279,69 @@ cedar_binding(cedar_dict_keys) {
   throw cedar::make_exception("(keys) call failed on non-dict");
 }
 
-cedar_binding(cedar_size) {
+cedar_raw_binding(cedar_size) {
   if (argc != 1)
     throw cedar::make_exception("(size ...) requires one arguments, given ",
                                 argc);
-  return self_call(argv[0], "size");
+  *ret = self_call(argv[0], "size");
 }
 
 
 
 cedar_binding(cedar_objcount) { return cedar::object_count; }
 
+
+// a type profile as a dict from each type that was seen to how many times it
+// was seen. A profile that gave up counting also has :megamorphic set
+static ref profile_to_dict(vm::type_profile &p) {
+  static ref megamorphic = new keyword(":megamorphic");
+  dict *d = new dict();
+  for (int i = 0; i < TYPE_PROFILE_WAYS; i++) {
+    type *t = p.types[i].load(std::memory_order_relaxed);
+    if (t == nullptr) break;
+    d->set(t, (i64)p.counts[i].load(std::memory_order_relaxed));
+  }
+  if (p.megamorphic.load(std::memory_order_relaxed))
+    d->set(megamorphic, true_value);
+  return d;
+}
+
+// (profile-types f) returns the type feedback a function has collected: a
+// dict with :args, the profile of each of its arguments, and :invokes, a
+// [method profile] pair for each method call site that has run. Native
+// functions aren't profiled, so they return nil
+cedar_binding(cedar_profile_types) {
+  ERROR_IF_ARGS_PASSED_IS("profile-types", !=, 1);
+  static ref args_kw = new keyword(":args");
+  static ref invokes_kw = new keyword(":invokes");
+
+  lambda *fn = ref_cast<lambda>(argv[0]);
+  if (fn == nullptr || fn->is_native()) return nullptr;
+  vm::bytecode *code = fn->code;
+
+  immer::flex_vector<ref> args;
+  for (int i = 0; i < fn->argc && i < TYPE_PROFILE_ARGS; i++)
+    args = args.push_back(profile_to_dict(code->arg_types[i]));
+
+  immer::flex_vector<ref> invokes;
+  for (size_t i = 0; i < code->attr_names.size(); i++) {
+    auto &site = code->attr_caches[i];
+    // GET_ATTR and SET_ATTR sites never record anything
+    if (site.receivers.types[0].load(std::memory_order_relaxed) == nullptr)
+      continue;
+    symbol *name = new symbol();
+    name->id = site.id;
+    immer::flex_vector<ref> pair;
+    pair = pair.push_back(name).push_back(profile_to_dict(site.receivers));
+    invokes = invokes.push_back(new vector(pair));
+  }
+
+  dict *d = new dict();
+  d->set(args_kw, new vector(args));
+  d->set(invokes_kw, new vector(invokes));
+  return d;
+}
+
 // give a macro expansion for each open option argument
 #define FOREACH_OPEN_OPTION(V) \
   V(O_RDONLY)                  \
@@ -418,6 +497,82 @@ cedar_binding(cedar_throw) {
   throw argv[0];
 }
 
+// (reduce-vector f init v) sums the numbers in v with the core's + in
+// vector registers (see simd.h). It gives back nil when it can't do that
+// natively, and core's reduce does it in cedar instead, so callbacks never
+// run on the C stack where the fiber can't be preempted
+cedar_binding(cedar_reduce_vector) {
+  ERROR_IF_ARGS_PASSED_IS("reduce-vector", !=, 3);
+  ref f = argv[0];
+  ref acc = argv[1];
+  auto *vec = ref_cast<cedar::vector>(argv[2]);
+  if (vec == nullptr)
+    throw cedar::make_exception("(reduce-vector ...) requires a vector, given ",
+                                argv[2]);
+
+  auto *fn = ref_cast<lambda>(f);
+  bool sum = fn != nullptr && fn->code_type == lambda::raw_function_type &&
+             fn->raw_binding == cedar_add;
+  if (!sum || !acc.is_number()) return nullptr;
+  if (vec->size() == 0) return acc;
+
+  // floats can start from anything, but adding ints to a float isn't the
+  // same as adding them up first
+  bool floats = ref(vec->items[0]).is_flt();
+  bool ok = floats || acc.is_int();
+  double fsum = 0;
+  u64 isum = 0;
+  immer::for_each_chunk(vec->items, [&](const ref *first, const ref *last) {
+    if (!ok) return;
+    if (floats) {
+      double s = 0;
+      ok = simd::sum_floats(first, last - first, &s);
+      fsum += s;
+    } else {
+      i64 s = 0;
+      ok = simd::sum_ints(first, last - first, &s);
+      isum += (u64)s;
+    }
+  });
+  if (!ok) return nullptr;
+  if (floats) return acc.to_float() + fsum;
+  return (i64)((u64)acc.to_int() + isum);
+}
+
+
+// (map-vector f v) maps a function with a native version on floats (see
+// simd.h) straight over a vector of numbers, giving back a list like core's
+// map does. Anything else gives back nil, and is left to map in cedar
+cedar_binding(cedar_map_vector) {
+  ERROR_IF_ARGS_PASSED_IS("map-vector", !=, 2);
+  auto *vec = ref_cast<cedar::vector>(argv[1]);
+  if (vec == nullptr)
+    throw cedar::make_exception("(map-vector ...) requires a vector, given ",
+                                argv[1]);
+
+  auto *fn = ref_cast<lambda>(argv[0]);
+  simd::unary native = fn != nullptr ? simd::find_unary(fn) : nullptr;
+  if (native == nullptr) return nullptr;
+
+  std::vector<ref> out;
+  out.reserve(vec->size());
+  bool ok = true;
+  immer::for_each_chunk(vec->items, [&](const ref *first, const ref *last) {
+    for (auto *it = first; ok && it != last; it++) {
+      ref x = *it;
+      ok = x.is_number();
+      if (ok) out.push_back(native(x.to_float()));
+    }
+  });
+  if (!ok) return nullptr;
+
+  ref result = nullptr;
+  for (auto it = out.rbegin(); it != out.rend(); it++)
+    result = new list(*it, result);
+  return result;
+}
+
+
 cedar_binding(cedar_apply) {
   ERROR_IF_ARGS_PASSED_IS("apply", !=, 2);
   ref f = argv[0];
@@ -431,7 +586,7 @@ cedar_binding(cedar_apply) {
       args.push_back(c.first());
     }
 
-    if (fnc->code_type == lambda::function_binding_type) {
+    if (fnc->is_native()) {
       function_callback c(nullptr, i, args.data(), ctx->coro, ctx->mod);
       fnc->call(c);
       return c.get_return();
@@ -444,6 +599,15 @@ cedar_binding(cedar_apply) {
   }
 }
 
+// (is-core* k f): is f still core's function number k. The bytecode compiler
+// turns this into OP_IS_CORE, this is for everything else (the AST JIT)
+cedar_binding(cedar_is_core) {
+  ERROR_IF_ARGS_PASSED_IS("is-core*", !=, 2);
+  i64 k = argv[0].to_int();
+  if (k < 0 || k >= CORE_INLINED_MAX) return nullptr;
+  return is_core_original(k, argv[1]) ? true_value : nullptr;
+}
+
 cedar_binding(cedar_rand) {
   double r = static_cast<double>(rand()) / static_cast<double>(RAND_MAX);
   return r;
@@ -551,7 +715,11 @@ void init_binding(cedar::vm::machine *m) {
   def_global("str", cedar_str);
   def_global("throw", cedar_throw);
   def_global("apply", cedar_apply);
+  def_global("reduce-vector", cedar_reduce_vector);
+  def_global("map-vector", cedar_map_vector);
+  def_global("is-core*", cedar_is_core);
   def_global("cedar/rand", cedar_rand);
+  def_global("profile-types", cedar_profile_types);
   def_global("catch*", cedar_catch);
   def_global("dir", obj_dir);
 
@@ -29,9 +29,16 @@
 #include <cedar/vm/opcode.h>
 #include <unistd.h>
 #include <cedar/objtype.h>
+#include <algorithm>
+#include <climits>
+#include <limits>
 #include <functional>
+#include <unordered_map>
 #include <cedar/ref.h>
 #include <mutex>
+#include <cstdlib>
+#include <iostream>
+#include <set>
 
 using namespace cedar;
 
@@ -45,48 +52,417 @@ int vm::bytecode::push_const(ref val) {
 }
 
 
-static void each_opcode(int size, uint8_t *code,
-                        std::function<void(uint8_t)> func) {
-#define WALK_OVER(type)   \
-  { i += sizeof(type); }; \
-  break;
-  int i = 0;
-  while (i < size) {
-    vm::instruction it;
-    it.address = i;
-    func(code[i++]);
-    switch (it.type()) {
-      case vm::imm_object:
-        WALK_OVER(object *);
-      case vm::imm_float:
-        WALK_OVER(double);
-      case vm::imm_int:
-        WALK_OVER(int64_t);
-      case vm::imm_ptr:
-        WALK_OVER(void *);
-      case vm::imm_byte:
-        WALK_OVER(i8);
-      case vm::no_arg: {
-      }; break;
+// the stack effect of a single (non super) instruction. The calls and RECUR also
+// pop the arguments they were given, which isn't part of the opcode table
+int vm::stack_effect(vm::instruction &in) {
+  int effect = 0;
+  switch (in.op) {
+#define V(name, code, type, eff) \
+  case code:                     \
+    effect = eff;                \
+    break;
+    CEDAR_FOREACH_OPCODE(V)
+#undef V
+  }
+  if (in.op == OP_CALL || in.op == OP_TAIL_CALL || in.op == OP_RECUR)
+    effect -= in.arg_int;
+  if (in.op == OP_INVOKE) effect -= in.arg_count;
+  return effect;
+}
+
+
+// does an instruction do nothing but push a value, so a SKIP of that value
+// can take both of them out
+static bool is_pure_push(u8 op) {
+  switch (op) {
+    case OP_NIL:
+    case OP_CONST:
+    case OP_FLOAT:
+    case OP_INT:
+    case OP_INT_8:
+    case OP_INT_NEG_1:
+    case OP_INT_0:
+    case OP_INT_1:
+    case OP_INT_2:
+    case OP_INT_3:
+    case OP_INT_4:
+    case OP_INT_5:
+    case OP_LOAD_LOCAL:
+    case OP_LOAD_SLOT:
+    case OP_LOAD_SELF:
+    case OP_DUP:
+    case OP_GET_MODULE:
+    case OP_GET_CURRENT_FUNC:
+    case OP_MAKE_FUNC:
+      return true;
+  }
+  return false;
+}
+
+
+// the peephole pass works on the decoded instructions, marking the ones it
+// removes and rewriting others in place, then encodes the ones left over and
+// remaps the jumps. It runs until a round finds nothing to do, as one rewrite
+// often exposes another (dropping a dead SKIP leaves a jump to the next
+// instruction, and so on). Setting CDRNOPEEPHOLE in the environment turns it
+// off, to compare against the unoptimized code. test/peephole/run.sh does
+// that for a corpus of programs and core
+void vm::bytecode::peephole(void) {
+  static bool disabled = getenv("CDRNOPEEPHOLE") != nullptr;
+  static bool dump = getenv("CDRPASSDUMP") != nullptr;
+  if (disabled) return;
+
+  size_t before = 0;
+  size_t after = 0;
+
+  while (true) {
+    auto insts = decode_bytecode(this);
+    size_t n = insts.size();
+    if (before == 0) before = n;
+    after = n;
+    bool changed = false;
+
+    std::unordered_map<u64, size_t> index;
+    for (size_t i = 0; i < n; i++) index[insts[i].address] = i;
+    // the index of the instruction at addr, or n for the end of the code
+    auto index_of = [&](u64 addr) {
+      auto it = index.find(addr);
+      return it == index.end() ? n : it->second;
+    };
+
+    // thread jumps through the unconditional jumps they land on. Only
+    // forward jumps are followed, so a chain always ends
+    for (auto &in : insts) {
+      if (!in.is_jump()) continue;
+      size_t t = index_of(in.arg_int);
+      while (t < n && insts[t].op == OP_JUMP &&
+             (u64)insts[t].arg_int > insts[t].address) {
+        in.arg_int = insts[t].arg_int;
+        t = index_of(in.arg_int);
+        changed = true;
+      }
+      // jumping to a return may as well return
+      if (in.op == OP_JUMP && t < n && insts[t].op == OP_RETURN) {
+        in.op = OP_RETURN;
+        changed = true;
+      }
+    }
+
+    // quoted integers and nil are compiled as constants, but have opcodes
+    // that don't need to load them
+    for (auto &in : insts) {
+      if (in.op != OP_CONST) continue;
+      ref &val = constants[in.arg_int];
+      if (val.is_nil()) {
+        in.op = OP_NIL;
+        changed = true;
+      } else if (val.is_int()) {
+        i64 v = val.to_int();
+        if (v >= -1 && v <= 5) {
+          // the small integer opcodes are laid out in order
+          in.op = OP_INT_0 + v;
+          changed = true;
+        } else if (v >= INT8_MIN && v <= INT8_MAX) {
+          in.op = OP_INT_8;
+          in.arg_int = v;
+          changed = true;
+        }
+      }
+    }
+
+    std::vector<bool> dead(n, true);
+
+    // anything control can't reach from the entry point goes, like the code
+    // after a RETURN
+    std::vector<size_t> work;
+    auto flow = [&](u64 addr) {
+      size_t i = index_of(addr);
+      if (i < n && dead[i]) {
+        dead[i] = false;
+        work.push_back(i);
+      }
+    };
+    if (n != 0) flow(insts[0].address);
+    while (!work.empty()) {
+      auto &in = insts[work.back()];
+      work.pop_back();
+      switch (in.op) {
+        case OP_JUMP:
+          flow(in.arg_int);
+          continue;
+        case OP_JUMP_IF_FALSE:
+          flow(in.arg_int);
+          break;
+        case OP_RETURN:
+        case OP_EXIT:
+        case OP_RECUR:
+          continue;
+      }
+      flow(in.address + 1 + operand_size(in.op));
+    }
+
+    // nothing can be removed from between two instructions if something
+    // jumps to the second one
+    std::set<u64> targets;
+    for (size_t i = 0; i < n; i++)
+      if (!dead[i] && insts[i].is_jump()) targets.insert(insts[i].arg_int);
+
+    for (size_t i = 0; i + 1 < n; i++) {
+      auto &a = insts[i];
+      auto &b = insts[i + 1];
+      if (dead[i] || dead[i + 1] || targets.count(b.address) != 0) continue;
+      // do pushes the value of every expression but the last just to SKIP it
+      if (b.op == OP_SKIP && is_pure_push(a.op)) {
+        dead[i] = dead[i + 1] = true;
+        i++;
+        continue;
+      }
+      // swapping two copies of the same value does nothing
+      if (a.op == OP_DUP && a.arg_int == 1 && b.op == OP_SWAP) {
+        dead[i + 1] = true;
+        i++;
+        continue;
+      }
+      // a body that ends in a call for its effect and then nil, like
+      // (defn log (x) (println x) nil), SKIPs the call's value just to
+      // return. RETURN throws away the rest of the frame anyway
+      if (a.op == OP_SKIP && b.op == OP_NIL && i + 2 < n && !dead[i + 2] &&
+          insts[i + 2].op == OP_RETURN &&
+          targets.count(insts[i + 2].address) == 0) {
+        dead[i] = true;
+        i += 2;
+        continue;
+      }
+    }
+
+    // a jump over nothing (usually left behind by the rewrites above)
+    for (size_t i = 0; i < n; i++) {
+      if (dead[i] || insts[i].op != OP_JUMP) continue;
+      size_t t = index_of(insts[i].arg_int);
+      if (t <= i) continue;
+      bool skips_nothing = true;
+      for (size_t j = i + 1; j < t && skips_nothing; j++)
+        if (!dead[j]) skips_nothing = false;
+      if (skips_nothing) dead[i] = true;
+    }
+
+    for (size_t i = 0; i < n; i++) changed |= dead[i];
+    if (!changed) break;
+
+    bytecode out;
+    // old index -> new address. A removed instruction maps to the address
+    // of the next one that was kept, which runs the same code from there
+    std::vector<u64> new_addr(n + 1);
+    // locations in the new code that hold a jump target from the old code
+    std::vector<std::pair<u64, u64>> fixups;
+    for (size_t i = 0; i < n; i++) {
+      new_addr[i] = out.get_size();
+      if (dead[i]) continue;
+      insts[i].encode(out);
+      if (insts[i].is_jump())
+        fixups.push_back({out.get_size() - sizeof(u32), insts[i].arg_int});
+    }
+    new_addr[n] = out.get_size();
+
+    for (auto &f : fixups) {
+      out.write_to(f.first, (u32)new_addr[index_of(f.second)]);
+    }
+
+    delete[] code;
+    code = out.code;
+    size = out.size;
+    cap = out.cap;
+  }
+
+  if (dump) {
+    std::cerr << ";; peephole (" << before << " -> " << after
+              << " instructions)" << std::endl;
+  }
+}
+
+
+// finalize computes the deepest the operand stack can get while running this
+// bytecode, so a frame can reserve all the stack it needs when it's pushed
+// instead of checking on every instruction. Every path through the code is
+// walked, tracking the depth on entry to each instruction. The compiler only
+// emits forward jumps (loops are done with RECUR), so this terminates
+std::vector<int> vm::stack_depths(std::vector<instruction> &insts,
+                                  int *max_depth, bool *consistent) {
+  std::unordered_map<u64, size_t> index;
+  for (size_t i = 0; i < insts.size(); i++) index[insts[i].address] = i;
+
+  std::vector<int> depth(insts.size(), INT_MIN);
+  std::vector<size_t> work;
+  if (max_depth != nullptr) *max_depth = 0;
+  if (consistent != nullptr) *consistent = true;
+
+  auto flow = [&](u64 addr, int d) {
+    auto it = index.find(addr);
+    // jumping to the end of the code just falls off
+    if (it == index.end()) return;
+    int &known = depth[it->second];
+    if (known != INT_MIN && known != d && consistent != nullptr)
+      *consistent = false;
+    if (d > known) {
+      known = d;
+      work.push_back(it->second);
+    }
+  };
+
+  if (!insts.empty()) flow(insts[0].address, 0);
+
+  while (!work.empty()) {
+    size_t i = work.back();
+    work.pop_back();
+    auto &in = insts[i];
+    int d = depth[i];
+    bool falls_through = true;
+
+    // superinstructions are walked part by part, as the depth in the middle
+    // of one can be deeper than at either end
+    std::vector<instruction> single = {in};
+    auto &parts = in.parts.empty() ? single : in.parts;
+    for (auto &part : parts) {
+      d += stack_effect(part);
+      if (max_depth != nullptr) *max_depth = std::max(*max_depth, d);
+      switch (part.op) {
+        case OP_JUMP:
+          falls_through = false;
+          // fall through
+        case OP_JUMP_IF_FALSE:
+          flow(part.arg_int, d);
+          break;
+        case OP_RETURN:
+        case OP_EXIT:
+        case OP_RECUR:
+          falls_through = false;
+          break;
+      }
     }
+    if (falls_through) flow(in.address + 1 + operand_size(in.op), d);
   }
 
-#undef WALK_OVER
+  return depth;
 }
 
 
 void vm::bytecode::finalize(void) {
-  int stack_effect = 0;
-  each_opcode(size, code, [&stack_effect](uint8_t op) {
-#define V(name, code, type, effect) \
-  case code:                        \
-    stack_effect += effect;         \
-    break;
-    switch (op) { CEDAR_FOREACH_OPCODE(V) }
-#undef V
-  });
+  peephole();
+  fuse_superinstructions(*this);
+
+  auto insts = decode_bytecode(this);
+  int max_depth = 0;
+  stack_depths(insts, &max_depth);
+
+  stack_size = max_depth;
+  allocate_caches();
+}
+
+
+void vm::bytecode::allocate_caches(void) {
+  if (global_caches == nullptr && global_names.size() != 0) {
+    global_caches = new std::atomic<global_cache *>[global_names.size()];
+    for (u32 i = 0; i < global_names.size(); i++) global_caches[i] = nullptr;
+  }
+
+  if (attr_caches == nullptr && attr_names.size() != 0) {
+    attr_caches = new attr_cache[attr_names.size()];
+    for (u32 i = 0; i < attr_names.size(); i++) {
+      attr_caches[i].id = attr_names[i];
+      for (auto &e : attr_caches[i].entries) e = nullptr;
+      attr_caches[i].next = 0;
+    }
+  }
+}
+
+
+u16 vm::bytecode::new_global_cache(u64 id) {
+  if (global_names.size() > UINT16_MAX)
+    throw cedar::make_exception("too many global references in one function");
+  global_names.push_back(id);
+  return global_names.size() - 1;
+}
+
+
+u16 vm::bytecode::new_attr_cache(u64 id) {
+  if (attr_names.size() > UINT16_MAX)
+    throw cedar::make_exception("too many attribute references in one function");
+  attr_names.push_back(id);
+  return attr_names.size() - 1;
+}
+
+
+u16 vm::bytecode::name_index(u64 id) {
+  // functions only reference a handful of names, a linear scan is fine
+  for (u64 i = 0; i < names.size(); i++)
+    if (names[i] == id) return i;
+  if (names.size() > UINT16_MAX)
+    throw cedar::make_exception("too many names referenced in one function");
+  names.push_back(id);
+  return names.size() - 1;
+}
+
+
+template <typename T>
+static T checked_operand(u8 op, i64 arg) {
+  if (arg < (i64)std::numeric_limits<T>::min() ||
+      arg > (i64)std::numeric_limits<T>::max())
+    throw cedar::make_exception("operand ", arg, " is out of range for opcode ",
+                                (int)op);
+  return (T)arg;
+}
+
 
-  stack_size = stack_effect;
+u64 vm::bytecode::write_op(u8 op, i64 arg) {
+  vm::instruction in;
+  in.op = op;
+  auto addr = write((u8)op);
+  switch (in.type()) {
+    case imm_byte:
+      write(checked_operand<u8>(op, arg));
+      break;
+    case imm_i8:
+      write(checked_operand<int8_t>(op, arg));
+      break;
+    case imm_u16:
+      write(checked_operand<u16>(op, arg));
+      break;
+    case imm_u32:
+      write(checked_operand<u32>(op, arg));
+      break;
+    case imm_global:
+      write((u16)new_global_cache(arg));
+      break;
+    case imm_name:
+      write((u16)name_index(arg));
+      break;
+    case imm_attr:
+      write((u16)new_attr_cache(arg));
+      break;
+    case imm_int:
+      write((i64)arg);
+      break;
+    default:
+      throw cedar::make_exception("write_op: opcode ", (int)op,
+                                  " doesn't take an integer operand");
+  }
+  return addr;
+}
+
+
+u64 vm::bytecode::write_invoke(u64 id, i64 argc) {
+  auto addr = write((u8)OP_INVOKE);
+  write((u16)new_attr_cache(id));
+  write(checked_operand<u16>(OP_INVOKE, argc));
+  return addr;
+}
+
+
+u64 vm::bytecode::write_local(u8 op, i64 depth, i64 index) {
+  auto addr = write((u8)op);
+  write(checked_operand<u16>(op, depth));
+  write(checked_operand<u16>(op, index));
+  return addr;
 }
 
 
@@ -95,7 +471,7 @@ void vm::bytecode::print(u8 *ip) {
   auto ins = decode_bytecode(this);
   int path_width = 5;
   for (auto i : ins) {
-    path_width += i.op == OP_JUMP || i.op == OP_JUMP_IF_FALSE;
+    path_width += i.is_jump();
   }
   path_width *= 2;
   std::vector<std::string> paths(ins.size());
@@ -108,7 +484,7 @@ void vm::bytecode::print(u8 *ip) {
   int path_i = 0;
   for (int i = 0; i < icount; i++) {
     auto c = ins[i];
-    bool is_jump = c.op == OP_JUMP || c.op == OP_JUMP_IF_FALSE;
+    bool is_jump = c.is_jump();
     if (is_jump) {
       path_i++;
       int target_index = 0;
@@ -156,23 +532,3 @@ void vm::bytecode::print(u8 *ip) {
     }
   }
 }
-
-
-
-void vm::bytecode::record_call(int argc, ref *argv) {
-  calls_lock.lock();
-  if (argv != nullptr) {
-    std::vector<type *> types;
-    for (int i = 0; i < argc; i++) {
-      types.push_back(argv[i].get_type());
-    }
-    if (calls[types] == 0) {
-      printf("new call: ");
-      for (int i = 0; i < argc; i++) std::cout << ref(argv[i].get_type()) << " ";
-
-      printf("\n");
-    }
-    calls[types]++;
-  }
-  calls_lock.unlock();
-}
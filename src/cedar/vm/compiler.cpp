@@ -40,7 +40,10 @@
 #include <cedar/vm/opcode.h>
 #include <cedar/jit.h>
 #include <cedar/ast.h>
+#include <algorithm>
 #include <memory>
+#include <set>
+#include <unordered_map>
 
 using namespace cedar;
 
@@ -48,22 +51,37 @@ using namespace cedar;
 // scope::
 vm::scope::scope(scope *parent) { m_parent = parent; }
 
-int vm::scope::find(uint64_t symbol) {
-  if (m_bindings.count(symbol) == 1) {
-    return m_bindings.at(symbol);
+vm::binding *vm::scope::find(uint64_t symbol) {
+  if (auto it = m_bindings.find(symbol); it != m_bindings.end()) {
+    return &it->second;
   }
-  // if there is no parent, return -1
-  if (m_parent == nullptr) return -1;
+  // if there is no parent, there is no binding
+  if (m_parent == nullptr) return nullptr;
   // defer to the parent recursively
   return m_parent->find(symbol);
 }
 
-int vm::scope::find(ref &symbol) { return find(symbol.symbol_hash()); }
+vm::binding *vm::scope::find(ref &symbol) {
+  return find(symbol.symbol_hash());
+}
+
+void vm::scope::set(uint64_t symbol, binding b) { m_bindings[symbol] = b; }
+
+void vm::scope::set(ref &symbol, binding b) {
+  m_bindings[symbol.symbol_hash()] = b;
+}
+
 
-void vm::scope::set(uint64_t symbol, int ind) { m_bindings[symbol] = ind; }
 
-void vm::scope::set(ref &symbol, int ind) {
-  m_bindings[symbol.symbol_hash()] = ind;
+// a slot lives in its function's frame, so only that function can use it.
+// Anything a nested function references is put in a closure instead, and
+// finding a slot from another function is a bug in the escape analysis
+static void check_slot_access(vm::binding *b, ref sym, vm::compiler_ctx *ctx) {
+  if (b->slot && b->depth != ctx->fn->depth) {
+    throw cedar::make_exception("compiler error: variable '", sym,
+                                "' was not captured by the nested function "
+                                "that references it");
+  }
 }
 
 
@@ -82,16 +100,23 @@ ref vm::compiler::compile(ref obj, module *mod) {
 
 
 
+  this->mod = mod;
+  obj = optimize(obj, this);
+
   // make a top level bytecode object
   auto code = new vm::bytecode();
   // make the top level scope for this expression
   auto sc = new scope(nullptr);
+  function_state fn;
+  collect_nested_refs(obj, false, fn.nested_refs);
   compiler_ctx context;
+  context.fn = &fn;
   compile_object(obj, *code, sc, &context);
 
   code->write_op(OP_RETURN);
   // code->write_op(OP_EXIT);
-  // finalize the code (sum up stack effect)
+  code->slot_count = fn.max_slots;
+  // finalize the code (optimize it and sum up stack effect)
   code->finalize();
   // build a lambda around the code
   auto lambda = new cedar::lambda(code);
@@ -100,6 +125,95 @@ ref vm::compiler::compile(ref obj, module *mod) {
   return lambda;
 }
 
+// the superinstruction table, sorted so the longest sequences are tried first
+struct superinstruction {
+  u8 op;
+  std::vector<u8> parts;
+};
+
+static std::vector<superinstruction> superinstruction_table(void) {
+  std::vector<superinstruction> table;
+#define SUPER(name, code, size, effect, parts) \
+  table.push_back({code, vm::superinstruction_parts(code)});
+  CEDAR_FOREACH_SUPERINSTRUCTION(SUPER, _);
+#undef SUPER
+  std::stable_sort(table.begin(), table.end(),
+                   [](const superinstruction &a, const superinstruction &b) {
+                     return a.parts.size() > b.parts.size();
+                   });
+  return table;
+}
+
+
+// a peephole pass over finished bytecode that replaces runs of opcodes with
+// a superinstruction doing the same work in one dispatch. A run is only fused
+// if nothing jumps into the middle of it, and since the code shrinks, all the
+// jump targets are remapped afterwards
+void vm::fuse_superinstructions(bytecode &code) {
+  static auto supers = superinstruction_table();
+
+  auto insts = decode_bytecode(&code);
+
+  std::set<u64> targets;
+  for (auto &in : insts)
+    if (in.is_jump()) targets.insert(in.arg_int);
+
+  bytecode out;
+  // old address -> new address
+  std::unordered_map<u64, u64> new_addr;
+  // locations in the new code that hold a jump target from the old code
+  std::vector<std::pair<u64, u64>> fixups;
+
+  // copy the operand bytes of some instruction over verbatim
+  auto copy_operands = [&](instruction &in) {
+    u64 len = operand_size(in.op);
+    // jumps are always the last operand of whatever they are in
+    if (in.is_jump())
+      fixups.push_back({out.get_size() + len - sizeof(u32), in.arg_int});
+    for (u64 b = 0; b < len; b++) out.write(code.code[in.address + 1 + b]);
+  };
+
+  for (size_t i = 0; i < insts.size();) {
+    new_addr[insts[i].address] = out.get_size();
+
+    const superinstruction *match = nullptr;
+    for (auto &sup : supers) {
+      if (i + sup.parts.size() > insts.size()) continue;
+      bool matches = true;
+      for (size_t p = 0; p < sup.parts.size() && matches; p++) {
+        if (insts[i + p].op != sup.parts[p]) matches = false;
+        // can't fuse across something that is jumped to
+        if (p != 0 && targets.count(insts[i + p].address) != 0) matches = false;
+      }
+      if (matches) {
+        match = &sup;
+        break;
+      }
+    }
+
+    if (match != nullptr) {
+      out.write_op(match->op);
+      for (size_t p = 0; p < match->parts.size(); p++) copy_operands(insts[i + p]);
+      i += match->parts.size();
+    } else {
+      out.write_op(insts[i].op);
+      copy_operands(insts[i]);
+      i++;
+    }
+  }
+  new_addr[code.get_size()] = out.get_size();
+
+  for (auto &f : fixups) {
+    out.write_to(f.first, (u32)new_addr.at(f.second));
+  }
+
+  code.code = out.code;
+  code.size = out.size;
+  code.cap = out.cap;
+}
+
+
+
 // helper function for the list compiler for checking if
 // a list is a call to some special form function
 static bool list_is_call_to(cedar::runes func_name, ref &obj) {
@@ -112,6 +226,82 @@ static bool list_is_call_to(cedar::runes func_name, ref &obj) {
   return false;
 }
 
+
+
+ref vm::compiler::expand(ref form) {
+  object *key = form.get();
+  if (auto it = m_expansions.find(key); it != m_expansions.end()) {
+    return it->second;
+  }
+  ref expanded = macroexpand_1(form, mod);
+  m_expansions[key] = expanded;
+  // hold on to the form so its address isn't reused for another one
+  m_expanded_forms.push_back(form);
+  return expanded;
+}
+
+
+
+void vm::compiler::collect_nested_refs(ref form, bool nested,
+                                       std::set<u64> &refs) {
+  if (form.isa(symbol_type)) {
+    if (!nested) return;
+    refs.insert(form.symbol_hash());
+    // dot notation like x.y loads x
+    cedar::runes base;
+    for (auto c : form.to_string(true)) {
+      if (c == '.') {
+        if (base.size() != 0) refs.insert(symbol::intern(base));
+        break;
+      }
+      base += c;
+    }
+    return;
+  }
+
+  if (form.isa(vector_type)) {
+    vector *vec = form.as<vector>();
+    for (int i = 0; i < vec->size(); i++)
+      collect_nested_refs(vec->at(i), nested, refs);
+    return;
+  }
+
+  if (form.isa(dict_type)) {
+    collect_nested_refs(form.as<dict>()->to_constructor_expr(), nested, refs);
+    return;
+  }
+
+  if (!form.isa(list_type)) return;
+
+  if (list_is_call_to("quote", form)) return;
+
+  if (list_is_call_to("fn", form)) {
+    ref rest = form.rest();
+    // skip the name and the parameter list
+    if (rest.first().isa(symbol_type)) rest = rest.rest();
+    for (ref body = rest.rest(); !body.is_nil(); body = body.rest())
+      collect_nested_refs(body.first(), true, refs);
+    return;
+  }
+
+  // let* is compiled into a function call
+  if (list_is_call_to("let*", form)) nested = true;
+
+  if (form.first().isa(symbol_type)) {
+    if (vm::is_macro(form.first().as<symbol>()->id)) {
+      ref expanded = expand(form);
+      if (expanded != form) {
+        collect_nested_refs(expanded, nested, refs);
+        return;
+      }
+    }
+  }
+
+  for (ref it = form; !it.is_nil(); it = it.rest()) {
+    collect_nested_refs(it.first(), nested, refs);
+  }
+}
+
 ///////////////////////////////////////////////////////
 // the entry point for the bytecode pass
 //
@@ -121,18 +311,25 @@ static bool list_is_call_to(cedar::runes func_name, ref &obj) {
 // expected expression will result in undefined behavior
 
 ref cedar::vm::bytecode_pass(ref obj, vm::compiler *c, module *m) {
+  c->mod = m;
+  obj = optimize(obj, c);
+
   // make a top level bytecode object
   auto code = new vm::bytecode();
   // make the top level scope for this expression
   auto sc = new scope(nullptr);
 
+  function_state fn;
+  c->collect_nested_refs(obj, false, fn.nested_refs);
   compiler_ctx context;
+  context.fn = &fn;
 
   c->compile_object(obj, *code, sc, &context);
 
   code->write_op(OP_RETURN);
   code->write_op(OP_EXIT);
-  // finalize the code (sum up stack effect)
+  code->slot_count = fn.max_slots;
+  // finalize the code (optimize it and sum up stack effect)
   code->finalize();
   // build a lambda around the code
   auto lambda = new cedar::lambda(code);
@@ -176,6 +373,16 @@ void vm::compiler::compile_object(ref obj, vm::bytecode &code, scope *sc,
 
 void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
                                 compiler_ctx *ctx) {
+  // nothing this list compiles is in tail position unless a form below
+  // explicitly hands its own position down to a subexpression
+  bool tail = ctx->tail;
+  ctx->tail = false;
+  auto compile_tail = [&](ref expr) {
+    ctx->tail = tail;
+    compile_object(expr, code, sc, ctx);
+    ctx->tail = false;
+  };
+
   //
   if (list_is_call_to("defmacro*", obj)) {
     ref name = obj.rest().first();
@@ -196,18 +403,18 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
     ref fls = obj.rest().rest().first();
     compile_object(cond, code, sc, ctx);
     code.write_op(OP_JUMP_IF_FALSE);
-    i64 false_join_loc = code.write((u64)0);
+    i64 false_join_loc = code.write((u32)0);
     // compile the true expression
-    compile_object(tru, code, sc, ctx);
+    compile_tail(tru);
     // write a jump instruction to jump to after the true expr
     code.write_op(OP_JUMP);
-    i64 true_join_loc = code.write((u64)0);
+    i64 true_join_loc = code.write((u32)0);
     // write to the false instruction's argument where to jump to
-    code.write_to(false_join_loc, code.get_size());
+    code.write_to(false_join_loc, (u32)code.get_size());
     // compile the false expression
-    compile_object(fls, code, sc, ctx);
+    compile_tail(fls);
     // write to the join location jump
-    code.write_to(true_join_loc, code.get_size());
+    code.write_to(true_join_loc, (u32)code.get_size());
     return;
   }
 
@@ -262,10 +469,12 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
 
 
 
-    if (const int ind = sc->find(name_obj); ind != -1) {
+    binding *local = sc->find(name_obj);
+    if (local != nullptr) {
       // is a local assignment
-      opcode = OP_SET_LOCAL;
-      index = ind;
+      check_slot_access(local, name_obj, ctx);
+      opcode = local->slot ? OP_SET_SLOT : OP_SET_LOCAL;
+      index = local->index;
     } else {
       symbol *sym = name_obj.as<symbol>();
       i64 global_ind = sym->id;
@@ -275,13 +484,12 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
     }
     // compile the value onto the stack
     compile_object(val_obj, code, sc, ctx);
+    // and write the storage opcode for it
     if (opcode == OP_SET_LOCAL) {
-      code.write_op(opcode);
-      code.write((u8)index);
-      return;
+      code.write_local(opcode, local->depth, index);
+    } else {
+      code.write_op(opcode, index);
     }
-    // and write the storage opcode for it
-    code.write_op(opcode, index);
     return;
   }
 
@@ -324,6 +532,13 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
     return compile_constant(obj.rest().first(), code, sc, ctx);
   }
 
+  // (is-core* k name), the guard on a call the passes inlined
+  if (list_is_call_to("is-core*", obj)) {
+    compile_object(obj.rest().rest().first(), code, sc, ctx);
+    code.write_op(OP_IS_CORE, obj.rest().first().to_int());
+    return;
+  }
+
   if (list_is_call_to("fn", obj)) {
     return compile_lambda_expression(obj, code, sc, ctx);
   }
@@ -331,8 +546,11 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
   if (list_is_call_to("do", obj)) {
     obj = obj.rest();
     while (true) {
+      if (obj.rest().is_nil()) {
+        compile_tail(obj.first());
+        break;
+      }
       compile_object(obj.first(), code, sc, ctx);
-      if (obj.rest().is_nil()) break;
       code.write_op(OP_SKIP);
       obj = obj.rest();
     }
@@ -351,16 +569,27 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
 
     scope *new_scope = new scope(sc);
 
-    compiler_ctx new_ctx;
-    new_ctx.closure_size = ctx->closure_size;
-    int arg_index = ctx->closure_size;
+    compiler_ctx new_ctx = *ctx;
+    // a tail call replaces the whole frame, so the POP_SCOPE after the
+    // body doesn't stop it from being in tail position
+    new_ctx.tail = tail;
+    int first_slot = ctx->fn->slots;
+    int captured = 0;
 
+    // the variables a nested function references go in a new closure, and
+    // the rest in stack slots above the ones already in use
     for (int i = 0; i < argc; i++) {
       ref arg = vars->get(i);
 
       if (auto *sym = ref_cast<cedar::symbol>(arg); sym != nullptr) {
-        new_scope->set(arg, new_ctx.closure_size);
-        new_ctx.closure_size++;
+        if (ctx->fn->nested_refs.count(sym->id) != 0) {
+          new_scope->set(arg, binding{false, captured++, ctx->closure_depth});
+        } else {
+          int slot = ctx->fn->slots++;
+          ctx->fn->max_slots = std::max(ctx->fn->max_slots, ctx->fn->slots);
+          new_scope->set(arg, binding{true, slot, ctx->fn->depth});
+          code.write_op(OP_CLEAR_SLOT, slot);
+        }
       } else {
         if (arg.is_nil()) {
           throw cedar::make_exception("scope* arguments must be symbols: ",
@@ -369,13 +598,15 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
       }
     }
 
-    code.write_op(OP_INT, arg_index);
-    code.write_op(OP_INT, new_ctx.closure_size);
-    code.write_op(OP_MAKE_SCOPE);
+    if (captured != 0) {
+      code.write_op(OP_MAKE_SCOPE, captured);
+      new_ctx.closure_depth++;
+    }
 
     compile_object(rbody, code, new_scope, &new_ctx);
 
-    code.write_op(OP_POP_SCOPE);
+    if (captured != 0) code.write_op(OP_POP_SCOPE);
+    ctx->fn->slots = first_slot;
     return;
   }
 
@@ -481,7 +712,8 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
         ref method_ref = a.first();
         ref args = a.rest();
 
-        // duplicate the top of the stack
+        // duplicate the top of the stack. The bottom copy is the slot
+        // INVOKE puts the method in, the top one is passed as self
         code.write_op(OP_DUP, 1);
 
         if (!method_ref.isa(symbol_type)) {
@@ -492,9 +724,6 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
 
         auto id = method_ref.as<symbol>()->id;
 
-        code.write_op(OP_GET_ATTR, id);
-        code.write_op(OP_SWAP);
-
         int argc = 1;
 
         while (!args.is_nil()) {
@@ -503,7 +732,7 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
           args = args.rest();
         }
 
-        code.write_op(OP_CALL, argc);
+        code.write_invoke(id, argc);
 
       } else {
         throw cedar::make_exception("invalid syntax in dot special form: ",
@@ -544,7 +773,7 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
     ref call = has_val ? newlist(fn, bval) : newlist(fn);
 
 
-    return compile_object(call, code, sc, ctx);
+    return compile_tail(call);
   }  // end of let construction
 
   if (list_is_call_to("eval", obj)) {
@@ -563,9 +792,9 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
 
 
       if (vm::is_macro(sid)) {
-        ref expanded = macroexpand_1(obj, mod);
+        ref expanded = expand(obj);
         if (expanded != obj) {
-          return compile_object(expanded, code, sc, ctx);
+          return compile_tail(expanded);
         }
       }
     }
@@ -606,7 +835,7 @@ void vm::compiler::compile_list(ref obj, vm::bytecode &code, scope *sc,
     return;
   }
 
-  code.write_op(OP_CALL, argc);
+  code.write_op(tail ? OP_TAIL_CALL : OP_CALL, argc);
 }
 
 
@@ -701,8 +930,11 @@ void vm::compiler::compile_number(ref obj, vm::bytecode &code, scope *,
       code.write_op(OP_INT_5);
       return;
     }
-    code.write_op(OP_INT);
-    code.write(obj.to_int());
+    if (n >= INT8_MIN && n <= INT8_MAX) {
+      code.write_op(OP_INT_8, n);
+      return;
+    }
+    code.write_op(OP_INT, n);
     return;
   }
 }
@@ -795,14 +1027,19 @@ void vm::compiler::compile_symbol(ref sym, bytecode &code, scope *sc,
 
   // if the symbol is found in the enclosing closure/freevars, just push the
   // constant time 'lookup' instruction
-  if (const int ind = sc->find(sym); ind != -1) {
-    code.write_op(OP_LOAD_LOCAL);
-    code.write((u8)ind);
+  if (binding *b = sc->find(sym); b != nullptr) {
+    check_slot_access(b, sym, ctx);
+    if (b->slot) {
+      code.write_op(OP_LOAD_SLOT, b->index);
+    } else {
+      code.write_local(OP_LOAD_LOCAL, b->depth, b->index);
+    }
     return;
   }
   symbol *symb = sym.as<symbol>();
 
-  // grab the symbol from the global scope
+  // grab the symbol from the global scope. Every load site gets it's own
+  // inline cache slot in the bytecode
   code.write_op(OP_LOAD_GLOBAL, symb->id);
 }
 
@@ -845,9 +1082,18 @@ void vm::compiler::compile_lambda_expression(ref expr, bytecode &code,
   }
 
   i32 argc = 0;
-  i32 arg_index = ctx->closure_size;
+  u16 closure_depth = ctx->closure_depth;
   bool vararg = false;
 
+  auto body = expr.rest().rest().first();
+
+  // find the variables that escape into functions nested in this one
+  function_state fn;
+  fn.depth = ctx->lambda_depth;
+  collect_nested_refs(body, false, fn.nested_refs);
+  std::vector<i16> arg_closure_index;
+  int captured = 0;
+
   while (true) {
     if (args.is_nil()) break;
     auto arg = args.first();
@@ -869,8 +1115,16 @@ void vm::compiler::compile_lambda_expression(ref expr, bytecode &code,
     if (arg.is_nil()) break;
 
     if (auto *sym = ref_cast<cedar::symbol>(arg); sym != nullptr) {
-      new_scope->set(arg, ctx->closure_size);
-      ctx->closure_size++;
+      // every argument has a slot, but the captured ones are only stored
+      // in the closure
+      if (fn.nested_refs.count(sym->id) != 0) {
+        new_scope->set(arg, binding{false, captured, closure_depth});
+        arg_closure_index.push_back(captured);
+        captured++;
+      } else {
+        new_scope->set(arg, binding{true, argc, fn.depth});
+        arg_closure_index.push_back(-1);
+      }
       argc++;
       if (vararg && !args.rest().is_nil()) {
         throw cedar::make_exception("function variable arguments invalid: ",
@@ -888,10 +1142,24 @@ void vm::compiler::compile_lambda_expression(ref expr, bytecode &code,
 
   // printf("args: %d\n", argc);
 
-  auto body = expr.rest().rest().first();
+  fn.slots = fn.max_slots = argc;
+  function_state *outer_fn = ctx->fn;
+  ctx->fn = &fn;
+  // a call with captured arguments puts a closure for them on the chain
+  if (captured != 0) ctx->closure_depth++;
 
+  // the body's value is what the function returns
+  bool outer_tail = ctx->tail;
+  ctx->tail = true;
   compile_object(body, *new_code, new_scope, ctx);
+  ctx->tail = outer_tail;
   new_code->write_op(OP_RETURN);
+  ctx->fn = outer_fn;
+  ctx->closure_depth = closure_depth;
+
+  new_code->slot_count = fn.max_slots;
+  new_code->closure_size = captured;
+  if (captured != 0) new_code->arg_closure_index = arg_closure_index;
 
   ctx->lambda_depth--;
 
@@ -901,7 +1169,6 @@ void vm::compiler::compile_lambda_expression(ref expr, bytecode &code,
   auto *new_lambda = new lambda(new_code);
   new_lambda->vararg = vararg;
   new_lambda->argc = argc;
-  new_lambda->arg_index = arg_index;
   new_lambda->name = name;
   new_lambda->defining = expr;
 
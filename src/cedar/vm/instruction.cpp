@@ -25,6 +25,7 @@
 
 
 #include <cedar/object.h>
+#include <cedar/object/symbol.h>
 #include <cedar/vm/instruction.h>
 #include <cedar/vm/bytecode.h>
 #include <cedar/vm/opcode.h>
@@ -61,13 +62,51 @@ bool instruction::encode(bytecode & bc) {
 			break;
 
 		case imm_byte:
+			bc.write<uint8_t>(arg_int);
+			break;
+
+		case imm_i8:
 			bc.write<int8_t>(arg_int);
 			break;
 
+		case imm_u16:
+			bc.write<uint16_t>(arg_int);
+			break;
+
+		case imm_u32:
+			bc.write<uint32_t>(arg_int);
+			break;
+
+		// these operands are an index into one of the bytecode's tables
+		case imm_global:
+		case imm_name:
+		case imm_attr:
+			bc.write<uint16_t>(arg_slot);
+			break;
+
+		case imm_invoke:
+			bc.write<uint16_t>(arg_slot);
+			bc.write<uint16_t>(arg_count);
+			break;
+
+		case imm_local:
+			bc.write<uint16_t>(arg_slot);
+			bc.write<uint16_t>(arg_int);
+			break;
+
 		case imm_ptr:
 			bc.write<void*>(arg_voidptr);
 			break;
 
+		case imm_super:
+			// the parts encode their own operands, minus the opcode byte
+			for (auto &p : parts) {
+				bytecode tmp;
+				p.encode(tmp);
+				for (u64 b = 1; b < tmp.get_size(); b++) bc.write<uint8_t>(tmp.code[b]);
+			}
+			break;
+
 		case no_arg:
 			break;
 	}
@@ -81,6 +120,9 @@ inst_type instruction::type(void) {
 #define OP_CASE(_, code, op_type, effect) case code: return op_type; break;
 		CEDAR_FOREACH_OPCODE(OP_CASE);
 #undef OP_CASE
+#define SUPER_CASE(_, code, size, effect, parts) case code: return imm_super;
+		CEDAR_FOREACH_SUPERINSTRUCTION(SUPER_CASE, _);
+#undef SUPER_CASE
 		default:
 			return no_arg;
 	}
@@ -89,32 +131,143 @@ inst_type instruction::type(void) {
 
 
 
-std::vector<instruction> cedar::vm::decode_bytecode(bytecode* bc) {
-	uint64_t i = 0;
-	std::vector<instruction> insts;
+bool instruction::is_jump(void) {
+	if (op == OP_JUMP || op == OP_JUMP_IF_FALSE) return true;
+	// superinstructions can only have a jump as their last part
+	return !parts.empty() && parts.back().is_jump();
+}
+
+
+
+std::vector<u8> cedar::vm::superinstruction_parts(u8 op) {
+	switch (op) {
+#define SUPER_PART(name) OP_##name,
+#define SUPER_CASE(_, code, size, effect, parts) case code: return { parts };
+		CEDAR_FOREACH_SUPERINSTRUCTION(SUPER_CASE, SUPER_PART);
+#undef SUPER_CASE
+#undef SUPER_PART
+	}
+	return {};
+}
+
+
+
+u64 cedar::vm::inst_type_size(inst_type t) {
+	switch (t) {
+		case imm_object: return sizeof(object*);
+		case imm_float: return sizeof(double);
+		case imm_int: return sizeof(int64_t);
+		case imm_byte: return sizeof(uint8_t);
+		case imm_i8: return sizeof(int8_t);
+		case imm_u16: return sizeof(uint16_t);
+		case imm_u32: return sizeof(uint32_t);
+		case imm_ptr: return sizeof(void*);
+		case imm_global: return sizeof(uint16_t);
+		case imm_name: return sizeof(uint16_t);
+		case imm_attr: return sizeof(uint16_t);
+		case imm_invoke: return 2 * sizeof(uint16_t);
+		case imm_local: return 2 * sizeof(uint16_t);
+		// superinstructions have their size looked up by opcode
+		case imm_super: return 0;
+		case no_arg: return 0;
+	}
+	return 0;
+}
+
+
+
+u64 cedar::vm::operand_size(u8 op) {
+	switch (op) {
+#define OP_CASE(_, code, op_type, effect) \
+		case code: return inst_type_size(op_type);
+		CEDAR_FOREACH_OPCODE(OP_CASE);
+#undef OP_CASE
+#define SUPER_CASE(_, code, size, effect, parts) case code: return size;
+		CEDAR_FOREACH_SUPERINSTRUCTION(SUPER_CASE, _);
+#undef SUPER_CASE
+	}
+	return 0;
+}
+
+
+
+// read the operands of the instruction at `i`, which has already had it's
+// op field set. Leaves `i` pointing at the next instruction
+static void read_operands(bytecode *bc, uint64_t &i, instruction &it) {
 
 #define READ_INTO(field, type) \
 	{ type val = bc->read<type>(i); i += sizeof(val); it.field = val; }; break;
 
+	switch (it.type()) {
+		case imm_object: READ_INTO(arg_object, object*);
+		case imm_float: READ_INTO(arg_float, double);
+		case imm_int: READ_INTO(arg_int, int64_t);
+		case imm_byte: READ_INTO(arg_int, uint8_t);
+		case imm_i8: READ_INTO(arg_int, int8_t);
+		case imm_u16: READ_INTO(arg_int, uint16_t);
+		case imm_u32: READ_INTO(arg_int, uint32_t);
+		case imm_ptr: READ_INTO(arg_voidptr, void*);
+		// table operands are resolved to the symbol id they refer to
+		case imm_global: {
+			it.arg_slot = bc->read<uint16_t>(i);
+			i += sizeof(uint16_t);
+			it.arg_int = bc->global_names.at(it.arg_slot);
+		}; break;
+		case imm_name: {
+			it.arg_slot = bc->read<uint16_t>(i);
+			i += sizeof(uint16_t);
+			it.arg_int = bc->names.at(it.arg_slot);
+		}; break;
+		case imm_attr: {
+			it.arg_slot = bc->read<uint16_t>(i);
+			i += sizeof(uint16_t);
+			it.arg_int = bc->attr_names.at(it.arg_slot);
+		}; break;
+		case imm_invoke: {
+			it.arg_slot = bc->read<uint16_t>(i);
+			i += sizeof(uint16_t);
+			it.arg_int = bc->attr_names.at(it.arg_slot);
+			it.arg_count = bc->read<uint16_t>(i);
+			i += sizeof(uint16_t);
+		}; break;
+		case imm_local: {
+			it.arg_slot = bc->read<uint16_t>(i);
+			i += sizeof(uint16_t);
+			it.arg_int = bc->read<uint16_t>(i);
+			i += sizeof(uint16_t);
+		}; break;
+		case imm_super: {
+			for (u8 part_op : superinstruction_parts(it.op)) {
+				instruction part;
+				part.address = i;
+				part.op = part_op;
+				read_operands(bc, i, part);
+				it.parts.push_back(part);
+			}
+			// expose the jump target so the printer can draw the paths
+			if (it.is_jump()) it.arg_int = it.parts.back().arg_int;
+		}; break;
+		// and no_arg is a nop
+		case no_arg: {}; break;
+	}
+
+#undef READ_INTO
+}
+
+
+
+std::vector<instruction> cedar::vm::decode_bytecode(bytecode* bc) {
+	uint64_t i = 0;
+	std::vector<instruction> insts;
+
 	while (i < bc->get_size()) {
 		instruction it;
 		it.address = i;
 		it.op = bc->read<uint8_t>(i++);
-		switch (it.type()) {
-			case imm_object: READ_INTO(arg_object, object*);
-			case imm_float: READ_INTO(arg_float, double);
-			case imm_int: READ_INTO(arg_int, int64_t);
-			case imm_byte: READ_INTO(arg_int, int8_t);
-			case imm_ptr: READ_INTO(arg_voidptr, void*);
-			// and no_arg is a nop
-			case no_arg: {}; break;
-		}
-
+		read_operands(bc, i, it);
 		insts.push_back(it);
 	}
 
-#undef READ_INTO
-
 	return insts;
 }
 
@@ -131,8 +284,17 @@ std::string cedar::vm::instruction::to_string(uint64_t offset) {
 
 	sprintf(hexbuf, "%-15s ", instruction_name(*this).c_str());
 	buf << hexbuf;
+	buf << operand_string();
+
+	return buf.str();
+}
+
 
 
+std::string cedar::vm::instruction::operand_string(void) {
+	std::ostringstream buf;
+	char hexbuf[22];
+
 	switch (type()) {
 
 		case imm_object:
@@ -143,8 +305,24 @@ std::string cedar::vm::instruction::to_string(uint64_t offset) {
 			buf << arg_float;
 			break;
 
+		case imm_super: {
+				// only print the operands, the name already lists the parts
+				bool first = true;
+				for (auto &p : parts) {
+					std::string ops = p.operand_string();
+					if (ops.empty()) continue;
+					if (!first) buf << ", ";
+					buf << ops;
+					first = false;
+				}
+				break;
+			}
+
 		case imm_int:
-    case imm_byte: {
+		case imm_byte:
+		case imm_i8:
+		case imm_u16:
+		case imm_u32: {
 				if (op == OP_JUMP || op == OP_JUMP_IF_FALSE) {
 					sprintf(hexbuf, "0x%lx", (u64)(arg_int));
 					buf << hexbuf;
@@ -158,6 +336,24 @@ std::string cedar::vm::instruction::to_string(uint64_t offset) {
 			buf << arg_voidptr;
 			break;
 
+		case imm_global:
+		case imm_attr:
+			buf << symbol::unintern(arg_int) << " [ic " << arg_slot << "]";
+			break;
+
+		case imm_invoke:
+			buf << symbol::unintern(arg_int) << " [ic " << arg_slot << "], "
+					<< arg_count;
+			break;
+
+		case imm_local:
+			buf << arg_slot << ", " << arg_int;
+			break;
+
+		case imm_name:
+			buf << symbol::unintern(arg_int);
+			break;
+
 		case no_arg:
 			break;
 	}
@@ -172,6 +368,9 @@ static std::string instruction_name(instruction &i) {
 #define OP_NAME(name, code, op_type, effect) case code: return #name;
 		CEDAR_FOREACH_OPCODE(OP_NAME);
 #undef OP_NAME
+#define SUPER_NAME(name, code, size, effect, parts) case code: return #name;
+		CEDAR_FOREACH_SUPERINSTRUCTION(SUPER_NAME, _);
+#undef SUPER_NAME
 		default:
 			return "unknown";
 	}
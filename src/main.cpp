@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <uv.h>
 #include <chrono>
@@ -73,9 +74,15 @@ int main(int argc, char **argv) {
   try {
     bool interactive = false;
 
-    char c;
+    int c;
 
-    while ((c = getopt(argc, argv, "ihe:")) != -1) {
+    static struct option long_options[] = {
+        {"jit-dump", required_argument, nullptr, 'J'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    while ((c = getopt_long(argc, argv, "ihe:", long_options, nullptr)) !=
+           -1) {
       switch (c) {
         case 'h':
           help();
@@ -92,6 +99,11 @@ int main(int argc, char **argv) {
           return 0;
           break;
         };
+        case 'J':
+          mkdir(optarg, 0755);
+          jit::dump_dir = optarg;
+          break;
+
         default:
           usage();
           exit(-1);
@@ -353,7 +365,9 @@ void hook_color(std::string const &context, Replxx::colors_t &colors,
 
 // print out the usage
 static void usage(void) {
-  printf("usage: cedar [-ih] [-e expression] [files] [args...]\n");
+  printf(
+      "usage: cedar [-ih] [-e expression] [--jit-dump dir] [files] "
+      "[args...]\n");
 }
 
 
@@ -368,6 +382,15 @@ static void help(void) {
   printf("  -i Run in an interactive repl\n");
   printf("  -h Show this help menu\n");
   printf("  -e Evaluate an expression\n");
+  printf("  --jit-dump dir  Write the assembly of JIT compiled code to dir\n");
+  printf("\n");
+  printf("Environment:\n");
+  printf("  CDRNOJIT    Never compile to native code\n");
+  printf("  CDRJITSYNC  Compile hot code on the thread that found it\n");
+  printf("  CDRPERFMAP  Write JIT symbols to /tmp/perf-<pid>.map for perf\n");
+  printf("  CDRGDBJIT   Register JIT code with gdb's JIT interface\n");
+  printf("  CDRCACHE    Keep compiled module caches in this dir\n");
+  printf("  CDRNOCACHE  Don't read or write compiled module caches\n");
   printf("\n");
 }
 
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Runs each program in this directory with the bytecode peephole pass on and
+# off, and fails if any of them print something different. Also reports how
+# many instructions the pass took out of the code each one compiled. Every
+# program loads lib/core/main.cdr first, so empty.cdr's numbers are core's.
+#
+#   test/peephole/run.sh [path to cedar]
+
+cedar=${1:-build/cedar}
+case $cedar in
+  /*) ;;
+  *) cedar=$PWD/$cedar ;;
+esac
+
+# run from the root, where ./lib is on the module path
+cd "$(dirname "$0")/../.." || exit 1
+# a cached core would skip compiling it, and the peephole pass with it
+export CDRNOCACHE=1
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+status=0
+for prog in test/peephole/*.cdr; do
+  name=$(basename "$prog")
+  CDRPASSDUMP=1 "$cedar" "$prog" >"$tmp/on" 2>"$tmp/dump"
+  echo "exit $?" >>"$tmp/on"
+  CDRNOPEEPHOLE=1 "$cedar" "$prog" >"$tmp/off" 2>/dev/null
+  echo "exit $?" >>"$tmp/off"
+
+  if ! diff -u "$tmp/off" "$tmp/on" >"$tmp/diff"; then
+    echo "FAIL $name: output changes with the peephole pass"
+    cat "$tmp/diff"
+    status=1
+    continue
+  fi
+
+  # finalize logs ";; peephole (before -> after instructions)" per bytecode
+  counts=$(sed -n 's/^;; peephole (\([0-9]*\) -> \([0-9]*\) instructions)$/\1 \2/p' \
+             "$tmp/dump" | awk '{ b += $1; a += $2 } END { print b + 0, a + 0 }')
+  set -- $counts
+  # core is big enough that the pass should always find something in it
+  if [ "$2" -gt "$1" ] || { [ "$name" = empty.cdr ] && [ "$2" -eq "$1" ]; }; then
+    echo "FAIL $name: $1 -> $2 instructions"
+    status=1
+    continue
+  fi
+  echo "ok   $name: $1 -> $2 instructions"
+done
+
+exit $status
@@ -18,24 +18,71 @@ footer = """
 
 
 ops = []
+supers = []
+
+# how many operand bytes follow each instruction type in the code stream.
+# Operands are as narrow as the values they hold allow. bytecode::write_op
+# picks the width from this table, and throws if a value doesn't fit
+operand_sizes = {
+    'no_arg': 0,
+    'imm_object': 8,
+    'imm_float': 8,
+    'imm_int': 8,
+    'imm_ptr': 8,
+    'imm_byte': 1,
+    'imm_i8': 1,
+    'imm_u16': 2,
+    'imm_u32': 4,
+    # index into the bytecode's global inline cache table
+    'imm_global': 2,
+    # index into the bytecode's symbol name table
+    'imm_name': 2,
+    # index into the bytecode's attribute inline cache table
+    'imm_attr': 2,
+    # an attribute cache index (u16) followed by an argument count (u16)
+    'imm_invoke': 4,
+    # a closure variable: the depth of its closure in the chain (u16), then
+    # its index in that closure (u16)
+    'imm_local': 4,
+}
 
 # push a new opcode to the list of opcode
-# defaults to having no stack effect
+# defaults to having no stack effect.
+#
+# The effect is what bytecode::finalize uses to compute the maximum stack
+# depth of a function, so it must be exact. The opcodes that pop a variable
+# number of values (CALL, TAIL_CALL, INVOKE and RECUR) don't include the
+# arguments in their effect, finalize subtracts their argc operand itself.
 def new_op(name, inst_type='no_arg', effect=0):
     ops.append((name.upper(), inst_type, effect))
 
 
+# declare a superinstruction: a single opcode that does the work of a fixed
+# sequence of the opcodes above. Their operands are laid out back to back
+# after the fused opcode, and the interpreter handler is built by pasting
+# together the handler bodies of each part. Only the last part may change
+# the instruction pointer or the current frame (CALL, JUMP_IF_FALSE)
+def new_super(*parts):
+    parts = [p.upper() for p in parts]
+    by_name = dict((op[0], op) for op in ops)
+    size = sum(operand_sizes[by_name[p][1]] for p in parts)
+    effect = sum(by_name[p][2] for p in parts)
+    supers.append(('_'.join(parts), size, effect, parts))
+
+
 new_op('NOP', effect=0)
 new_op('NIL', effect=1)
 
 # load the constant at the index
-new_op('CONST', 'imm_int', effect=1)
+new_op('CONST', 'imm_u16', effect=1)
 
 # push a float literal to the stack
 new_op('FLOAT', 'imm_float', effect=1)
 
 
 new_op('INT',   'imm_int', effect=1)
+# small integers that don't have their own opcode below
+new_op('INT_8', 'imm_i8', effect=1)
 
 new_op('INT_NEG_1', effect=1);
 new_op('INT_0', effect=1);
@@ -45,29 +92,42 @@ new_op('INT_3', effect=1);
 new_op('INT_4', effect=1);
 new_op('INT_5', effect=1);
 
-new_op('LOAD_LOCAL', 'imm_byte', effect=1)
-new_op('SET_LOCAL', 'imm_byte', effect=0)
+# variables a nested function closes over live in closures. The compiler knows
+# how deep in the closure chain each one is, and every closure can reach any
+# depth of its chain directly (see closure::m_display)
+new_op('LOAD_LOCAL', 'imm_local', effect=1)
+new_op('SET_LOCAL', 'imm_local', effect=0)
+# everything else lives in a stack slot of the frame that binds it. Arguments
+# are the first slots, scope* variables come after them
+new_op('LOAD_SLOT', 'imm_u16', effect=1)
+new_op('SET_SLOT', 'imm_u16', effect=0)
+# set a slot to nil, a scope* variable starts out unbound
+new_op('CLEAR_SLOT', 'imm_u16', effect=0)
 
 # pop the name off the stack, look it up, then push the value found,
 # otherwise throw because it wasn't found
 #
 # These instructions are used only to access global bindings not found in local scope or
-# freevars
-new_op('LOAD_GLOBAL', 'imm_int', effect=1)
+# freevars. LOAD_GLOBAL also carries an inline cache index (see bytecode.h)
+new_op('LOAD_GLOBAL', 'imm_global', effect=1)
 # SET_GLOBAL pops the name off the stack, then the value off the stack
 #  GLOBALS[POP()] = POP(); PUSH(GLOBALS[...]);
-new_op('SET_GLOBAL', 'imm_int', effect=0)
-new_op('SET_PRIVATE', 'imm_int', effect=0)
+new_op('SET_GLOBAL', 'imm_name', effect=0)
+new_op('SET_PRIVATE', 'imm_name', effect=0)
 
 new_op('CONS', effect=-1)
 new_op('APPEND', effect=-1)
 
-new_op('CALL', 'imm_int', effect=0)
-new_op('CALL_EXCEPTIONAL', 'imm_int', effect=0)
-new_op('MAKE_FUNC', 'imm_int', effect=1)
+new_op('CALL', 'imm_u16', effect=0)
+new_op('CALL_EXCEPTIONAL', 'imm_u16', effect=0)
+# a call in tail position. Bytecode callees take over the current frame,
+# anything else is called normally and the code after it returns the value
+new_op('TAIL_CALL', 'imm_u16', effect=0)
+new_op('MAKE_FUNC', 'imm_u16', effect=1)
 
 
-new_op('MAKE_SCOPE', effect=0);
+# push a new closure with room for some number of variables onto the chain
+new_op('MAKE_SCOPE', 'imm_u16', effect=0);
 new_op('POP_SCOPE', effect=0);
 
 
@@ -75,26 +135,33 @@ new_op('POP_SCOPE', effect=0);
 # at the argument index in the stack call frame
 new_op('ARG_POP', 'imm_int', effect=1);
 
-new_op('RETURN', effect=0);
+new_op('RETURN', effect=-1);
 new_op('EXIT', effect=0);
 
 new_op('SKIP', effect=-1);
 
-new_op('JUMP', 'imm_int', effect=0)
-new_op('JUMP_IF_FALSE', 'imm_int', effect=0)
-new_op('RECUR', 'imm_int', effect=0)
+# jumps hold an absolute offset into the bytecode
+new_op('JUMP', 'imm_u32', effect=0)
+new_op('JUMP_IF_FALSE', 'imm_u32', effect=-1)
+new_op('RECUR', 'imm_u16', effect=0)
 
 
 
-new_op('DUP', 'imm_int', effect=1)
+new_op('DUP', 'imm_byte', effect=1)
 new_op('SWAP', effect=0)
 
-new_op('GET_ATTR', 'imm_int', effect=0);
-new_op('SET_ATTR', 'imm_int', effect=0);
-new_op('DEF_MACRO', 'imm_int', effect=0);
+# attribute access sites each get a polymorphic inline cache
+new_op('GET_ATTR', 'imm_attr', effect=0);
+new_op('SET_ATTR', 'imm_attr', effect=-1);
+# call a method on an object: [slot, obj, args...] -> [result]. The method is
+# looked up on obj through the site's inline cache and stored in the slot,
+# then it's called like CALL with obj as its self, without binding a copy of
+# the method to the object. argc includes obj
+new_op('INVOKE', 'imm_invoke', effect=0);
+new_op('DEF_MACRO', 'imm_name', effect=0);
 new_op('EVAL', effect=0)
 
-new_op('SLEEP', effect=-1)
+new_op('SLEEP', effect=0)
 new_op('GET_MODULE', effect=1)
 
 new_op('ADD', effect=-1)
@@ -107,13 +174,43 @@ new_op('INC', effect=0)
 new_op('LOAD_SELF', effect=1)
 
 new_op('RECV', effect=0)
-new_op('SEND', effect=0)
+new_op('SEND', effect=-1)
 new_op('DICT_SET', effect=-2)
 
+# replace the value on top with true if it's still the core function at the
+# index in core_originals, and nil if not. Guards the calls the passes inline
+new_op('IS_CORE', 'imm_byte', effect=0)
+
 new_op('GET_CURRENT_FUNC', effect=1)
 
 
 
+# superinstructions for the hottest sequences the compiler emits. Function
+# calls push the callee, then the args from left to right, so a call like
+# (f a b) is LOAD_GLOBAL f, LOAD_SLOT a, LOAD_SLOT b, CALL 2
+new_super('LOAD_GLOBAL', 'LOAD_SLOT', 'LOAD_SLOT', 'CALL')
+new_super('LOAD_GLOBAL', 'LOAD_SLOT', 'CALL')
+new_super('LOAD_SLOT', 'LOAD_SLOT', 'CALL')
+new_super('LOAD_SLOT', 'CALL')
+new_super('LOAD_GLOBAL', 'CALL')
+new_super('LOAD_GLOBAL', 'LOAD_SLOT')
+new_super('LOAD_SLOT', 'LOAD_SLOT')
+# (+ a b), (- n 1), (+ n 1)
+new_super('LOAD_SLOT', 'LOAD_SLOT', 'ADD')
+new_super('LOAD_SLOT', 'LOAD_SLOT', 'SUB')
+new_super('LOAD_SLOT', 'DEC')
+new_super('LOAD_SLOT', 'INC')
+# (if x ...)
+new_super('LOAD_SLOT', 'JUMP_IF_FALSE')
+# loops written as tail recursion, (loop (- n 1) acc)
+new_super('LOAD_GLOBAL', 'LOAD_SLOT', 'LOAD_SLOT', 'TAIL_CALL')
+new_super('LOAD_SLOT', 'LOAD_SLOT', 'TAIL_CALL')
+new_super('LOAD_SLOT', 'TAIL_CALL')
+# the guard in front of an inlined core call, (if (is-core* k inc) ...)
+new_super('LOAD_GLOBAL', 'IS_CORE', 'JUMP_IF_FALSE')
+
+
+
 def main(outfile):
     with open(outfile, 'w') as f:
         f.write(header)
@@ -130,6 +227,23 @@ def main(outfile):
             if i < len(ops)-1:
                 f.write(" \\")
             f.write("\n")
+
+        f.write("\n")
+        f.write("/* Superinstructions, each runs a fixed sequence of opcodes */\n")
+        for i, sup in enumerate(supers):
+            f.write("#define OP_%-24s 0x%02x\n" % (sup[0], len(ops) + i))
+
+        f.write("\n")
+        f.write("/* Superinstruction foreach macro for code generation */\n")
+        f.write("/* Arg order: (name, bytecode, operand bytes, stack effect, parts)\n")
+        f.write("   where parts is a sequence of P(name) for each fused opcode */\n")
+        f.write("#define CEDAR_FOREACH_SUPERINSTRUCTION(V, P) \\\n")
+        for i, sup in enumerate(supers):
+            parts = ' '.join('P(%s)' % p for p in sup[3])
+            f.write("  V(%s, OP_%s, %d, %d, %s)" % (sup[0], sup[0], sup[1], sup[2], parts))
+            if i < len(supers)-1:
+                f.write(" \\")
+            f.write("\n")
         f.write(footer)
 
 